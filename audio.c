@@ -1,5 +1,62 @@
 #include "audio.h"
 
+// REALTIME DEBUG CHECKS
+// Build with -DTAPE_SIM_RT_DEBUG to abort whenever this file allocates, frees
+// or opens a file from inside the audio callback.
+#ifdef TAPE_SIM_RT_DEBUG
+_Thread_local bool insideAudioCallback = false;
+
+void abortIfInsideAudioCallback(const char *call, const char *file, int line)
+{
+  if (insideAudioCallback)
+  {
+    fprintf(stderr, "RT violation: %s called from the audio thread at %s:%d\n", call, file, line);
+    abort();
+  }
+}
+
+void *rtCheckedMalloc(size_t size, const char *file, int line)
+{
+  abortIfInsideAudioCallback("malloc", file, line);
+  return malloc(size);
+}
+
+void *rtCheckedCalloc(size_t count, size_t size, const char *file, int line)
+{
+  abortIfInsideAudioCallback("calloc", file, line);
+  return calloc(count, size);
+}
+
+void *rtCheckedRealloc(void *pointer, size_t size, const char *file, int line)
+{
+  abortIfInsideAudioCallback("realloc", file, line);
+  return realloc(pointer, size);
+}
+
+void rtCheckedFree(void *pointer, const char *file, int line)
+{
+  abortIfInsideAudioCallback("free", file, line);
+  free(pointer);
+}
+
+FILE *rtCheckedFopen(const char *path, const char *mode, const char *file, int line)
+{
+  abortIfInsideAudioCallback("fopen", file, line);
+  return fopen(path, mode);
+}
+
+#define malloc(size) rtCheckedMalloc(size, __FILE__, __LINE__)
+#define calloc(count, size) rtCheckedCalloc(count, size, __FILE__, __LINE__)
+#define realloc(pointer, size) rtCheckedRealloc(pointer, size, __FILE__, __LINE__)
+#define free(pointer) rtCheckedFree(pointer, __FILE__, __LINE__)
+#define fopen(path, mode) rtCheckedFopen(path, mode, __FILE__, __LINE__)
+#define enterAudioCallback() (insideAudioCallback = true)
+#define leaveAudioCallback() (insideAudioCallback = false)
+#else
+#define enterAudioCallback()
+#define leaveAudioCallback()
+#endif
+
 // UTILITY FUNCTIONS
 void separatePathFromTitle(const char *selectedPath, char **dirPath, char **trackTitle)
 {
@@ -23,24 +80,21 @@ void separatePathFromTitle(const char *selectedPath, char **dirPath, char **trac
   }
 }
 
-// For calculating db levels
-float calculateRMS(const unsigned char *buffer, size_t framesPerBuffer)
+uint64_t monotonicMs()
 {
-  float sum = 0.0;
-  for (size_t i = 0; i < framesPerBuffer; i++)
-  {
-    int sample24bit = (buffer[3 * i + 2] << 16) | (buffer[3 * i + 1] << 8) | buffer[3 * i];
-    if (sample24bit & 0x800000)
-    {                           // if the highest bit is set, the sample is negative
-      sample24bit |= ~0xFFFFFF; // extend the sign to 32 bits
-    }
-    float sampleFloat = sample24bit / (float)0x800000; // Normalize by the maximum possible value of a 24-bit int
-    sum += sampleFloat * sampleFloat;
-  }
-  float rms = sqrt(sum / framesPerBuffer);
-  return rms;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+double elapsedSeconds(struct timespec start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
 }
 
+// For calculating db levels
 float rmsToDb(float rms)
 {
   // Ensure rms is positive but non-zero to avoid log10(0)
@@ -50,636 +104,6993 @@ float rmsToDb(float rms)
   return dbFS; // This will naturally yield negative values for rms < 1
 }
 
-int calculateAudioDuration(size_t audioDataSize, int channels)
+uint64_t secondsToFrames(double seconds)
 {
-  size_t bytesPerSample = bitDepth / 8;
-  int durationInSeconds = (int)audioDataSize / (bytesPerSample * sampleRate * channels);
-  return durationInSeconds;
+  return (uint64_t)(seconds * sampleRate);
 }
 
-size_t calculateBufferSize(int channels, int durationInSeconds)
+// SAMPLE FORMATS
+// Each format gets its own copy of every loop, stamped out by SAMPLE_KERNELS from
+// that format's load and store functions, so the per-sample work inlines to a few
+// instructions. The session picks one table entry per block of samples.
+static inline float loadInt16(const unsigned char *sample)
 {
-  size_t bytesPerSample = bitDepth / 8;
-  size_t samplesPerChannel = (size_t)(sampleRate * durationInSeconds);
-  size_t totalBufferSize = samplesPerChannel * bytesPerSample * channels;
-  return totalBufferSize;
+  int16_t value;
+  memcpy(&value, sample, 2);
+  return value * (1.0f / 32768.0f);
 }
 
-void mixMonoTrackToStereoBuffer(WavFile *monoTrack, unsigned char *stereoBuffer, size_t bufferSize, int channel)
+static inline float loadInt24(const unsigned char *sample)
 {
-  fseek(monoTrack->file, 0, SEEK_END);
-  long fileSize = ftell(monoTrack->file);
-  rewind(monoTrack->file);
+  // left align the 3 bytes in an int32 so the sign comes along without a branch
+  int32_t value = (int32_t)((uint32_t)sample[0] << 8 | (uint32_t)sample[1] << 16 | (uint32_t)sample[2] << 24);
+  return value * (1.0f / 2147483648.0f);
+}
 
-  long dataLength = fileSize - 44;
-  long numSamples = dataLength / 3;
+static inline float loadInt32(const unsigned char *sample)
+{
+  int32_t value;
+  memcpy(&value, sample, 4);
+  return value * (1.0f / 2147483648.0f);
+}
 
-  fseek(monoTrack->file, 44, SEEK_SET);
-  unsigned char sample[3];
+static inline float loadFloat32(const unsigned char *sample)
+{
+  float value;
+  memcpy(&value, sample, 4);
+  return value;
+}
 
-  for (long i = 0; i < numSamples; i++)
-  {
-    size_t offset = 6 * i + 3 * channel;
-    if (offset + 3 > bufferSize)
-    {
-      break;
-    }
+// integer stores scale by the same power of two the loads divide by, so a sample
+// that goes to float and back comes out bit for bit the same
+static inline float clampScaled(float value, float low, float high)
+{
+  return value < low ? low : (value > high ? high : value);
+}
 
-    fread(sample, 1, 3, monoTrack->file);
-    memcpy(stereoBuffer + offset, sample, 3);
-  }
+static inline void storeInt16(unsigned char *sample, float value)
+{
+  int16_t scaled = (int16_t)lrintf(clampScaled(value * 32768.0f, -32768.0f, 32767.0f));
+  memcpy(sample, &scaled, 2);
 }
 
-float getCurrentStartTimeInSeconds()
+static inline void storeInt24(unsigned char *sample, float value)
 {
-  return startTimeInSeconds;
+  int32_t scaled = (int32_t)lrintf(clampScaled(value * 8388608.0f, -8388608.0f, 8388607.0f));
+  sample[0] = scaled;
+  sample[1] = scaled >> 8;
+  sample[2] = scaled >> 16;
 }
 
-void updateStartTime(float time)
+static inline void storeInt32(unsigned char *sample, float value)
 {
-  startTimeInSeconds = time;
+  double scaled = value * 2147483648.0;
+  scaled = scaled < -2147483648.0 ? -2147483648.0 : (scaled > 2147483647.0 ? 2147483647.0 : scaled);
+  int32_t rounded = (int32_t)lrint(scaled);
+  memcpy(sample, &rounded, 4);
 }
 
-float getCurrentAmplitude(unsigned int index)
+static inline void storeFloat32(unsigned char *sample, float value)
 {
-  return recorder.tracks[index].currentAmplitudeLevel;
+  memcpy(sample, &value, 4);
 }
 
-void onSetInputTrackRecordEnabled(unsigned int index, bool state)
+// left aligned int32 samples keep integer conversions exact
+static inline void storeLeftInt16(unsigned char *sample, int32_t value)
 {
-  if (state == 1)
-  {
-    recorder.tracks[index].recordEnabled = true;
+  sample[0] = (uint32_t)value >> 16;
+  sample[1] = (uint32_t)value >> 24;
+}
+
+static inline void storeLeftInt24(unsigned char *sample, int32_t value)
+{
+  sample[0] = (uint32_t)value >> 8;
+  sample[1] = (uint32_t)value >> 16;
+  sample[2] = (uint32_t)value >> 24;
+}
+
+static inline void storeLeftInt32(unsigned char *sample, int32_t value)
+{
+  memcpy(sample, &value, 4);
+}
+
+static inline void storeLeftFloat32(unsigned char *sample, int32_t value)
+{
+  storeFloat32(sample, value * (1.0f / 2147483648.0f));
+}
+
+#define SAMPLE_KERNELS(NAME, BYTES)                                                        \
+  float rms##NAME(const unsigned char *buffer, size_t frames)                              \
+  {                                                                                        \
+    float sum = 0.0;                                                                       \
+    for (size_t i = 0; i < frames; i++)                                                    \
+    {                                                                                      \
+      float sample = load##NAME(buffer + i * (BYTES));                                     \
+      sum += sample * sample;                                                              \
+    }                                                                                      \
+    return sqrt(sum / frames);                                                             \
+  }                                                                                        \
+                                                                                           \
+  void toFloat##NAME(const unsigned char *source, float *destination, size_t count)        \
+  {                                                                                        \
+    for (size_t i = 0; i < count; i++)                                                     \
+    {                                                                                      \
+      destination[i] = load##NAME(source + i * (BYTES));                                   \
+    }                                                                                      \
+  }                                                                                        \
+                                                                                           \
+  void fromFloat##NAME(const float *source, unsigned char *destination, size_t count)      \
+  {                                                                                        \
+    for (size_t i = 0; i < count; i++)                                                     \
+    {                                                                                      \
+      store##NAME(destination + i * (BYTES), source[i]);                                   \
+    }                                                                                      \
+  }                                                                                        \
+                                                                                           \
+  void fromInt32##NAME(const int32_t *source, unsigned char *destination, size_t count)    \
+  {                                                                                        \
+    for (size_t i = 0; i < count; i++)                                                     \
+    {                                                                                      \
+      storeLeft##NAME(destination + i * (BYTES), source[i]);                               \
+    }                                                                                      \
   }
-  else
+
+SAMPLE_KERNELS(Int16, 2)
+SAMPLE_KERNELS(Int24, 3)
+SAMPLE_KERNELS(Int32, 4)
+SAMPLE_KERNELS(Float32, 4)
+
+SampleKernels sampleKernelTable[SAMPLE_FORMAT_COUNT] = {
+    [SAMPLE_INT16] = {2, paInt16, WAVE_FORMAT_PCM, rmsInt16, toFloatInt16, fromFloatInt16, fromInt32Int16},
+    [SAMPLE_INT24] = {3, paInt24, WAVE_FORMAT_PCM, rmsInt24, toFloatInt24, fromFloatInt24, fromInt32Int24},
+    [SAMPLE_INT32] = {4, paInt32, WAVE_FORMAT_PCM, rmsInt32, toFloatInt32, fromFloatInt32, fromInt32Int32},
+    [SAMPLE_FLOAT32] = {4, paFloat32, WAVE_FORMAT_IEEE_FLOAT, rmsFloat32, toFloatFloat32, fromFloatFloat32, fromInt32Float32},
+};
+
+const SampleKernels *sampleKernels = &sampleKernelTable[SAMPLE_INT24];
+
+// only while stopped: tracks in another format are handled by formatMismatchPolicy
+// the next time they are opened
+void setSampleFormat(SampleFormat format)
+{
+  if (format < 0 || format >= SAMPLE_FORMAT_COUNT)
   {
-    recorder.tracks[index].recordEnabled = false;
+    return;
   }
+  sampleFormat = format;
+  sampleKernels = &sampleKernelTable[format];
+  bitDepth = sampleKernels->bytesPerSample * 8;
 }
 
-void openWavFile(WavFile *wav, char *filename, char *directoryPath, short numChannels)
+float calculateRMS(const unsigned char *buffer, size_t framesPerBuffer)
 {
-  char *filePath = malloc(strlen(directoryPath) + strlen(filename) + 2); // +2 for '/' and '\0'
-  sprintf(filePath, "%s/%s", directoryPath, filename);
+  return sampleKernels->rms(buffer, framesPerBuffer);
+}
 
-  bool fileExists = access(filePath, F_OK) != -1;
+// SIMD CONVERSION
+// The callback moves every block between the device's packed 24 bit samples and
+// the float bus, so those two conversions get vector versions: SSSE3 and AVX2 on
+// x86 (chosen at runtime from what the CPU supports) and NEON on arm64, where it
+// is always present. Each loop stops early enough that no vector load or store
+// touches memory past the block, and the scalar kernel finishes the tail. Results
+// are identical to the scalar loops.
+#if defined(__x86_64__) || defined(__i386__)
+// moves the three bytes of each of 4 samples to the top of a 32 bit lane
+#define INT24_UNPACK_MASK _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11)
+// and back, packing 4 samples into the low 12 bytes
+#define INT24_PACK_MASK _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1)
 
-  int headerSize = 44;
-  int subchunk1Size = 16; // PCM
-  short audioFormat = 1;  // No compression
-  int byteRate = sampleRate * numChannels * (bitDepth / 8);
-  short blockAlign = numChannels * (bitDepth / 8);
-  int zero = 0;
+__attribute__((target("ssse3"))) void int24ToFloatSSSE3(const unsigned char *source, float *destination, size_t count)
+{
+  const __m128i mask = INT24_UNPACK_MASK;
+  const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+  size_t i = 0;
+  for (; i + 6 <= count; i += 4) // a 16 byte load for 12 bytes of samples
+  {
+    __m128i packed = _mm_loadu_si128((const __m128i *)(source + i * 3));
+    __m128i samples = _mm_shuffle_epi8(packed, mask);
+    _mm_storeu_ps(destination + i, _mm_mul_ps(_mm_cvtepi32_ps(samples), scale));
+  }
+  toFloatInt24(source + i * 3, destination + i, count - i);
+}
 
-  wav->file = fopen(filePath, fileExists ? "r+b" : "wb");
-  if (!wav->file)
+__attribute__((target("ssse3"))) void floatToInt24SSSE3(const float *source, unsigned char *destination, size_t count)
+{
+  const __m128i mask = INT24_PACK_MASK;
+  const __m128 scale = _mm_set1_ps(8388608.0f);
+  const __m128 low = _mm_set1_ps(-8388608.0f);
+  const __m128 high = _mm_set1_ps(8388607.0f);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
   {
-    perror("Failed to open file");
-    free(filePath);
-    return;
+    __m128 scaled = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(source + i), scale), low), high);
+    __m128i packed = _mm_shuffle_epi8(_mm_cvtps_epi32(scaled), mask);
+    _mm_storel_epi64((__m128i *)(destination + i * 3), packed);
+    int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+    memcpy(destination + i * 3 + 8, &last, 4);
   }
+  fromFloatInt24(source + i, destination + i * 3, count - i);
+}
 
-  if (!fileExists)
+__attribute__((target("avx2"))) void int24ToFloatAVX2(const unsigned char *source, float *destination, size_t count)
+{
+  const __m256i mask = _mm256_broadcastsi128_si256(INT24_UNPACK_MASK);
+  const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+  size_t i = 0;
+  for (; i + 10 <= count; i += 8) // the upper load ends 4 bytes past its samples
   {
-    wav->dataSize = 0;
+    const unsigned char *block = source + i * 3;
+    __m256i packed = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)block)),
+                                             _mm_loadu_si128((const __m128i *)(block + 12)), 1);
+    __m256i samples = _mm256_shuffle_epi8(packed, mask);
+    _mm256_storeu_ps(destination + i, _mm256_mul_ps(_mm256_cvtepi32_ps(samples), scale));
+  }
+  int24ToFloatSSSE3(source + i * 3, destination + i, count - i);
+}
 
-    // Write proper RIFF header
-    fwrite("RIFF", 1, 4, wav->file); // ChunkID
-    fwrite(&zero, 4, 1, wav->file);  // ChunkSize (placeholder)
-    fwrite("WAVE", 1, 4, wav->file); // Format
+__attribute__((target("avx2"))) void floatToInt24AVX2(const float *source, unsigned char *destination, size_t count)
+{
+  const __m256i mask = _mm256_broadcastsi128_si256(INT24_PACK_MASK);
+  const __m256 scale = _mm256_set1_ps(8388608.0f);
+  const __m256 low = _mm256_set1_ps(-8388608.0f);
+  const __m256 high = _mm256_set1_ps(8388607.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256 scaled = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(source + i), scale), low), high);
+    __m256i packed = _mm256_shuffle_epi8(_mm256_cvtps_epi32(scaled), mask);
+    unsigned char lanes[32];
+    _mm256_storeu_si256((__m256i *)lanes, packed);
+    memcpy(destination + i * 3, lanes, 12);
+    memcpy(destination + i * 3 + 12, lanes + 16, 12);
+  }
+  floatToInt24SSSE3(source + i, destination + i * 3, count - i);
+}
+#elif defined(__aarch64__)
+void int24ToFloatNEON(const unsigned char *source, float *destination, size_t count)
+{
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    uint8x8x3_t bytes = vld3_u8(source + i * 3); // deinterleaves low, middle and high bytes
+    uint16x8_t low = vorrq_u16(vmovl_u8(bytes.val[0]), vshll_n_u8(bytes.val[1], 8));
+    uint16x8_t high = vmovl_u8(bytes.val[2]);
+    uint32x4_t first = vorrq_u32(vshlq_n_u32(vmovl_u16(vget_low_u16(high)), 24), vshlq_n_u32(vmovl_u16(vget_low_u16(low)), 8));
+    uint32x4_t second = vorrq_u32(vshlq_n_u32(vmovl_u16(vget_high_u16(high)), 24), vshlq_n_u32(vmovl_u16(vget_high_u16(low)), 8));
+    vst1q_f32(destination + i, vmulq_n_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(first)), 1.0f / 2147483648.0f));
+    vst1q_f32(destination + i + 4, vmulq_n_f32(vcvtq_f32_s32(vreinterpretq_s32_u32(second)), 1.0f / 2147483648.0f));
+  }
+  toFloatInt24(source + i * 3, destination + i, count - i);
+}
 
-    fwrite("fmt ", 1, 4, wav->file);         // Subchunk1ID
-    fwrite(&subchunk1Size, 4, 1, wav->file); // Subchunk1Size
-    fwrite(&audioFormat, 2, 1, wav->file);   // AudioFormat
-    fwrite(&numChannels, 2, 1, wav->file);   // NumChannels
-    fwrite(&sampleRate, 4, 1, wav->file);    // SampleRate
-    fwrite(&byteRate, 4, 1, wav->file);      // ByteRate
-    fwrite(&blockAlign, 2, 1, wav->file);    // BlockAlign
-    fwrite(&bitDepth, 2, 1, wav->file);      // BitsPerSample
+void floatToInt24NEON(const float *source, unsigned char *destination, size_t count)
+{
+  const float32x4_t low = vdupq_n_f32(-8388608.0f);
+  const float32x4_t high = vdupq_n_f32(8388607.0f);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    int32x4_t first = vcvtnq_s32_f32(vminq_f32(vmaxq_f32(vmulq_n_f32(vld1q_f32(source + i), 8388608.0f), low), high));
+    int32x4_t second = vcvtnq_s32_f32(vminq_f32(vmaxq_f32(vmulq_n_f32(vld1q_f32(source + i + 4), 8388608.0f), low), high));
+    uint8x8x3_t bytes;
+    bytes.val[0] = vmovn_u16(vcombine_u16(vmovn_u32(vreinterpretq_u32_s32(first)), vmovn_u32(vreinterpretq_u32_s32(second))));
+    bytes.val[1] = vmovn_u16(vcombine_u16(vshrn_n_u32(vreinterpretq_u32_s32(first), 8), vshrn_n_u32(vreinterpretq_u32_s32(second), 8)));
+    bytes.val[2] = vmovn_u16(vcombine_u16(vshrn_n_u32(vreinterpretq_u32_s32(first), 16), vshrn_n_u32(vreinterpretq_u32_s32(second), 16)));
+    vst3_u8(destination + i * 3, bytes); // interleaves them back
+  }
+  fromFloatInt24(source + i, destination + i * 3, count - i);
+}
+#endif
 
-    fwrite("data", 1, 4, wav->file); // Subchunk2ID
-    fwrite(&zero, 4, 1, wav->file);  // Subchunk2Size (placeholder)
+// swaps the vector converters into the 24 bit table entry where the CPU has them
+void dispatchSampleKernels()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    sampleKernelTable[SAMPLE_INT24].toFloat = int24ToFloatAVX2;
+    sampleKernelTable[SAMPLE_INT24].fromFloat = floatToInt24AVX2;
   }
-  else
+  else if (__builtin_cpu_supports("ssse3"))
   {
-    fseek(wav->file, 0, SEEK_END);
-    size_t currentFileSize = ftell(wav->file);
-    wav->dataSize = currentFileSize - headerSize;
+    sampleKernelTable[SAMPLE_INT24].toFloat = int24ToFloatSSSE3;
+    sampleKernelTable[SAMPLE_INT24].fromFloat = floatToInt24SSSE3;
+  }
+#elif defined(__aarch64__)
+  sampleKernelTable[SAMPLE_INT24].toFloat = int24ToFloatNEON;
+  sampleKernelTable[SAMPLE_INT24].fromFloat = floatToInt24NEON;
+#endif
+}
 
-    // Seek to overwrite position
-    size_t bytesPerSample = (bitDepth / 8) * numChannels;
-    size_t sampleOffset = (size_t)(sampleRate * startTimeInSeconds);
-    size_t byteOffset = sampleOffset * bytesPerSample;
-    size_t overwriteStartPos = headerSize + byteOffset;
+// METERING
+// One pass over every metered track's bus block per callback, measuring peak, sum
+// of squares and clip count together. The vector versions keep a partial result
+// per lane and combine the lanes at the end of each block, so their sums can
+// differ from the scalar loop in the last bits.
+#define METER_CLIP_LEVEL (1.0f - 1.0f / 32768) // within one 16 bit step of full scale
 
-    fseek(wav->file, overwriteStartPos, SEEK_SET);
+void meterBlocksScalar(const float *const *blocks, size_t blockCount, size_t frames, MeterReading *readings)
+{
+  for (size_t b = 0; b < blockCount; b++)
+  {
+    const float *samples = blocks[b];
+    float peak = 0;
+    float sum = 0;
+    uint32_t clips = 0;
+    for (size_t i = 0; i < frames; i++)
+    {
+      float magnitude = fabsf(samples[i]);
+      peak = magnitude > peak ? magnitude : peak;
+      sum += samples[i] * samples[i];
+      clips += magnitude >= METER_CLIP_LEVEL;
+    }
+    readings[b] = (MeterReading){peak, sum, clips};
   }
-
-  free(filePath);
 }
 
-void initTracks(const uint32_t *inputTrackRecordEnabledStates)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) void meterBlocksSSE2(const float *const *blocks, size_t blockCount, size_t frames, MeterReading *readings)
 {
-  for (size_t i = 0; i < recorder.trackCount; i++)
+  const __m128 signMask = _mm_set1_ps(-0.0f);
+  const __m128 clipLevel = _mm_set1_ps(METER_CLIP_LEVEL);
+  for (size_t b = 0; b < blockCount; b++)
   {
-    char filename[20];
-    snprintf(filename, sizeof(filename), "track%zu.wav", i + 1);
-    openWavFile(&recorder.tracks[i], filename, appDirPath, 1);
-
-    if (inputTrackRecordEnabledStates && inputTrackRecordEnabledStates[i] == 1)
+    const float *samples = blocks[b];
+    __m128 peak = _mm_setzero_ps();
+    __m128 sum = _mm_setzero_ps();
+    __m128i clips = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4)
     {
-      recorder.tracks[i].recordEnabled = true;
+      __m128 value = _mm_loadu_ps(samples + i);
+      __m128 magnitude = _mm_andnot_ps(signMask, value);
+      peak = _mm_max_ps(peak, magnitude);
+      sum = _mm_add_ps(sum, _mm_mul_ps(value, value));
+      clips = _mm_sub_epi32(clips, _mm_castps_si128(_mm_cmpge_ps(magnitude, clipLevel))); // true lanes are -1
     }
-    else
+    float peakLanes[4], sumLanes[4];
+    uint32_t clipLanes[4];
+    _mm_storeu_ps(peakLanes, peak);
+    _mm_storeu_ps(sumLanes, sum);
+    _mm_storeu_si128((__m128i *)clipLanes, clips);
+    MeterReading tail;
+    const float *rest = samples + i;
+    meterBlocksScalar(&rest, 1, frames - i, &tail);
+    for (int lane = 0; lane < 4; lane++)
     {
-      recorder.tracks[i].recordEnabled = false;
+      tail.peak = peakLanes[lane] > tail.peak ? peakLanes[lane] : tail.peak;
+      tail.sumOfSquares += sumLanes[lane];
+      tail.clipCount += clipLanes[lane];
     }
-
-    recorder.tracks[i].currentAmplitudeLevel = -100; //  a minimum signal level for now
+    readings[b] = tail;
   }
 }
 
-void writeWavData(WavFile *wav, const void *data, size_t dataSize)
+__attribute__((target("avx2"))) void meterBlocksAVX2(const float *const *blocks, size_t blockCount, size_t frames, MeterReading *readings)
 {
-  // Write the new data
-  fwrite(data, 1, dataSize, wav->file);
-
-  // Determine the position after writing
-  size_t newPosition = ftell(wav->file);
-
-  // Update dataSize based on whether the new data extends beyond the original dataSize
-  size_t newDataSize = newPosition - 44; // Subtract header size to get audio data size
-  if (newDataSize > wav->dataSize)
+  const __m256 signMask = _mm256_set1_ps(-0.0f);
+  const __m256 clipLevel = _mm256_set1_ps(METER_CLIP_LEVEL);
+  for (size_t b = 0; b < blockCount; b++)
   {
-    wav->dataSize = newDataSize;
+    const float *samples = blocks[b];
+    __m256 peak = _mm256_setzero_ps();
+    __m256 sum = _mm256_setzero_ps();
+    __m256i clips = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= frames; i += 8)
+    {
+      __m256 value = _mm256_loadu_ps(samples + i);
+      __m256 magnitude = _mm256_andnot_ps(signMask, value);
+      peak = _mm256_max_ps(peak, magnitude);
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(value, value));
+      clips = _mm256_sub_epi32(clips, _mm256_castps_si256(_mm256_cmp_ps(magnitude, clipLevel, _CMP_GE_OQ)));
+    }
+    float peakLanes[8], sumLanes[8];
+    uint32_t clipLanes[8];
+    _mm256_storeu_ps(peakLanes, peak);
+    _mm256_storeu_ps(sumLanes, sum);
+    _mm256_storeu_si256((__m256i *)clipLanes, clips);
+    MeterReading tail;
+    const float *rest = samples + i;
+    meterBlocksScalar(&rest, 1, frames - i, &tail);
+    for (int lane = 0; lane < 8; lane++)
+    {
+      tail.peak = peakLanes[lane] > tail.peak ? peakLanes[lane] : tail.peak;
+      tail.sumOfSquares += sumLanes[lane];
+      tail.clipCount += clipLanes[lane];
+    }
+    readings[b] = tail;
   }
-
-  // Note: wav->dataSize is initially set based on the file's original dataSize when opened
 }
-
-void closeWavFile(WavFile *wav)
+#elif defined(__aarch64__)
+void meterBlocksNEON(const float *const *blocks, size_t blockCount, size_t frames, MeterReading *readings)
 {
-  size_t finalDataSize = wav->dataSize;
-
-  // Move to the start of the file size field
-  fseek(wav->file, 4, SEEK_SET);
-  int fileSizeMinus8 = finalDataSize + 36; // Size of 'WAVEfmt ' and 'data' headers plus dataSize
-  fwrite(&fileSizeMinus8, sizeof(fileSizeMinus8), 1, wav->file);
+  const float32x4_t clipLevel = vdupq_n_f32(METER_CLIP_LEVEL);
+  for (size_t b = 0; b < blockCount; b++)
+  {
+    const float *samples = blocks[b];
+    float32x4_t peak = vdupq_n_f32(0);
+    float32x4_t sum = vdupq_n_f32(0);
+    uint32x4_t clips = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 4 <= frames; i += 4)
+    {
+      float32x4_t value = vld1q_f32(samples + i);
+      float32x4_t magnitude = vabsq_f32(value);
+      peak = vmaxq_f32(peak, magnitude);
+      sum = vmlaq_f32(sum, value, value);
+      clips = vsubq_u32(clips, vcgeq_f32(magnitude, clipLevel)); // true lanes are all ones
+    }
+    MeterReading tail;
+    const float *rest = samples + i;
+    meterBlocksScalar(&rest, 1, frames - i, &tail);
+    float lanePeak = vmaxvq_f32(peak);
+    tail.peak = lanePeak > tail.peak ? lanePeak : tail.peak;
+    tail.sumOfSquares += vaddvq_f32(sum);
+    tail.clipCount += vaddvq_u32(clips);
+    readings[b] = tail;
+  }
+}
+#endif
 
-  // Move to the start of the data size field
-  fseek(wav->file, 40, SEEK_SET);
-  fwrite(&finalDataSize, sizeof(finalDataSize), 1, wav->file);
+void (*meterBlocks)(const float *const *blocks, size_t blockCount, size_t frames, MeterReading *readings) = meterBlocksScalar;
 
-  fclose(wav->file);
+void dispatchMeterKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    meterBlocks = meterBlocksAVX2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    meterBlocks = meterBlocksSSE2;
+  }
+#elif defined(__aarch64__)
+  meterBlocks = meterBlocksNEON;
+#endif
 }
 
-void closeWavFiles()
+// INTERLEAVING
+// Packs one block from each of channelCount mono tracks into interleaved frames,
+// for bouncing and multichannel export. 24 bit samples have vector versions:
+// SSSE3 with a dedicated stereo shuffle and, for any other count, channels taken
+// four at a time through a 4x4 transpose; NEON for stereo. Whatever the vector
+// loop does not cover goes through the scalar loop.
+void interleaveSamplesScalar(const unsigned char *const *sources, size_t channelCount, size_t bytesPerSample,
+                             unsigned char *destination, size_t firstChannel, size_t lastChannel, size_t firstFrame, size_t frames)
 {
-  for (size_t i = 0; i < recorder.trackCount; i++)
+  size_t frameBytes = channelCount * bytesPerSample;
+  for (size_t channel = firstChannel; channel < lastChannel; channel++)
   {
-    closeWavFile(&recorder.tracks[i]);
+    const unsigned char *source = sources[channel] + firstFrame * bytesPerSample;
+    unsigned char *out = destination + firstFrame * frameBytes + channel * bytesPerSample;
+    for (size_t i = firstFrame; i < frames; i++)
+    {
+      memcpy(out, source, bytesPerSample);
+      source += bytesPerSample;
+      out += frameBytes;
+    }
   }
 }
 
-static int streamCallback(const void *inputBuffer, void *outputBuffer,
-                          unsigned long framesPerBuffer,
-                          const PaStreamCallbackTimeInfo *timeInfo,
-                          PaStreamCallbackFlags statusFlags,
-                          void *userData)
+void interleaveInt24Scalar(const unsigned char *const *sources, size_t channelCount, unsigned char *destination, size_t frames)
 {
-  const unsigned char **inputBuffers = (const unsigned char **)inputBuffer;
-  unsigned char **outputBuffers = (unsigned char **)outputBuffer;
-  size_t minReadFrames = framesPerBuffer;                   // Initialize with the maximum possible
-  unsigned char *writeBuffer = malloc(framesPerBuffer * 3); // Allocate buffer
+  interleaveSamplesScalar(sources, channelCount, 3, destination, 0, channelCount, 0, frames);
+}
 
-  for (size_t channel = 0; channel < recorder.trackCount; ++channel)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3"))) void interleaveInt24SSSE3(const unsigned char *const *sources, size_t channelCount, unsigned char *destination, size_t frames)
+{
+  size_t vectorFrames = frames >= 6 ? (frames - 2) & ~(size_t)3 : 0; // 16 byte loads stay inside each block
+  if (channelCount == 2)
   {
-    if (isRecording)
+    // 4 frames: 12 bytes from each side make 24 interleaved bytes
+    const __m128i leftLow = _mm_setr_epi8(0, 1, 2, -1, -1, -1, 3, 4, 5, -1, -1, -1, 6, 7, 8, -1);
+    const __m128i rightLow = _mm_setr_epi8(-1, -1, -1, 0, 1, 2, -1, -1, -1, 3, 4, 5, -1, -1, -1, 6);
+    const __m128i leftHigh = _mm_setr_epi8(-1, -1, 9, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i rightHigh = _mm_setr_epi8(7, 8, -1, -1, -1, 9, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1);
+    for (size_t i = 0; i < vectorFrames; i += 4)
     {
-      if (recorder.tracks[channel].recordEnabled)
-      {
-        // set db amplitude levels
-        float rms = calculateRMS(inputBuffers[channel], framesPerBuffer);
-        float dbLevel = rmsToDb(rms);
-        printf("Recording - Channel %d: dB Level = %f\n", channel, dbLevel);
-        recorder.tracks[channel].currentAmplitudeLevel = dbLevel;
-        // channel data and write buffer for wav
-        const unsigned char *channelData = inputBuffers[channel];
-        // Accumulate the samples for the current channel into writeBuffer
-        for (unsigned long frame = 0; frame < framesPerBuffer; ++frame)
-        {
-          int byteIndex = frame * 3;
-          memcpy(&writeBuffer[frame * 3], &channelData[byteIndex], 3);
-        }
-        // Now, writeBuffer contains all the frames for the current channel, so write it all at once
-        writeWavData(&recorder.tracks[channel], writeBuffer, framesPerBuffer * 3);
-      }
+      __m128i left = _mm_loadu_si128((const __m128i *)(sources[0] + i * 3));
+      __m128i right = _mm_loadu_si128((const __m128i *)(sources[1] + i * 3));
+      unsigned char *out = destination + i * 6;
+      _mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_shuffle_epi8(left, leftLow), _mm_shuffle_epi8(right, rightLow)));
+      _mm_storel_epi64((__m128i *)(out + 16), _mm_or_si128(_mm_shuffle_epi8(left, leftHigh), _mm_shuffle_epi8(right, rightHigh)));
     }
-    else // Handle Playback for non record enabled tracks
-    {
-      float dbLevel = -100; // Default to a very low dB level if no data is read
-      size_t readFrames = 0;
-
-      for (size_t frame = 0; frame < framesPerBuffer; ++frame)
-      {
-        if (recorder.playbackPosition + frame < recorder.tracks[channel].dataSize / 3)
-        {
-          uint8_t sampleBytes[3];
-          if (fread(sampleBytes, sizeof(uint8_t), 3, recorder.tracks[channel].file) == 3)
-          {
-            memcpy(&outputBuffers[channel][frame * 3], sampleBytes, 3);
-            readFrames++;
-          }
-          else
-          {
-            memset(&outputBuffers[channel][frame * 3], 0, 3); // Fail-safe clear in case of read failure
-          }
-        }
-        else
-        {
-          memset(&outputBuffers[channel][frame * 3], 0, 3); // Zero out the buffer beyond data size
-        }
-      }
+    interleaveSamplesScalar(sources, 2, 3, destination, 0, 2, vectorFrames, frames);
+    return;
+  }
 
-      if (readFrames > 0)
+  // 4 channels by 4 frames: widen each channel's samples to 32 bit lanes, transpose
+  // so each register holds one frame, and pack that back to 12 bytes
+  const __m128i unpack = INT24_UNPACK_MASK;
+  const __m128i pack = _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+  size_t frameBytes = channelCount * 3;
+  size_t groupChannels = channelCount & ~(size_t)3;
+  for (size_t channel = 0; channel < groupChannels; channel += 4)
+  {
+    for (size_t i = 0; i < vectorFrames; i += 4)
+    {
+      __m128 rows[4];
+      for (int c = 0; c < 4; c++)
       {
-        float rms = calculateRMS(outputBuffers[channel], readFrames);
-        dbLevel = rmsToDb(rms);
+        __m128i packed = _mm_loadu_si128((const __m128i *)(sources[channel + c] + i * 3));
+        rows[c] = _mm_castsi128_ps(_mm_shuffle_epi8(packed, unpack));
       }
-      printf("Playback - Channel %d: dB Level = %f\n", channel, dbLevel);
-      recorder.tracks[channel].currentAmplitudeLevel = dbLevel;
-
-      // Determine the minimum readFrames across all channels for playback tracking
-      if (readFrames < minReadFrames)
+      _MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+      for (int f = 0; f < 4; f++)
       {
-        minReadFrames = readFrames;
+        __m128i frame = _mm_shuffle_epi8(_mm_castps_si128(rows[f]), pack);
+        unsigned char *out = destination + (i + f) * frameBytes + channel * 3;
+        _mm_storel_epi64((__m128i *)out, frame);
+        int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(frame, 8));
+        memcpy(out + 8, &last, 4);
       }
     }
   }
-
-  // free the write buffer
-  free(writeBuffer);
-
-  // Update the start time to reflect the current playback position
-  float timeIncrement = (float)framesPerBuffer / sampleRate;
-  startTimeInSeconds += timeIncrement;
-
-  return paContinue;
+  interleaveSamplesScalar(sources, channelCount, 3, destination, groupChannels, channelCount, 0, vectorFrames);
+  interleaveSamplesScalar(sources, channelCount, 3, destination, 0, channelCount, vectorFrames, frames);
 }
-
-void initStream()
+#elif defined(__aarch64__)
+void interleaveInt24NEON(const unsigned char *const *sources, size_t channelCount, unsigned char *destination, size_t frames)
 {
-  // stop if no input device
-  int inputDevice = Pa_GetDefaultInputDevice();
-  if (inputDevice == -1)
+  if (channelCount != 2)
   {
-    printf("Error: No default input device found!");
-    exit(EXIT_FAILURE);
+    interleaveInt24Scalar(sources, channelCount, destination, frames);
+    return;
   }
+  // a stereo frame is three 16 bit pairs (L0 L1)(L2 R0)(R1 R2), so after splitting
+  // both sides into byte planes vst3 on 16 bit lanes writes 8 whole frames
+  size_t i = 0;
+  for (; i + 8 <= frames; i += 8)
+  {
+    uint8x8x3_t left = vld3_u8(sources[0] + i * 3);
+    uint8x8x3_t right = vld3_u8(sources[1] + i * 3);
+    uint8x8x2_t first = vzip_u8(left.val[0], left.val[1]);
+    uint8x8x2_t second = vzip_u8(left.val[2], right.val[0]);
+    uint8x8x2_t third = vzip_u8(right.val[1], right.val[2]);
+    uint16x8x3_t pairs;
+    pairs.val[0] = vreinterpretq_u16_u8(vcombine_u8(first.val[0], first.val[1]));
+    pairs.val[1] = vreinterpretq_u16_u8(vcombine_u8(second.val[0], second.val[1]));
+    pairs.val[2] = vreinterpretq_u16_u8(vcombine_u8(third.val[0], third.val[1]));
+    vst3q_u16((uint16_t *)(destination + i * 6), pairs);
+  }
+  interleaveSamplesScalar(sources, 2, 3, destination, 0, 2, i, frames);
+}
+#endif
 
-  PaError err;
-  // Stream parameters
-  PaStreamParameters inputParameters;
-  inputParameters.channelCount = recorder.trackCount;
-  inputParameters.device = inputDevice;                                                                // or another specific device
-  inputParameters.sampleFormat = paInt24 | paNonInterleaved;                                           // Correct way to combine flags
-  inputParameters.suggestedLatency = Pa_GetDeviceInfo(inputParameters.device)->defaultLowInputLatency; // lowest latency
-  inputParameters.hostApiSpecificStreamInfo = NULL;
-
-  // Setup output parameters
-  PaStreamParameters outputParameters;
-  outputParameters.device = Pa_GetDefaultOutputDevice();
-  outputParameters.channelCount = recorder.trackCount;                                                   // Number of tracks
-  outputParameters.sampleFormat = paInt24 | paNonInterleaved;                                            // Correct way to combine flags
-  outputParameters.suggestedLatency = Pa_GetDeviceInfo(outputParameters.device)->defaultLowInputLatency; // lowest latency
-  outputParameters.hostApiSpecificStreamInfo = NULL;
-
-  printf("Initializing stream with %d channels.\n", recorder.trackCount); // Typically NULL
+void (*interleaveInt24)(const unsigned char *const *sources, size_t channelCount, unsigned char *destination, size_t frames) = interleaveInt24Scalar;
 
-  // start PA audio stream
-  err = Pa_OpenStream(
-      &stream,
-      &inputParameters,
-      &outputParameters,
-      sampleRate,
-      frames,
-      paClipOff, // or other relevant flags. Note: paNonInterleaved is NOT set here
-      streamCallback,
-      NULL // User data passed to callback
-  );
-  if (err != paNoError)
+void dispatchInterleaveKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3"))
   {
-    printf("PortAudio error: %s\n", Pa_GetErrorText(err));
-    exit(EXIT_FAILURE);
+    interleaveInt24 = interleaveInt24SSSE3;
   }
-
-  // Calculate playback start position based on startTimeInSeconds
-  // Assuming each sample in the buffer corresponds to a frame of audio
-  size_t startPosition = (size_t)(sampleRate * startTimeInSeconds);
-  recorder.playbackPosition = startPosition;
+#elif defined(__aarch64__)
+  interleaveInt24 = interleaveInt24NEON;
+#endif
 }
 
-void onRewind()
+// interleaves in the session format
+void interleaveSamples(const unsigned char *const *sources, size_t channelCount, unsigned char *destination, size_t frames)
 {
-  if (startTimeInSeconds > 0.1)
+  size_t bytesPerSample = bitDepth / 8;
+  if (bytesPerSample == 3)
   {
-    startTimeInSeconds -= 0.1;
+    interleaveInt24(sources, channelCount, destination, frames);
   }
   else
   {
-    startTimeInSeconds = 0.0;
+    interleaveSamplesScalar(sources, channelCount, bytesPerSample, destination, 0, channelCount, 0, frames);
   }
 }
 
-void onFastForward()
+// SUMMING
+// destination += source * gain, the inner loop of mixing
+void accumulateScaledScalar(float *destination, const float *source, float gain, size_t count)
 {
-  // Adjust time forwards by 0.1 seconds, with 216000 seconds as 60 hours
-  if (startTimeInSeconds < 216000 - 0.1)
-  {
-    startTimeInSeconds += 0.1;
-  }
-  else
+  for (size_t i = 0; i < count; i++)
   {
-    // Optionally loop around or cap at 216000
-    startTimeInSeconds = 216000;
+    destination[i] += source[i] * gain;
   }
 }
 
-void onRtz()
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) void accumulateScaledSSE2(float *destination, const float *source, float gain, size_t count)
 {
-  updateStartTime(0.00);
+  const __m128 scale = _mm_set1_ps(gain);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128 sum = _mm_add_ps(_mm_loadu_ps(destination + i), _mm_mul_ps(_mm_loadu_ps(source + i), scale));
+    _mm_storeu_ps(destination + i, sum);
+  }
+  accumulateScaledScalar(destination + i, source + i, gain, count - i);
 }
 
-void onStop()
+__attribute__((target("avx2"))) void accumulateScaledAVX2(float *destination, const float *source, float gain, size_t count)
 {
-  Pa_StopStream(stream);
-  Pa_CloseStream(stream);
-  closeWavFiles();
+  const __m256 scale = _mm256_set1_ps(gain);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256 sum = _mm256_add_ps(_mm256_loadu_ps(destination + i), _mm256_mul_ps(_mm256_loadu_ps(source + i), scale));
+    _mm256_storeu_ps(destination + i, sum);
+  }
+  accumulateScaledScalar(destination + i, source + i, gain, count - i);
 }
-
-void onStart(const uint32_t *inputTrackRecordEnabledStates, bool isRecordingFromUI)
+#elif defined(__aarch64__)
+void accumulateScaledNEON(float *destination, const float *source, float gain, size_t count)
 {
-  PaError err;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4)
+  {
+    vst1q_f32(destination + i, vmlaq_n_f32(vld1q_f32(destination + i), vld1q_f32(source + i), gain));
+  }
+  accumulateScaledScalar(destination + i, source + i, gain, count - i);
+}
+#endif
 
-  isRecording = isRecordingFromUI;
+void (*accumulateScaled)(float *destination, const float *source, float gain, size_t count) = accumulateScaledScalar;
 
-  initTracks(inputTrackRecordEnabledStates);
-  initStream();
+void dispatchMixKernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    accumulateScaled = accumulateScaledAVX2;
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    accumulateScaled = accumulateScaledSSE2;
+  }
+#elif defined(__aarch64__)
+  accumulateScaled = accumulateScaledNEON;
+#endif
+}
 
-  err = Pa_StartStream(stream);
-  if (err != paNoError)
+// RING BUFFERS
+bool initRingBuffer(RingBuffer *ring, size_t capacity)
+{
+  ring->data = malloc(capacity);
+  if (ring->data == NULL)
   {
-    printf("PortAudio error: %s\n", Pa_GetErrorText(err));
-    exit(EXIT_FAILURE);
+    ring->capacity = 0;
+    return false;
   }
+  ring->capacity = capacity;
+  atomic_store(&ring->writeIndex, 0);
+  atomic_store(&ring->readIndex, 0);
+  atomic_store(&ring->peakFill, 0);
+  atomic_store(&ring->overflowCount, 0);
+  return true;
 }
 
-// MACOS
-AudioDeviceID getDefaultMacOSInputDeviceID()
+void freeRingBuffer(RingBuffer *ring)
 {
-  AudioDeviceID deviceID = kAudioObjectUnknown;
-  UInt32 dataSize = sizeof(deviceID);
-  AudioObjectPropertyAddress propertyAddress = {
-      kAudioHardwarePropertyDefaultInputDevice,
-      kAudioObjectPropertyScopeGlobal,
-      kAudioObjectPropertyElementMaster};
+  free(ring->data);
+  ring->data = NULL;
+  ring->capacity = 0;
+}
 
-  OSStatus status = AudioObjectGetPropertyData(kAudioObjectSystemObject,
-                                               &propertyAddress,
-                                               0,
-                                               NULL,
-                                               &dataSize,
-                                               &deviceID);
-  if (status != noErr)
+// only safe while neither side is running
+void resetRingBuffer(RingBuffer *ring)
+{
+  atomic_store(&ring->writeIndex, 0);
+  atomic_store(&ring->readIndex, 0);
+  atomic_store(&ring->peakFill, 0);
+  atomic_store(&ring->overflowCount, 0);
+}
+
+size_t ringBufferFill(RingBuffer *ring)
+{
+  size_t writeIndex = atomic_load_explicit(&ring->writeIndex, memory_order_acquire);
+  size_t readIndex = atomic_load_explicit(&ring->readIndex, memory_order_acquire);
+  return writeIndex - readIndex;
+}
+
+// producer side: writes all of the data or none of it, never blocks
+bool ringBufferWrite(RingBuffer *ring, const unsigned char *data, size_t size)
+{
+  size_t writeIndex = atomic_load_explicit(&ring->writeIndex, memory_order_relaxed);
+  size_t readIndex = atomic_load_explicit(&ring->readIndex, memory_order_acquire);
+  size_t fill = writeIndex - readIndex;
+
+  if (size > ring->capacity - fill)
   {
-    fprintf(stderr, "Failed to get the default macos input device ID\n");
-    exit(EXIT_FAILURE);
+    atomic_fetch_add_explicit(&ring->overflowCount, 1, memory_order_relaxed);
+    return false;
   }
 
-  return deviceID; // Return the default input device ID
+  size_t start = writeIndex % ring->capacity;
+  size_t firstPart = ring->capacity - start;
+  if (firstPart > size)
+  {
+    firstPart = size;
+  }
+  memcpy(ring->data + start, data, firstPart);
+  memcpy(ring->data, data + firstPart, size - firstPart);
+
+  atomic_store_explicit(&ring->writeIndex, writeIndex + size, memory_order_release);
+
+  if (fill + size > atomic_load_explicit(&ring->peakFill, memory_order_relaxed))
+  {
+    atomic_store_explicit(&ring->peakFill, fill + size, memory_order_relaxed);
+  }
+  return true;
 }
 
-AudioDeviceID getDefaultMacOSOutputDeviceID()
+// producer side: writes as many of size bytes of zeros as fit, returns how many
+size_t ringBufferWriteSilence(RingBuffer *ring, size_t size)
 {
-  AudioDeviceID deviceID = kAudioObjectUnknown;
-  UInt32 dataSize = sizeof(deviceID);
-  AudioObjectPropertyAddress propertyAddress = {
-      kAudioHardwarePropertyDefaultOutputDevice,
-      kAudioObjectPropertyScopeGlobal,
-      kAudioObjectPropertyElementMaster};
+  size_t writeIndex = atomic_load_explicit(&ring->writeIndex, memory_order_relaxed);
+  size_t readIndex = atomic_load_explicit(&ring->readIndex, memory_order_acquire);
+  size_t fill = writeIndex - readIndex;
 
-  OSStatus status = AudioObjectGetPropertyData(kAudioObjectSystemObject,
-                                               &propertyAddress,
-                                               0,
-                                               NULL,
-                                               &dataSize,
-                                               &deviceID);
-  if (status != noErr)
+  if (size > ring->capacity - fill)
   {
-    fprintf(stderr, "Failed to get the default macos output device ID\n");
-    exit(EXIT_FAILURE);
+    size = ring->capacity - fill;
   }
 
-  return deviceID; // Return the default output device ID
+  size_t start = writeIndex % ring->capacity;
+  size_t firstPart = ring->capacity - start;
+  if (firstPart > size)
+  {
+    firstPart = size;
+  }
+  memset(ring->data + start, 0, firstPart);
+  memset(ring->data, 0, size - firstPart);
+
+  atomic_store_explicit(&ring->writeIndex, writeIndex + size, memory_order_release);
+  return size;
 }
 
-void setupInputTracks(int inputChannelCount)
+// consumer side: exposes the readable bytes as at most two contiguous regions
+// so they can be handed straight to a write without an extra copy
+size_t ringBufferReadRegions(RingBuffer *ring, unsigned char **first, size_t *firstSize, unsigned char **second, size_t *secondSize)
 {
-  if (recorder.tracks != NULL)
+  size_t readIndex = atomic_load_explicit(&ring->readIndex, memory_order_relaxed);
+  size_t writeIndex = atomic_load_explicit(&ring->writeIndex, memory_order_acquire);
+  size_t fill = writeIndex - readIndex;
+  size_t start = readIndex % ring->capacity;
+
+  *first = ring->data + start;
+  *firstSize = ring->capacity - start < fill ? ring->capacity - start : fill;
+  *second = ring->data;
+  *secondSize = fill - *firstSize;
+  return fill;
+}
+
+void ringBufferConsume(RingBuffer *ring, size_t size)
+{
+  size_t readIndex = atomic_load_explicit(&ring->readIndex, memory_order_relaxed);
+  atomic_store_explicit(&ring->readIndex, readIndex + size, memory_order_release);
+}
+
+// producer side counterpart of ringBufferReadRegions: exposes the free space so
+// reads can land directly in the ring, followed by ringBufferCommit
+size_t ringBufferWriteRegions(RingBuffer *ring, unsigned char **first, size_t *firstSize, unsigned char **second, size_t *secondSize)
+{
+  size_t writeIndex = atomic_load_explicit(&ring->writeIndex, memory_order_relaxed);
+  size_t readIndex = atomic_load_explicit(&ring->readIndex, memory_order_acquire);
+  size_t space = ring->capacity - (writeIndex - readIndex);
+  size_t start = writeIndex % ring->capacity;
+
+  *first = ring->data + start;
+  *firstSize = ring->capacity - start < space ? ring->capacity - start : space;
+  *second = ring->data;
+  *secondSize = space - *firstSize;
+  return space;
+}
+
+void ringBufferCommit(RingBuffer *ring, size_t size)
+{
+  size_t writeIndex = atomic_load_explicit(&ring->writeIndex, memory_order_relaxed);
+  atomic_store_explicit(&ring->writeIndex, writeIndex + size, memory_order_release);
+}
+
+// consumer side: copies out up to size bytes, returns how many were available
+size_t ringBufferRead(RingBuffer *ring, unsigned char *data, size_t size)
+{
+  size_t readIndex = atomic_load_explicit(&ring->readIndex, memory_order_relaxed);
+  size_t writeIndex = atomic_load_explicit(&ring->writeIndex, memory_order_acquire);
+  size_t fill = writeIndex - readIndex;
+  if (size > fill)
   {
-    free(recorder.tracks);
-    recorder.tracks = NULL;
+    size = fill;
   }
-  recorder.trackCount = inputChannelCount;
-  recorder.tracks = calloc(sizeof(WavFile) * recorder.trackCount, sizeof(WavFile)); // make room for as many wav files as needed tracks
 
-  if (recorder.tracks == NULL)
+  size_t start = readIndex % ring->capacity;
+  size_t firstPart = ring->capacity - start;
+  if (firstPart > size)
   {
-    printf("Error: Failed to allocate memory for tracks.\n");
-    exit(EXIT_FAILURE);
+    firstPart = size;
   }
+  memcpy(data, ring->data + start, firstPart);
+  memcpy(data + firstPart, ring->data, size - firstPart);
+
+  atomic_store_explicit(&ring->readIndex, readIndex + size, memory_order_release);
+  return size;
 }
 
-int checkPAIOAndGetChannelCount()
+// WORKER POOL
+void initTaskGroup(TaskGroup *group)
 {
-  int inputDevice = Pa_GetDefaultInputDevice();
-  int outputDevice = Pa_GetDefaultOutputDevice();
-  // check that we have both IO devices from default setup
-  if (inputDevice == -1 || outputDevice == -1)
+  group->pending = 0;
+  pthread_mutex_init(&group->lock, NULL);
+  pthread_cond_init(&group->done, NULL);
+}
+
+void destroyTaskGroup(TaskGroup *group)
+{
+  pthread_mutex_destroy(&group->lock);
+  pthread_cond_destroy(&group->done);
+}
+
+void *workerLoop(void *arg)
+{
+  WorkerPool *pool = arg;
+  while (true)
   {
-    printf("Error: We are missing either an input or an output default device\n");
-    exit(EXIT_FAILURE);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head == NULL && !pool->stopping)
+    {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->head == NULL)
+    {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    WorkerTask *task = pool->head;
+    pool->head = task->next;
+    if (pool->head == NULL)
+    {
+      pool->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    task->run(task->arg);
+
+    pthread_mutex_lock(&task->group->lock);
+    if (--task->group->pending == 0)
+    {
+      pthread_cond_broadcast(&task->group->done);
+    }
+    pthread_mutex_unlock(&task->group->lock);
+    free(task);
   }
-  // get IO device info
-  const PaDeviceInfo *inputDeviceInfo = Pa_GetDeviceInfo(inputDevice);
-  const PaDeviceInfo *outputDeviceInfo = Pa_GetDeviceInfo(outputDevice);
-  // set channel count
-  int inputChannelCount = inputDeviceInfo->maxInputChannels;
-  int outputChannelCount = outputDeviceInfo->maxOutputChannels;
+}
 
-  // handle input count error
-  if (inputChannelCount <= 0)
+bool startWorkerPool(WorkerPool *pool, int threadCount)
+{
+  pool->threads = calloc(threadCount, sizeof(pthread_t));
+  pool->threadCount = 0;
+  pool->head = pool->tail = NULL;
+  pool->stopping = false;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  for (int i = 0; i < threadCount; i++)
   {
-    printf("Error: Invalid number of input channels (%d). Must be greater than 0.\n", inputChannelCount);
-    exit(EXIT_FAILURE);
+    if (pthread_create(&pool->threads[i], NULL, workerLoop, pool) != 0)
+    {
+      break;
+    }
+    pool->threadCount++;
   }
+  return pool->threadCount > 0;
+}
 
-  // for now, we are enforcing that devices must comply with 1:1 inputs to outputs
-  if (outputChannelCount < inputChannelCount)
+// finishes the queued tasks, then joins the threads
+void stopWorkerPool(WorkerPool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->threadCount; i++)
   {
-    printf("Error: There are not enough output channels (%d) to match input channels\n", outputChannelCount);
-    exit(EXIT_FAILURE);
+    pthread_join(pool->threads[i], NULL);
   }
+  free(pool->threads);
+  pool->threads = NULL;
+  pool->threadCount = 0;
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+}
 
-  return inputChannelCount;
+void submitTask(WorkerPool *pool, TaskGroup *group, void (*run)(void *arg), void *arg)
+{
+  WorkerTask *task = malloc(sizeof(WorkerTask));
+  task->run = run;
+  task->arg = arg;
+  task->group = group;
+  task->next = NULL;
+
+  pthread_mutex_lock(&group->lock);
+  group->pending++;
+  pthread_mutex_unlock(&group->lock);
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail != NULL)
+  {
+    pool->tail->next = task;
+  }
+  else
+  {
+    pool->head = task;
+  }
+  pool->tail = task;
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
 }
 
-void initAudio()
+void waitTaskGroup(TaskGroup *group)
+{
+  pthread_mutex_lock(&group->lock);
+  while (group->pending > 0)
+  {
+    pthread_cond_wait(&group->done, &group->lock);
+  }
+  pthread_mutex_unlock(&group->lock);
+}
+
+// one thread per core for CPU bound offline work, started on first use
+WorkerPool computePool;
+pthread_once_t computePoolOnce = PTHREAD_ONCE_INIT;
+bool computePoolStarted = false;
+
+void startComputePool()
 {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  computePoolStarted = startWorkerPool(&computePool, cores > 0 ? cores : 1);
+}
 
-  PaError err;
-  // init PA
-  err = Pa_Initialize();
-  if (err != paNoError)
+// SCRATCH ARENA
+// Bump allocator for the callback. Everything a callback stage needs is borrowed
+// from here and released all at once by resetScratchArena at the top of the next callback.
+#define SCRATCH_ALIGNMENT 64
+#define SCRATCH_BLOCKS_PER_TRACK 4 // block = one callback of float samples for one track
+
+ScratchArena callbackArena = {NULL, 0, 0};
+
+void prepareScratchArena(ScratchArena *arena, size_t size)
+{
+  if (arena->base != NULL && arena->size >= size)
   {
-    printf("PortAudio error during initialization: %s\n", Pa_GetErrorText(err));
+    arena->used = 0;
+    return;
+  }
+  free(arena->base);
+  arena->base = NULL;
+  arena->size = 0;
+  arena->used = 0;
+  if (posix_memalign((void **)&arena->base, SCRATCH_ALIGNMENT, size) != 0)
+  {
+    arena->base = NULL;
+    printf("Error: Failed to allocate %zu byte scratch arena.\n", size);
     exit(EXIT_FAILURE);
   }
-
-  // establish the current input setup
-  size_t inputChannelCount = checkPAIOAndGetChannelCount();
-  setupInputTracks(inputChannelCount);
+  arena->size = size;
 }
 
-void cleanupAudio()
+void freeScratchArena(ScratchArena *arena)
 {
-  PaError err;
+  free(arena->base);
+  arena->base = NULL;
+  arena->size = 0;
+  arena->used = 0;
+}
 
-  Pa_StopStream(stream);
-  Pa_CloseStream(stream);
+void resetScratchArena(ScratchArena *arena)
+{
+  arena->used = 0;
+}
 
-  err = Pa_Terminate();
-  if (err != paNoError)
+// returns NULL instead of growing, the arena is sized up front for the stream
+void *borrowScratch(ScratchArena *arena, size_t size)
+{
+  size_t start = (arena->used + SCRATCH_ALIGNMENT - 1) & ~(size_t)(SCRATCH_ALIGNMENT - 1);
+  if (start + size > arena->size)
   {
-    printf("PortAudio error during termination: %s\n", Pa_GetErrorText(err));
+    return NULL;
   }
+  arena->used = start + size;
+  return arena->base + start;
 }
 
-// also monitors the default devices on macos to adjust audio setup if a change has occured
-int getInputTrackCount()
+// (re)allocates a ring to the requested capacity and empties it
+void prepareRingBuffer(RingBuffer *ring, size_t capacity)
 {
-  // if macos device defaults change
-  AudioDeviceID defaultMacOSInputDevice = getDefaultMacOSInputDeviceID();
-  AudioDeviceID defaultMacOSOutputDevice = getDefaultMacOSOutputDeviceID();
-  if (defaultMacOSInputDevice != currentDefaultMacOSInputDevice || defaultMacOSOutputDevice != currentDefaultMacOSOutputDevice)
+  if (ring->data != NULL && ring->capacity != capacity)
   {
-    // reset our PA audio setup
-    cleanupAudio();
-    initAudio();
+    freeRingBuffer(ring);
   }
-  // after we re-init and set the recorder.trackCount we should now be returning the latest state update
-  return recorder.trackCount;
+  if (ring->data == NULL && !initRingBuffer(ring, capacity))
+  {
+    printf("Error: Failed to allocate %zu byte ring buffer.\n", capacity);
+    exit(EXIT_FAILURE);
+  }
+  resetRingBuffer(ring);
 }
 
-int bounceTracks(const uint32_t *tracksToBounce, char *selectedPath)
+float getCurrentStartTimeInSeconds()
 {
-  // reset time in seconds
-  startTimeInSeconds = 0;
+  return startTimeInSeconds;
+}
 
-  initTracks(NULL); // ###############################
+void updateStartTime(float time)
+{
+  startTimeInSeconds = time;
+}
 
-  // Parse the selected path into directory and track title
-  char *dirPath, *trackTitle;
-  separatePathFromTitle(selectedPath, &dirPath, &trackTitle);
+float getCurrentAmplitude(unsigned int index)
+{
+  return recorder.tracks[index].currentAmplitudeLevel;
+}
 
-  // Create the new stereo file
-  WavFile *bouncedTrack = malloc(sizeof(WavFile));
-  openWavFile(bouncedTrack, trackTitle, dirPath, 2);
+float getCurrentPeak(unsigned int index)
+{
+  return recorder.tracks[index].currentPeakLevel;
+}
 
-  // Find the two tracks marked for bouncing
-  int selectedIndices[2] = {-1, -1};
-  int found = 0;
-  for (size_t i = 0; i < recorder.trackCount; i++)
-  {
-    if (tracksToBounce[i] == 1)
-    {
-      selectedIndices[found++] = i;
-    }
-  }
+size_t getClippedSampleCount(unsigned int index)
+{
+  return atomic_load_explicit(&recorder.tracks[index].clippedSamples, memory_order_relaxed);
+}
 
-  if (found != 2)
+void onSetInputTrackRecordEnabled(unsigned int index, bool state)
+{
+  if (state == 1)
   {
-    printf("Error: Less than two tracks marked for bouncing.\n");
-    free(bouncedTrack);
-    return 1;
+    recorder.tracks[index].recordEnabled = true;
   }
-
-  // Determine the duration of the longest track among the two
-  int duration = 0;
-  for (int i = 0; i < 2; i++)
+  else
   {
-    fseek(recorder.tracks[selectedIndices[i]].file, 0, SEEK_END);
-    size_t fileSize = ftell(recorder.tracks[selectedIndices[i]].file);
-    size_t audioDataSize = fileSize - 44; // Subtract the header size
-    int trackDuration = calculateAudioDuration(audioDataSize, 1);
-    if (duration < trackDuration)
-    {
-      duration = trackDuration;
-    }
+    recorder.tracks[index].recordEnabled = false;
   }
+}
 
-  if (duration == 0)
+void setRecordRingSeconds(float seconds)
+{
+  if (seconds > 0)
   {
-    printf("ERROR: One or both tracks are empty.\n");
-    free(bouncedTrack);
-    return 1;
+    recordRingSeconds = seconds;
   }
+}
 
-  // Allocate and initialize a stereo buffer based on the longest track duration
-  size_t stereoBufferSize = calculateBufferSize(2, duration);
-  unsigned char *stereoBuffer = malloc(stereoBufferSize);
-  if (!stereoBuffer)
+float getRecordRingFillLevel(unsigned int index)
+{
+  RingBuffer *ring = &recorder.tracks[index].recordRing;
+  if (ring->capacity == 0)
   {
-    printf("Memory allocation failed for stereo buffer.\n");
-    free(bouncedTrack);
-    return 1;
+    return 0;
   }
-  memset(stereoBuffer, 0, stereoBufferSize);
+  return (float)ringBufferFill(ring) / ring->capacity;
+}
 
-  // Mix each track into the appropriate channel of the stereo buffer
-  for (int channel = 0; channel < 2; channel++)
+float getRecordRingPeakFillLevel(unsigned int index)
+{
+  RingBuffer *ring = &recorder.tracks[index].recordRing;
+  if (ring->capacity == 0)
   {
-    mixMonoTrackToStereoBuffer(&recorder.tracks[selectedIndices[channel]], stereoBuffer, stereoBufferSize, channel);
+    return 0;
   }
+  return (float)atomic_load(&ring->peakFill) / ring->capacity;
+}
 
-  // Write and close the stereo WAV file
-  writeWavData(bouncedTrack, stereoBuffer, stereoBufferSize);
-  closeWavFile(bouncedTrack);
-
-  // Cleanup
-  free(stereoBuffer);
-  free(bouncedTrack);
+size_t getRecordRingOverflowCount(unsigned int index)
+{
+  return atomic_load(&recorder.tracks[index].recordRing.overflowCount);
+}
 
-  return 0;
+// failed or short writes of recorded audio since the take started
+size_t getRecordWriteFailureCount(unsigned int index)
+{
+  return atomic_load(&recorder.tracks[index].writeFailureCount);
 }
 
-void onSetAppDirPath(const char *selectedPath)
+void setPlaybackRingSeconds(float seconds)
 {
-  if (appDirPath != NULL)
+  if (seconds > 0)
+  {
+    playbackRingSeconds = seconds;
+  }
+}
+
+size_t getPlaybackUnderrunCount(unsigned int index)
+{
+  return atomic_load(&recorder.tracks[index].playbackUnderrunCount);
+}
+
+void setBounceBlockFrames(size_t frames)
+{
+  if (frames > 0)
+  {
+    bounceBlockFrames = frames;
+  }
+}
+
+// Sets up a bounce to tape for the next recording pass, while stopped: the tracks
+// marked in sourceTracks play back and their sum, each scaled by its linear gain
+// (unity when gains is NULL), is recorded onto destinationTrack in place of its
+// input. The destination has to be armed for the pass; armed sources are left out.
+void setTrackBounce(const uint32_t *sourceTracks, const float *gains, int destinationTrack)
+{
+  bounceDestinationTrack = destinationTrack >= 0 && destinationTrack < recorder.trackCount ? destinationTrack : -1;
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    bool source = sourceTracks[i] == 1 && (int)i != bounceDestinationTrack;
+    recorder.tracks[i].bounceGain = source ? (gains != NULL ? gains[i] : 1) : 0;
+  }
+}
+
+void clearTrackBounce()
+{
+  bounceDestinationTrack = -1;
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    recorder.tracks[i].bounceGain = 0;
+  }
+}
+
+// WRITEBACK POLICY
+// Controls how recorded audio leaves the page cache: disk space can be reserved
+// for a whole take up front, dirty data can be bounded by syncing on a fixed
+// cadence, and ranges that are safely on disk can be dropped from the cache so a
+// long take does not push out the audio being played back.
+void setWritebackPolicy(WritebackMode mode, size_t intervalBytes, bool dropPages)
+{
+  writebackMode = mode;
+  if (intervalBytes > 0)
+  {
+    writebackIntervalBytes = intervalBytes;
+  }
+  dropPersistedPages = dropPages;
+}
+
+void setExpectedTakeSeconds(float seconds)
+{
+  expectedTakeSeconds = seconds > 0 ? seconds : 0;
+}
+
+// reserves disk blocks for offset..offset + length without changing the file size
+int reserveFileSpace(int fd, off_t offset, off_t length)
+{
+#if defined(__APPLE__)
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0)
+  {
+    return -1;
+  }
+  if (fileStat.st_size >= offset + length)
+  {
+    return 0;
+  }
+  fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, offset + length - fileStat.st_size, 0};
+  if (fcntl(fd, F_PREALLOCATE, &store) == -1)
+  {
+    store.fst_flags = F_ALLOCATEALL; // contiguous space not available, take what there is
+    return fcntl(fd, F_PREALLOCATE, &store) == -1 ? -1 : 0;
+  }
+  return 0;
+#elif defined(__linux__)
+  return fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length);
+#else
+  return 0;
+#endif
+}
+
+// reserves disk space for the file up to offset + length and extends it to that size
+int preallocateFile(int fd, off_t offset, off_t length)
+{
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0)
+  {
+    return -1;
+  }
+  if (fileStat.st_size >= offset + length)
+  {
+    return 0;
+  }
+  reserveFileSpace(fd, offset, length);
+  return ftruncate(fd, offset + length);
+}
+
+// reserves room for expectedTakeSeconds of audio past the overwrite position
+void reserveTakeSpace(WavFile *wav)
+{
+  if (expectedTakeSeconds <= 0 || wav->file == NULL)
+  {
+    return;
+  }
+  size_t takeBytes = (size_t)(sampleRate * expectedTakeSeconds) * (bitDepth / 8);
+  if (reserveFileSpace(fileno(wav->file), wav->writePosition, takeBytes) != 0)
+  {
+    perror("Failed to reserve disk space for take");
+  }
+}
+
+void resetWritebackState(WritebackState *state)
+{
+  state->pendingStart = state->pendingEnd = 0;
+  state->previousStart = state->previousEnd = 0;
+}
+
+void dropFileRange(int fd, off_t start, off_t end)
+{
+#ifdef POSIX_FADV_DONTNEED
+  if (dropPersistedPages && end > start)
+  {
+    posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+  }
+#endif
+}
+
+void syncPendingRange(WritebackState *state, int fd)
+{
+  if (state->pendingEnd == state->pendingStart)
+  {
+    return;
+  }
+
+#if defined(__linux__)
+  if (writebackMode == WRITEBACK_RANGE)
+  {
+    // kick off the new range, then wait for the previous one so at most two
+    // intervals of dirty data are ever outstanding
+    sync_file_range(fd, state->pendingStart, state->pendingEnd - state->pendingStart, SYNC_FILE_RANGE_WRITE);
+    if (state->previousEnd > state->previousStart)
+    {
+      sync_file_range(fd, state->previousStart, state->previousEnd - state->previousStart,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      dropFileRange(fd, state->previousStart, state->previousEnd);
+    }
+    state->previousStart = state->pendingStart;
+    state->previousEnd = state->pendingEnd;
+    state->pendingStart = state->pendingEnd;
+    return;
+  }
+  fdatasync(fd);
+#else
+  // no range writeback outside linux, both modes sync the whole file
+  fsync(fd);
+#endif
+  dropFileRange(fd, state->pendingStart, state->pendingEnd);
+  state->pendingStart = state->pendingEnd;
+}
+
+// records that start..end of the file was just written and syncs according to the
+// writeback policy once writebackIntervalBytes have built up. Callers using stdio
+// must have flushed the FILE before calling.
+void noteFileWritten(WritebackState *state, int fd, off_t start, off_t end)
+{
+  if (writebackMode == WRITEBACK_KERNEL)
+  {
+    return;
+  }
+
+  if (state->pendingEnd == state->pendingStart)
+  {
+    state->pendingStart = start;
+    state->pendingEnd = end;
+  }
+  else
+  {
+    state->pendingStart = start < state->pendingStart ? start : state->pendingStart;
+    state->pendingEnd = end > state->pendingEnd ? end : state->pendingEnd;
+  }
+  if ((size_t)(state->pendingEnd - state->pendingStart) < writebackIntervalBytes)
+  {
+    return;
+  }
+
+  syncPendingRange(state, fd);
+}
+
+// pushes out whatever is still pending, used at the end of a take
+void finishWriteback(WritebackState *state, int fd)
+{
+  if (writebackMode == WRITEBACK_KERNEL)
+  {
+    return;
+  }
+  syncPendingRange(state, fd);
+#if defined(__linux__)
+  if (state->previousEnd > state->previousStart)
+  {
+    sync_file_range(fd, state->previousStart, state->previousEnd - state->previousStart,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    dropFileRange(fd, state->previousStart, state->previousEnd);
+  }
+#endif
+  resetWritebackState(state);
+}
+
+// DIRECT I/O
+// Opt-in page cache bypass for track files. A second descriptor is opened with
+// O_DIRECT (F_NOCACHE on macOS) and every transfer goes through an aligned staging
+// buffer in whole DIRECT_IO_ALIGNMENT blocks. The 44 byte header and the 3 byte
+// sample stride never line up with blocks, so the block holding the first byte of
+// a take is read back before writing and the last block is merged with what is
+// already on disk when the take ends.
+#define DIRECT_IO_ALIGNMENT 4096
+#define DIRECT_IO_STAGING_BYTES (1024 * 1024)
+
+void setDirectIO(bool enabled)
+{
+  useDirectIO = enabled;
+}
+
+off_t alignDown(off_t value)
+{
+  return value & ~(off_t)(DIRECT_IO_ALIGNMENT - 1);
+}
+
+size_t alignUp(size_t value)
+{
+  return (value + DIRECT_IO_ALIGNMENT - 1) & ~(size_t)(DIRECT_IO_ALIGNMENT - 1);
+}
+
+bool openDirectIO(WavFile *wav, const char *filePath)
+{
+#if defined(__linux__)
+  int fd = open(filePath, O_RDWR | O_DIRECT);
+#else
+  int fd = open(filePath, O_RDWR);
+#if defined(__APPLE__)
+  if (fd != -1)
+  {
+    fcntl(fd, F_NOCACHE, 1);
+  }
+#endif
+#endif
+  if (fd == -1)
+  {
+    perror("Failed to open track for direct I/O");
+    return false;
+  }
+  if (posix_memalign((void **)&wav->direct.staging, DIRECT_IO_ALIGNMENT, DIRECT_IO_STAGING_BYTES) != 0)
+  {
+    close(fd);
+    return false;
+  }
+  wav->direct.fd = fd;
+  wav->direct.stagingOffset = 0;
+  wav->direct.stagingFill = 0;
+  wav->direct.initialFileSize = -1; // set by the first write
+  wav->direct.active = true;
+  return true;
+}
+
+// merges the partially filled last block with the file and writes everything staged
+void flushDirectIO(WavFile *wav)
+{
+  DirectIO *direct = &wav->direct;
+  if (direct->initialFileSize < 0 || direct->stagingFill == 0)
+  {
+    return;
+  }
+
+  size_t tailStart = alignDown(direct->stagingFill);
+  size_t writeSize = alignUp(direct->stagingFill);
+  if (writeSize > direct->stagingFill)
+  {
+    // keep whatever the file already has after the end of the take in this block
+    unsigned char *block = direct->staging + tailStart;
+    unsigned char saved[DIRECT_IO_ALIGNMENT];
+    size_t keep = direct->stagingFill - tailStart;
+    memcpy(saved, block, keep);
+    ssize_t readBytes = pread(direct->fd, block, DIRECT_IO_ALIGNMENT, direct->stagingOffset + tailStart);
+    if (readBytes < DIRECT_IO_ALIGNMENT)
+    {
+      memset(block + (readBytes > 0 ? readBytes : 0), 0, DIRECT_IO_ALIGNMENT - (readBytes > 0 ? readBytes : 0));
+    }
+    memcpy(block, saved, keep);
+  }
+
+  if (pwrite(direct->fd, direct->staging, writeSize, direct->stagingOffset) != (ssize_t)writeSize)
+  {
+    perror("Failed to write track with direct I/O");
+  }
+
+  // drop the block padding if it grew the file past the real end
+  off_t realEnd = direct->stagingOffset + direct->stagingFill;
+  off_t keepSize = realEnd > direct->initialFileSize ? realEnd : direct->initialFileSize;
+  if (direct->stagingOffset + (off_t)writeSize > keepSize)
+  {
+    ftruncate(direct->fd, keepSize);
+  }
+
+  // carry on from the last block in case more data follows
+  if (tailStart > 0)
+  {
+    memmove(direct->staging, direct->staging + tailStart, direct->stagingFill - tailStart);
+  }
+  direct->stagingOffset += tailStart;
+  direct->stagingFill -= tailStart;
+}
+
+void closeDirectIO(WavFile *wav)
+{
+  if (!wav->direct.active)
+  {
+    return;
+  }
+  flushDirectIO(wav);
+  close(wav->direct.fd);
+  free(wav->direct.staging);
+  wav->direct.staging = NULL;
+  wav->direct.active = false;
+}
+
+// appends at position, which is only consulted for the first write of a take.
+// Returns the file position after the data.
+off_t directWrite(WavFile *wav, off_t position, const unsigned char *data, size_t size)
+{
+  DirectIO *direct = &wav->direct;
+  if (direct->initialFileSize < 0)
+  {
+    struct stat fileStat;
+    fstat(direct->fd, &fileStat);
+    direct->initialFileSize = fileStat.st_size;
+    direct->stagingOffset = alignDown(position);
+    direct->stagingFill = position - direct->stagingOffset;
+    if (direct->stagingFill > 0)
+    {
+      // header or earlier audio shares the first block
+      ssize_t readBytes = pread(direct->fd, direct->staging, DIRECT_IO_ALIGNMENT, direct->stagingOffset);
+      if (readBytes < (ssize_t)direct->stagingFill)
+      {
+        memset(direct->staging, 0, direct->stagingFill);
+      }
+    }
+  }
+
+  while (size > 0)
+  {
+    size_t space = DIRECT_IO_STAGING_BYTES - direct->stagingFill;
+    size_t chunk = size < space ? size : space;
+    memcpy(direct->staging + direct->stagingFill, data, chunk);
+    direct->stagingFill += chunk;
+    data += chunk;
+    size -= chunk;
+
+    if (direct->stagingFill == DIRECT_IO_STAGING_BYTES)
+    {
+      if (pwrite(direct->fd, direct->staging, DIRECT_IO_STAGING_BYTES, direct->stagingOffset) != DIRECT_IO_STAGING_BYTES)
+      {
+        perror("Failed to write track with direct I/O");
+      }
+      direct->stagingOffset += DIRECT_IO_STAGING_BYTES;
+      direct->stagingFill = 0;
+    }
+  }
+  return direct->stagingOffset + direct->stagingFill;
+}
+
+// reads size bytes at position, refilling the staging buffer a whole buffer at a time
+size_t directRead(WavFile *wav, off_t position, unsigned char *destination, size_t size)
+{
+  DirectIO *direct = &wav->direct;
+  size_t total = 0;
+  while (total < size)
+  {
+    off_t want = position + total;
+    if (want < direct->stagingOffset || want >= direct->stagingOffset + (off_t)direct->stagingFill)
+    {
+      direct->stagingOffset = alignDown(want);
+      ssize_t readBytes = pread(direct->fd, direct->staging, DIRECT_IO_STAGING_BYTES, direct->stagingOffset);
+      direct->stagingFill = readBytes > 0 ? readBytes : 0;
+      if (want >= direct->stagingOffset + (off_t)direct->stagingFill)
+      {
+        break; // end of file
+      }
+    }
+    size_t offset = want - direct->stagingOffset;
+    size_t chunk = direct->stagingFill - offset;
+    chunk = chunk < size - total ? chunk : size - total;
+    memcpy(destination + total, direct->staging + offset, chunk);
+    total += chunk;
+  }
+  return total;
+}
+
+// POSITIONAL TRACK I/O
+// All audio data moves with pread/pwrite at explicit offsets (or through the mapping
+// or the direct I/O staging), never through the FILE position, so transfers for
+// different tracks can run on any thread at the same time.
+size_t readTrackAt(WavFile *wav, off_t position, unsigned char *destination, size_t size)
+{
+  if (wav->map != NULL)
+  {
+    size_t available = position < (off_t)wav->mapSize ? wav->mapSize - position : 0;
+    size = size < available ? size : available;
+    memcpy(destination, wav->map + position, size);
+    return size;
+  }
+  if (wav->direct.active)
+  {
+    return directRead(wav, position, destination, size);
+  }
+
+  size_t total = 0;
+  while (total < size)
+  {
+    ssize_t readBytes = pread(fileno(wav->file), destination + total, size - total, position + total);
+    if (readBytes <= 0)
+    {
+      break;
+    }
+    total += readBytes;
+  }
+  return total;
+}
+
+size_t writeTrackAt(WavFile *wav, off_t position, const unsigned char *data, size_t size)
+{
+  if (wav->direct.active)
+  {
+    directWrite(wav, position, data, size);
+    return size;
+  }
+
+  size_t total = 0;
+  while (total < size)
+  {
+    ssize_t written = pwrite(fileno(wav->file), data + total, size - total, position + total);
+    if (written <= 0)
+    {
+      perror("Failed to write track data");
+      break;
+    }
+    total += written;
+  }
+  return total;
+}
+
+// MAPPED PLAYBACK
+// With useMappedPlayback the prefetcher copies straight out of a read-only mapping
+// of each track, so a refill is a memcpy from a pointer offset. Read-ahead is
+// requested with MADV_WILLNEED in windows that slide with the play head and pages
+// behind it are released with MADV_DONTNEED. Page faults land on the prefetcher,
+// never on the audio thread, since the callback still only reads its ring.
+#define MAP_WINDOW_BYTES (4 * 1024 * 1024)
+
+void setMappedPlayback(bool enabled)
+{
+  useMappedPlayback = enabled;
+}
+
+void unmapTrack(WavFile *wav)
+{
+  if (wav->map != NULL)
+  {
+    munmap(wav->map, wav->mapSize);
+    wav->map = NULL;
+    wav->mapSize = 0;
+  }
+}
+
+// maps the file as it is now, remapping when it has grown or shrunk since the last pass
+bool mapTrack(WavFile *wav)
+{
+  struct stat fileStat;
+  fflush(wav->file);
+  if (fstat(fileno(wav->file), &fileStat) != 0 || (size_t)fileStat.st_size <= wav->dataOffset)
+  {
+    unmapTrack(wav);
+    return false;
+  }
+
+  size_t fileSize = (size_t)fileStat.st_size;
+  if (wav->map == NULL || wav->mapSize != fileSize)
+  {
+    unmapTrack(wav);
+    void *map = mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fileno(wav->file), 0);
+    if (map == MAP_FAILED)
+    {
+      perror("Failed to map track for playback");
+      return false;
+    }
+    wav->map = map;
+    wav->mapSize = fileSize;
+    madvise(wav->map, wav->mapSize, MADV_SEQUENTIAL);
+  }
+
+  // never read past the mapping even if the recorded size disagrees with the file
+  if (wav->dataSize > wav->mapSize - wav->dataOffset)
+  {
+    wav->dataSize = wav->mapSize - wav->dataOffset;
+  }
+  return true;
+}
+
+// page-aligned madvise over a range of the audio data
+void adviseTrackRange(WavFile *wav, size_t dataStart, size_t dataEnd, int advice)
+{
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = (wav->dataOffset + dataStart) & ~(pageSize - 1);
+  size_t end = wav->dataOffset + dataEnd;
+  if (end > wav->mapSize)
+  {
+    end = wav->mapSize;
+  }
+  if (end > start)
+  {
+    madvise(wav->map + start, end - start, advice);
+  }
+}
+
+// keeps one window of read-ahead in front of the prefetch position and releases
+// whole windows once they are behind it
+void slideTrackWindow(WavFile *wav)
+{
+  if (wav->mapAdvisedEnd < wav->prefetchOffset + MAP_WINDOW_BYTES)
+  {
+    size_t start = wav->mapAdvisedEnd > wav->prefetchOffset ? wav->mapAdvisedEnd : wav->prefetchOffset;
+    wav->mapAdvisedEnd = wav->prefetchOffset + 2 * MAP_WINDOW_BYTES;
+    adviseTrackRange(wav, start, wav->mapAdvisedEnd, MADV_WILLNEED);
+  }
+  if (wav->prefetchOffset > wav->mapReleasedEnd + 2 * MAP_WINDOW_BYTES)
+  {
+    size_t releaseEnd = wav->prefetchOffset - MAP_WINDOW_BYTES;
+    adviseTrackRange(wav, wav->mapReleasedEnd, releaseEnd, MADV_DONTNEED);
+    wav->mapReleasedEnd = releaseEnd;
+  }
+}
+
+// WAV HEADERS
+// New files are laid out as
+//   RIFF <size> WAVE | JUNK <28> reserved | fmt  <16> ... | data <size> audio
+// The JUNK chunk is the room a ds64 chunk needs, so a take that grows past 4 GB is
+// turned into RF64 (EBU Tech 3306 / BW64) in place: the form becomes RF64, JUNK
+// becomes ds64 with the real 64 bit sizes and the 32 bit fields are set to
+// 0xFFFFFFFF. Old 44 byte headers have no such room and are shifted once, when
+// they are closed past 4 GB.
+#define WAV_HEADER_SIZE 80
+#define WAV_DS64_OFFSET 12
+#define WAV_DS64_SIZE 28
+#define WAV_LEGACY_HEADER_SIZE 44
+#define WAV_SIZE_LIMIT 0xFFFFFFFFull
+#define WAV_SHIFT_BLOCK_BYTES (1024 * 1024)
+
+// reads size bytes at offset, from the already loaded head of the file when it
+// covers them
+bool readHeaderBytes(int fd, const unsigned char *head, size_t headSize, off_t offset, void *destination, size_t size)
+{
+  if (offset + size <= headSize)
+  {
+    memcpy(destination, head + offset, size);
+    return true;
+  }
+  return pread(fd, destination, size, offset) == (ssize_t)size;
+}
+
+// fills format from a fmt chunk body. WAVE_FORMAT_EXTENSIBLE is resolved to the
+// subformat, whose tag is the first two bytes of its GUID.
+bool parseFormatChunk(const unsigned char *body, uint32_t size, WavFormat *format)
+{
+  if (size < 16)
+  {
+    return false;
+  }
+  memcpy(&format->formatTag, body, 2);
+  memcpy(&format->channels, body + 2, 2);
+  memcpy(&format->sampleRate, body + 4, 4);
+  memcpy(&format->blockAlign, body + 12, 2);
+  memcpy(&format->bitsPerSample, body + 14, 2);
+  if (format->formatTag == WAVE_FORMAT_EXTENSIBLE)
+  {
+    if (size < 40)
+    {
+      return false;
+    }
+    memcpy(&format->formatTag, body + 24, 2);
+  }
+  return format->channels > 0 && format->blockAlign > 0 && format->bitsPerSample > 0;
+}
+
+// Walks the chunks of a RIFF, RF64 or BW64 WAVE file up to the data chunk. The
+// first WAV_SCAN_BYTES are loaded with one read, which covers the header of
+// anything this program writes; chunks past that (a long bext or LIST before
+// the audio) cost one small read per chunk header. Unknown chunks (bext, LIST,
+// JUNK, fact, cue ...) are skipped by size, honouring the pad byte after odd
+// length chunks. Returns false if there is no fmt chunk before the data.
+#define WAV_SCAN_BYTES 4096
+
+bool readWavLayout(int fd, WavLayout *layout)
+{
+  unsigned char head[WAV_SCAN_BYTES];
+  ssize_t headRead = pread(fd, head, WAV_SCAN_BYTES, 0);
+  size_t headSize = headRead > 0 ? headRead : 0;
+  if (headSize < 12 || memcmp(head + 8, "WAVE", 4) != 0)
+  {
+    return false;
+  }
+  bool isRf64 = memcmp(head, "RF64", 4) == 0 || memcmp(head, "BW64", 4) == 0;
+  if (!isRf64 && memcmp(head, "RIFF", 4) != 0)
+  {
+    return false;
+  }
+
+  memset(layout, 0, sizeof(WavLayout));
+  bool haveFormat = false;
+  uint64_t ds64DataSize = 0;
+  off_t offset = 12;
+  unsigned char chunk[8];
+  while (readHeaderBytes(fd, head, headSize, offset, chunk, 8))
+  {
+    uint32_t size;
+    memcpy(&size, chunk + 4, 4);
+    if (memcmp(chunk, "ds64", 4) == 0 && size >= WAV_DS64_SIZE)
+    {
+      unsigned char body[WAV_DS64_SIZE];
+      if (readHeaderBytes(fd, head, headSize, offset + 8, body, WAV_DS64_SIZE))
+      {
+        memcpy(&ds64DataSize, body + 8, 8);
+        layout->ds64Offset = offset;
+      }
+    }
+    else if (memcmp(chunk, "JUNK", 4) == 0 && offset == WAV_DS64_OFFSET && size >= WAV_DS64_SIZE)
+    {
+      layout->ds64Offset = offset; // room for a ds64 chunk
+    }
+    else if (memcmp(chunk, "fmt ", 4) == 0)
+    {
+      unsigned char body[40];
+      size_t bodySize = size < sizeof(body) ? size : sizeof(body);
+      haveFormat = readHeaderBytes(fd, head, headSize, offset + 8, body, bodySize) && parseFormatChunk(body, bodySize, &layout->format);
+    }
+    else if (memcmp(chunk, "data", 4) == 0)
+    {
+      layout->dataOffset = offset + 8;
+      layout->dataSize = isRf64 && size == WAV_SIZE_LIMIT ? ds64DataSize : size;
+      return haveFormat;
+    }
+    offset += 8 + (off_t)size + (size & 1); // chunks are padded to even lengths
+  }
+  return false;
+}
+
+// sets the size fields in a copy of the first layout->dataOffset bytes of the file
+void encodeWavHeaderSizes(unsigned char *header, const WavLayout *layout)
+{
+  uint64_t riffSize = layout->dataOffset - 8 + layout->dataSize;
+  uint32_t riffSize32 = riffSize < WAV_SIZE_LIMIT ? riffSize : WAV_SIZE_LIMIT;
+  uint32_t dataSize32 = layout->dataSize < WAV_SIZE_LIMIT ? layout->dataSize : WAV_SIZE_LIMIT;
+
+  if (riffSize >= WAV_SIZE_LIMIT && layout->ds64Offset != 0)
+  {
+    // the chunk size stays as it is: 28 for the reserved JUNK, possibly more with a table
+    uint64_t sampleCount = layout->dataSize / layout->format.blockAlign;
+    unsigned char *ds64 = header + layout->ds64Offset;
+    memcpy(header, "RF64", 4);
+    memcpy(ds64, "ds64", 4);
+    memcpy(ds64 + 8, &riffSize, 8);
+    memcpy(ds64 + 16, &layout->dataSize, 8);
+    memcpy(ds64 + 24, &sampleCount, 8);
+    riffSize32 = dataSize32 = WAV_SIZE_LIMIT;
+  }
+  else if (layout->ds64Offset != 0)
+  {
+    // back under 4 GB, or never over it
+    memcpy(header, "RIFF", 4);
+    memcpy(header + layout->ds64Offset, "JUNK", 4);
+  }
+
+  memcpy(header + 4, &riffSize32, 4);
+  memcpy(header + layout->dataOffset - 4, &dataSize32, 4);
+}
+
+// rewrites the header with the sizes in layout without touching the FILE position
+bool writeWavHeaderSizes(int fd, const WavLayout *layout)
+{
+  unsigned char *header = malloc(layout->dataOffset);
+  bool written = pread(fd, header, layout->dataOffset, 0) == (ssize_t)layout->dataOffset;
+  if (written)
+  {
+    encodeWavHeaderSizes(header, layout);
+    written = pwrite(fd, header, layout->dataOffset, 0) == (ssize_t)layout->dataOffset;
+  }
+  free(header);
+  return written;
+}
+
+// makes room for a ds64 chunk in a header that has none by moving everything after
+// the form type up by one chunk, back to front so nothing is overwritten before it
+// has been copied
+bool insertDs64Chunk(int fd, WavLayout *layout)
+{
+  const size_t gap = 8 + WAV_DS64_SIZE;
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0)
+  {
+    return false;
+  }
+  printf("Converting a track with a %d byte header to RF64, this rewrites the file once.\n", WAV_LEGACY_HEADER_SIZE);
+
+  unsigned char *block = malloc(WAV_SHIFT_BLOCK_BYTES);
+  off_t end = fileStat.st_size;
+  bool moved = true;
+  while (moved && end > WAV_DS64_OFFSET)
+  {
+    size_t size = end - WAV_DS64_OFFSET < WAV_SHIFT_BLOCK_BYTES ? end - WAV_DS64_OFFSET : WAV_SHIFT_BLOCK_BYTES;
+    end -= size;
+    moved = pread(fd, block, size, end) == (ssize_t)size && pwrite(fd, block, size, end + gap) == (ssize_t)size;
+  }
+  free(block);
+  if (!moved)
+  {
+    perror("Failed to convert track to RF64");
+    return false;
+  }
+
+  unsigned char junk[8 + WAV_DS64_SIZE] = {0};
+  uint32_t junkSize = WAV_DS64_SIZE;
+  memcpy(junk, "JUNK", 4);
+  memcpy(junk + 4, &junkSize, 4);
+  if (pwrite(fd, junk, sizeof(junk), WAV_DS64_OFFSET) != sizeof(junk))
+  {
+    return false;
+  }
+  layout->ds64Offset = WAV_DS64_OFFSET;
+  layout->dataOffset += gap;
+  return true;
+}
+
+// final header for a closed take, switching to RF64 when it no longer fits RIFF
+bool finishWavHeader(int fd, WavLayout *layout)
+{
+  if (layout->dataOffset - 8 + layout->dataSize >= WAV_SIZE_LIMIT && layout->ds64Offset == 0 && !insertDs64Chunk(fd, layout))
+  {
+    return false;
+  }
+  return writeWavHeaderSizes(fd, layout);
+}
+
+WavLayout trackLayout(WavFile *wav, uint64_t dataSize)
+{
+  WavLayout layout = {wav->dataOffset, wav->ds64Offset, dataSize, wav->format};
+  return layout;
+}
+
+// HEADER CHECKPOINTS
+// The RIFF and data sizes are only final once a take is closed. While recording,
+// the disk writer rewrites them every headerCheckpointSeconds with the amount of
+// audio already handed to the kernel, so a crash or power cut loses at most the
+// last checkpoint interval instead of leaving a header that claims no audio.
+#define RECOVERY_SCAN_BYTES (64 * 1024)
+
+void setHeaderCheckpointSeconds(float seconds)
+{
+  headerCheckpointSeconds = seconds;
+}
+
+// audio bytes that are actually in the file rather than still in the direct staging
+uint64_t persistedDataSize(WavFile *wav)
+{
+  uint64_t dataSize = wav->dataSize;
+  if (wav->direct.active && wav->direct.initialFileSize >= 0)
+  {
+    off_t onDisk = wav->direct.stagingOffset > wav->direct.initialFileSize ? wav->direct.stagingOffset : wav->direct.initialFileSize;
+    uint64_t persisted = onDisk > (off_t)wav->dataOffset ? onDisk - wav->dataOffset : 0;
+    dataSize = persisted < dataSize ? persisted : dataSize;
+  }
+  return dataSize;
+}
+
+// runs on the disk writer between write batches, never on the audio thread
+void checkpointTrackHeader(WavFile *wav)
+{
+  if (wav->file == NULL)
+  {
+    return;
+  }
+  WavLayout layout = trackLayout(wav, persistedDataSize(wav));
+  writeWavHeaderSizes(fileno(wav->file), &layout);
+
+  // the staged first block still holds the header as it was when the take started
+  // and would put it back over the checkpoint on its next flush
+  DirectIO *direct = &wav->direct;
+  if (direct->active && direct->initialFileSize >= 0 && direct->stagingOffset == 0 && direct->stagingFill >= wav->dataOffset)
+  {
+    encodeWavHeaderSizes(direct->staging, &layout);
+  }
+}
+
+// true if well formed chunks run from offset exactly to the end of the file, as
+// with LIST or other metadata written after the audio
+bool chunksReachEnd(int fd, off_t offset, off_t fileSize)
+{
+  unsigned char chunk[8];
+  while (offset < fileSize)
+  {
+    if (pread(fd, chunk, 8, offset) != 8)
+    {
+      return false;
+    }
+    for (int i = 0; i < 4; i++)
+    {
+      if (chunk[i] < 0x20 || chunk[i] > 0x7e)
+      {
+        return false;
+      }
+    }
+    uint32_t size;
+    memcpy(&size, chunk + 4, 4);
+    offset += 8 + (off_t)size + (size & 1);
+  }
+  return offset == fileSize;
+}
+
+// Repairs a track left behind by a crash. Audio past the last checkpoint is
+// trusted up to the last non-zero byte: a power cut can leave allocated but never
+// written blocks at the end of the file, and those read back as zeros. Only the
+// region after the checkpoint is scanned, from the end backwards, so recovery
+// costs the same for a minute long take as for an hour long one.
+// Returns true if the file was changed.
+bool recoverWavFile(const char *filePath)
+{
+  int fd = open(filePath, O_RDWR);
+  if (fd == -1)
+  {
+    return false;
+  }
+
+  WavLayout layout;
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0 || !readWavLayout(fd, &layout))
+  {
+    close(fd); // not a layout this program understands
+    return false;
+  }
+
+  uint64_t available = fileStat.st_size - layout.dataOffset;
+  uint64_t wholeFrames = available - available % layout.format.blockAlign;
+  uint64_t headerDataSize = layout.dataSize;
+  if (headerDataSize == available ||
+      (headerDataSize < available && chunksReachEnd(fd, layout.dataOffset + headerDataSize + (headerDataSize & 1), fileStat.st_size)))
+  {
+    close(fd); // closed cleanly
+    return false;
+  }
+
+  uint64_t checkpointed = headerDataSize < wholeFrames ? headerDataSize : wholeFrames;
+  uint64_t end = wholeFrames;
+  unsigned char *scan = malloc(RECOVERY_SCAN_BYTES);
+  while (end > checkpointed)
+  {
+    size_t chunk = end - checkpointed < RECOVERY_SCAN_BYTES ? end - checkpointed : RECOVERY_SCAN_BYTES;
+    if (pread(fd, scan, chunk, layout.dataOffset + end - chunk) != (ssize_t)chunk)
+    {
+      break;
+    }
+    size_t i = chunk;
+    while (i > 0 && scan[i - 1] == 0)
+    {
+      i--;
+    }
+    if (i > 0)
+    {
+      end -= chunk - i;
+      break;
+    }
+    end -= chunk;
+  }
+  free(scan);
+
+  // never cut a sample in half
+  end = (end + layout.format.blockAlign - 1) / layout.format.blockAlign * layout.format.blockAlign;
+  if (end > wholeFrames)
+  {
+    end = wholeFrames;
+  }
+
+  bool repaired = true;
+  if (end < available && ftruncate(fd, layout.dataOffset + end) != 0)
+  {
+    repaired = false;
+  }
+  layout.dataSize = end;
+  repaired = repaired && finishWavHeader(fd, &layout);
+#if defined(__linux__)
+  fdatasync(fd);
+#else
+  fsync(fd);
+#endif
+  close(fd);
+
+  if (repaired)
+  {
+    printf("Recovered %s: header had %llu bytes of audio, file has %llu.\n", filePath, (unsigned long long)headerDataSize, (unsigned long long)end);
+  }
+  else
+  {
+    perror("Failed to repair track header");
+  }
+  return repaired;
+}
+
+// checks every trackN.wav in directoryPath and repairs the ones that were not closed
+// cleanly. Returns the number of repaired files.
+int recoverTrackFiles(const char *directoryPath)
+{
+  int repaired = 0;
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    char filename[32];
+    snprintf(filename, sizeof(filename), "track%zu.wav", i + 1);
+    char *filePath = malloc(strlen(directoryPath) + strlen(filename) + 2);
+    sprintf(filePath, "%s/%s", directoryPath, filename);
+    if (recoverWavFile(filePath))
+    {
+      repaired++;
+    }
+    free(filePath);
+  }
+  return repaired;
+}
+
+// writes the header of a new, empty file in the format of kernels
+void writeNewWavHeader(WavFile *wav, short numChannels, const SampleKernels *kernels)
+{
+  int headerSize = WAV_HEADER_SIZE;
+  int ds64Size = WAV_DS64_SIZE;
+  unsigned char ds64Reserved[WAV_DS64_SIZE] = {0};
+  int subchunk1Size = 16; // PCM
+  short audioFormat = kernels->formatTag; // PCM, or IEEE float for float sessions
+  short bitsPerSample = kernels->bytesPerSample * 8;
+  int byteRate = sampleRate * numChannels * kernels->bytesPerSample;
+  short blockAlign = numChannels * kernels->bytesPerSample;
+  int zero = 0;
+
+  wav->dataOffset = headerSize;
+  wav->ds64Offset = WAV_DS64_OFFSET;
+  wav->format = (WavFormat){audioFormat, numChannels, sampleRate, bitsPerSample, blockAlign};
+  wav->headerStale = true; // the placeholder sizes have to be filled in
+  wav->dataSize = 0;
+
+  // Write proper RIFF header
+  fwrite("RIFF", 1, 4, wav->file); // ChunkID
+  fwrite(&zero, 4, 1, wav->file);  // ChunkSize (placeholder)
+  fwrite("WAVE", 1, 4, wav->file); // Format
+
+  fwrite("JUNK", 1, 4, wav->file);                   // becomes ds64 if the take passes 4 GB
+  fwrite(&ds64Size, 4, 1, wav->file);                // JUNK size
+  fwrite(ds64Reserved, 1, WAV_DS64_SIZE, wav->file); // room for the 64 bit sizes
+
+  fwrite("fmt ", 1, 4, wav->file);         // Subchunk1ID
+  fwrite(&subchunk1Size, 4, 1, wav->file); // Subchunk1Size
+  fwrite(&audioFormat, 2, 1, wav->file);   // AudioFormat
+  fwrite(&numChannels, 2, 1, wav->file);   // NumChannels
+  fwrite(&sampleRate, 4, 1, wav->file);    // SampleRate
+  fwrite(&byteRate, 4, 1, wav->file);      // ByteRate
+  fwrite(&blockAlign, 2, 1, wav->file);    // BlockAlign
+  fwrite(&bitsPerSample, 2, 1, wav->file); // BitsPerSample
+
+  fwrite("data", 1, 4, wav->file); // Subchunk2ID
+  fwrite(&zero, 4, 1, wav->file);  // Subchunk2Size (placeholder)
+  fflush(wav->file);               // audio is written with pwrite from here on
+
+  wav->writePosition = headerSize;
+}
+
+void openWavFile(WavFile *wav, char *filename, char *directoryPath, short numChannels)
+{
+  char *filePath = malloc(strlen(directoryPath) + strlen(filename) + 2); // +2 for '/' and '\0'
+  sprintf(filePath, "%s/%s", directoryPath, filename);
+
+  bool fileExists = access(filePath, F_OK) != -1;
+
+  short audioFormat = sampleKernels->formatTag; // PCM, or IEEE float for float sessions
+  short blockAlign = numChannels * (bitDepth / 8);
+
+  wav->file = fopen(filePath, fileExists ? "r+b" : "w+b");
+  if (!wav->file)
+  {
+    perror("Failed to open file");
+    free(filePath);
+    return;
+  }
+
+  wav->map = NULL;
+  wav->mapSize = 0;
+  wav->editStart = 0;
+  wav->editEnd = 0;
+  resetWritebackState(&wav->writeback);
+
+  if (!fileExists)
+  {
+    writeNewWavHeader(wav, numChannels, sampleKernels);
+  }
+  else
+  {
+    struct stat fileStat;
+    fstat(fileno(wav->file), &fileStat);
+    WavLayout layout;
+    if (!readWavLayout(fileno(wav->file), &layout))
+    {
+      // unreadable header, assume the classic 44 bytes in the session format and trust the file size
+      layout.dataOffset = WAV_LEGACY_HEADER_SIZE;
+      layout.ds64Offset = 0;
+      layout.dataSize = UINT64_MAX;
+      layout.format = (WavFormat){audioFormat, numChannels, sampleRate, bitDepth, blockAlign};
+    }
+    uint64_t inFile = (uint64_t)fileStat.st_size > layout.dataOffset ? fileStat.st_size - layout.dataOffset : 0;
+    wav->dataOffset = layout.dataOffset;
+    wav->ds64Offset = layout.ds64Offset;
+    wav->format = layout.format;
+    wav->headerStale = false;
+    wav->dataSize = layout.dataSize < inFile ? layout.dataSize : inFile;
+
+    // Seek to overwrite position
+    uint64_t byteOffset = secondsToFrames(startTimeInSeconds) * wav->format.blockAlign;
+    off_t overwriteStartPos = wav->dataOffset + byteOffset;
+
+    fseek(wav->file, overwriteStartPos, SEEK_SET);
+    wav->writePosition = overwriteStartPos;
+  }
+
+  free(filePath);
+}
+
+void closeWavFile(WavFile *wav)
+{
+  uint64_t finalDataSize = wav->dataSize;
+
+  if (wav->file == NULL)
+  {
+    return;
+  }
+
+  unmapTrack(wav);
+  closeDirectIO(wav);
+  fflush(wav->file);
+  finishWriteback(&wav->writeback, fileno(wav->file));
+
+  // files that were only played keep their header exactly as it was
+  WavLayout layout = trackLayout(wav, finalDataSize);
+  if (wav->headerStale && finishWavHeader(fileno(wav->file), &layout))
+  {
+    wav->dataOffset = layout.dataOffset;
+    wav->ds64Offset = layout.ds64Offset;
+  }
+
+  fclose(wav->file);
+  wav->file = NULL;
+}
+
+// REEL STORAGE
+// Header layout (little endian):
+//   0  "TSRL"         4  version       8  header size   12 track count
+//   16 sample rate    20 bit depth     22 format tag    24 chunk frames
+//   32 frames per track (u64 each)
+//   4088 edits.log length when the track files were last exported (version 2 on)
+#define REEL_FILENAME "session.reel"
+#define REEL_VERSION 2
+#define REEL_HEADER_SIZE 4096
+#define REEL_CHUNK_FRAMES 32768
+#define REEL_GROW_CHUNKS 64 // chunks reserved at a time as a take runs past the end
+#define REEL_EXPORTED_OFFSET (REEL_HEADER_SIZE - 8)
+#define REEL_MAX_TRACKS ((REEL_EXPORTED_OFFSET - 32) / 8)
+#define REEL_NEVER_EXPORTED UINT64_MAX
+
+Reel reel = {-1};
+
+void setSessionStorage(SessionStorage storage)
+{
+  sessionStorage = storage;
+}
+
+off_t reelChunkOffset(size_t chunk)
+{
+  return REEL_HEADER_SIZE + (off_t)chunk * reel.chunkBytes;
+}
+
+unsigned char *reelTrackBlock(int track)
+{
+  return reel.chunkBuffer + (size_t)track * reel.chunkFrames * (bitDepth / 8);
+}
+
+uint64_t reelLengthFrames()
+{
+  uint64_t length = 0;
+  for (int t = 0; t < reel.trackCount; t++)
+  {
+    if (reel.trackFrames[t] > length)
+    {
+      length = reel.trackFrames[t];
+    }
+  }
+  return length;
+}
+
+// tracks present on both the reel and the current device
+int reelSharedTrackCount()
+{
+  return reel.trackCount < recorder.trackCount ? reel.trackCount : recorder.trackCount;
+}
+
+void writeReelHeader()
+{
+  unsigned char header[REEL_HEADER_SIZE] = {0};
+  uint32_t version = REEL_VERSION, headerSize = REEL_HEADER_SIZE, trackCount = reel.trackCount;
+  uint32_t rate = sampleRate, chunkFrames = reel.chunkFrames;
+  uint16_t depth = bitDepth;
+
+  memcpy(header, "TSRL", 4);
+  memcpy(header + 4, &version, 4);
+  memcpy(header + 8, &headerSize, 4);
+  memcpy(header + 12, &trackCount, 4);
+  memcpy(header + 16, &rate, 4);
+  memcpy(header + 20, &depth, 2);
+  memcpy(header + 22, &sampleKernels->formatTag, 2);
+  memcpy(header + 24, &chunkFrames, 4);
+  memcpy(header + 32, reel.trackFrames, sizeof(uint64_t) * reel.trackCount);
+  memcpy(header + REEL_EXPORTED_OFFSET, &reel.exportedJournalLength, 8);
+
+  if (pwrite(reel.fd, header, REEL_HEADER_SIZE, 0) != REEL_HEADER_SIZE)
+  {
+    perror("Failed to write reel header");
+  }
+}
+
+void closeReel()
+{
+  if (reel.fd == -1)
+  {
+    return;
+  }
+  finishWriteback(&reel.writeback, reel.fd);
+  writeReelHeader();
+  close(reel.fd);
+  free(reel.trackFrames);
+  free(reel.chunkBuffer);
+  reel.fd = -1;
+  reel.trackFrames = NULL;
+  reel.chunkBuffer = NULL;
+}
+
+// opens appDirPath/session.reel, creating it for the current device when missing
+bool openReel()
+{
+  closeReel();
+
+  // reel sessions have no per-track files open
+  for (size_t t = 0; t < recorder.trackCount; t++)
+  {
+    closeWavFile(&recorder.tracks[t]);
+    recorder.tracks[t].dataSize = 0;
+  }
+
+  char *filePath = malloc(strlen(appDirPath) + strlen(REEL_FILENAME) + 2);
+  sprintf(filePath, "%s/%s", appDirPath, REEL_FILENAME);
+  reel.fd = open(filePath, O_RDWR | O_CREAT, 0644);
+  free(filePath);
+  if (reel.fd == -1)
+  {
+    perror("Failed to open reel");
+    return false;
+  }
+
+  unsigned char header[REEL_HEADER_SIZE];
+  ssize_t headerRead = pread(reel.fd, header, REEL_HEADER_SIZE, 0);
+  if (headerRead == REEL_HEADER_SIZE && memcmp(header, "TSRL", 4) == 0)
+  {
+    uint32_t version, trackCount, rate, chunkFrames;
+    uint16_t depth, formatTag;
+    memcpy(&version, header + 4, 4);
+    memcpy(&trackCount, header + 12, 4);
+    memcpy(&rate, header + 16, 4);
+    memcpy(&depth, header + 20, 2);
+    memcpy(&formatTag, header + 22, 2);
+    memcpy(&chunkFrames, header + 24, 4);
+    formatTag = formatTag == 0 ? WAVE_FORMAT_PCM : formatTag; // reels from before float sessions
+    if (rate != sampleRate || depth != bitDepth || formatTag != sampleKernels->formatTag || trackCount == 0 || trackCount > REEL_MAX_TRACKS || chunkFrames == 0)
+    {
+      printf("Error: Reel format (%u tracks, %u Hz, %u bit) does not match this session.\n", trackCount, rate, depth);
+      close(reel.fd);
+      reel.fd = -1;
+      return false;
+    }
+    reel.trackCount = trackCount;
+    reel.chunkFrames = chunkFrames;
+    reel.trackFrames = calloc(reel.trackCount, sizeof(uint64_t));
+    memcpy(reel.trackFrames, header + 32, sizeof(uint64_t) * reel.trackCount);
+    reel.exportedJournalLength = REEL_NEVER_EXPORTED; // reels from before exports were tracked
+    if (version >= 2)
+    {
+      memcpy(&reel.exportedJournalLength, header + REEL_EXPORTED_OFFSET, 8);
+    }
+  }
+  else
+  {
+    // new reel laid out for the tracks of the current device
+    reel.trackCount = recorder.trackCount < REEL_MAX_TRACKS ? recorder.trackCount : REEL_MAX_TRACKS;
+    reel.chunkFrames = REEL_CHUNK_FRAMES;
+    reel.trackFrames = calloc(reel.trackCount, sizeof(uint64_t));
+    reel.exportedJournalLength = REEL_NEVER_EXPORTED;
+    writeReelHeader();
+  }
+
+  reel.chunkBytes = reel.chunkFrames * reel.trackCount * (bitDepth / 8);
+  reel.chunkBuffer = malloc(reel.chunkBytes);
+  reel.cachedChunk = -1;
+  reel.editFirst = 0;
+  reel.editEnd = 0;
+  resetWritebackState(&reel.writeback);
+  if (reel.trackFrames == NULL || reel.chunkBuffer == NULL)
+  {
+    printf("Error: Failed to allocate reel buffers.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  struct stat fileStat;
+  fstat(reel.fd, &fileStat);
+  reel.allocatedChunks = fileStat.st_size > REEL_HEADER_SIZE ? (fileStat.st_size - REEL_HEADER_SIZE) / reel.chunkBytes : 0;
+
+  size_t bytesPerSample = bitDepth / 8;
+  for (int t = 0; t < reelSharedTrackCount(); t++)
+  {
+    recorder.tracks[t].dataSize = reel.trackFrames[t] * bytesPerSample;
+  }
+  return true;
+}
+
+// brings a chunk into chunkBuffer, reading it only if it can hold recorded audio
+void loadReelChunk(size_t chunk)
+{
+  if (reel.cachedChunk == (long)chunk)
+  {
+    return;
+  }
+  memset(reel.chunkBuffer, 0, reel.chunkBytes);
+  if (chunk * reel.chunkFrames < reelLengthFrames() && chunk < reel.allocatedChunks)
+  {
+    if (pread(reel.fd, reel.chunkBuffer, reel.chunkBytes, reelChunkOffset(chunk)) < 0)
+    {
+      perror("Failed to read reel chunk");
+    }
+  }
+  reel.cachedChunk = chunk;
+}
+
+// moves queued audio of the armed tracks into the reel one chunk at a time.
+// Unless flushing, a chunk is only written once every armed track can complete it.
+void drainReel(bool flushAll)
+{
+  if (reel.fd == -1)
+  {
+    return;
+  }
+
+  size_t bytesPerSample = bitDepth / 8;
+  while (true)
+  {
+    size_t availableFrames = SIZE_MAX;
+    for (int t = 0; t < reelSharedTrackCount(); t++)
+    {
+      if (recorder.tracks[t].recordEnabled)
+      {
+        size_t frames = ringBufferFill(&recorder.tracks[t].recordRing) / bytesPerSample;
+        availableFrames = frames < availableFrames ? frames : availableFrames;
+      }
+    }
+    if (availableFrames == SIZE_MAX || availableFrames == 0)
+    {
+      return;
+    }
+
+    size_t chunk = reel.writeFrame / reel.chunkFrames;
+    size_t offsetInChunk = reel.writeFrame % reel.chunkFrames;
+    size_t framesToChunkEnd = reel.chunkFrames - offsetInChunk;
+    if (!flushAll && availableFrames < framesToChunkEnd)
+    {
+      return;
+    }
+    size_t frames = availableFrames < framesToChunkEnd ? availableFrames : framesToChunkEnd;
+
+    loadReelChunk(chunk);
+    for (int t = 0; t < reelSharedTrackCount(); t++)
+    {
+      WavFile *track = &recorder.tracks[t];
+      if (!track->recordEnabled)
+      {
+        continue;
+      }
+      ringBufferRead(&track->recordRing, reelTrackBlock(t) + offsetInChunk * bytesPerSample, frames * bytesPerSample);
+      if (reel.trackFrames[t] < reel.writeFrame + frames)
+      {
+        reel.trackFrames[t] = reel.writeFrame + frames;
+        track->dataSize = reel.trackFrames[t] * bytesPerSample;
+      }
+    }
+
+    if (chunk >= reel.allocatedChunks)
+    {
+      size_t chunks = chunk + REEL_GROW_CHUNKS;
+      if (preallocateFile(reel.fd, REEL_HEADER_SIZE, (off_t)chunks * reel.chunkBytes) == 0)
+      {
+        reel.allocatedChunks = chunks;
+      }
+    }
+    if (pwrite(reel.fd, reel.chunkBuffer, reel.chunkBytes, reelChunkOffset(chunk)) != (ssize_t)reel.chunkBytes)
+    {
+      perror("Failed to write reel chunk");
+    }
+    noteFileWritten(&reel.writeback, reel.fd, reelChunkOffset(chunk), reelChunkOffset(chunk) + reel.chunkBytes);
+    if (reel.editFirst == reel.editEnd)
+    {
+      reel.editFirst = reel.writeFrame;
+    }
+    reel.writeFrame += frames;
+    reel.editEnd = reel.writeFrame;
+  }
+}
+
+// loads the rest of the current chunk into every track's playback ring, returns frames added
+size_t prefetchReel()
+{
+  if (reel.fd == -1)
+  {
+    return 0;
+  }
+
+  size_t bytesPerSample = bitDepth / 8;
+  size_t offsetInChunk = reel.readFrame % reel.chunkFrames;
+  size_t frames = reel.chunkFrames - offsetInChunk;
+  uint64_t length = reelLengthFrames();
+  if (reel.readFrame >= length)
+  {
+    for (int t = 0; t < reelSharedTrackCount(); t++)
+    {
+      atomic_store(&recorder.tracks[t].prefetchEnded, true);
+    }
+    return 0;
+  }
+  if (frames > length - reel.readFrame)
+  {
+    frames = length - reel.readFrame;
+  }
+
+  // wait until every track can take the whole span so the tracks stay in step
+  for (int t = 0; t < reelSharedTrackCount(); t++)
+  {
+    RingBuffer *ring = &recorder.tracks[t].playbackRing;
+    if (ring->capacity - ringBufferFill(ring) < frames * bytesPerSample)
+    {
+      return 0;
+    }
+  }
+
+  loadReelChunk(reel.readFrame / reel.chunkFrames);
+  for (int t = 0; t < reelSharedTrackCount(); t++)
+  {
+    WavFile *track = &recorder.tracks[t];
+    if (atomic_load(&track->prefetchEnded))
+    {
+      continue;
+    }
+    uint64_t trackFrames = reel.trackFrames[t] > reel.readFrame ? reel.trackFrames[t] - reel.readFrame : 0;
+    if (trackFrames > frames)
+    {
+      trackFrames = frames;
+    }
+    ringBufferWrite(&track->playbackRing, reelTrackBlock(t) + offsetInChunk * bytesPerSample, trackFrames * bytesPerSample);
+    track->prefetchOffset += trackFrames * bytesPerSample;
+    if (reel.readFrame + frames >= reel.trackFrames[t])
+    {
+      atomic_store(&track->prefetchEnded, true);
+    }
+  }
+  reel.readFrame += frames;
+  return frames;
+}
+
+// bookkeeping after size bytes were stored at wav->writePosition
+void finishTrackWrite(WavFile *wav, size_t size)
+{
+  off_t start = wav->writePosition;
+  wav->writePosition += size;
+  wav->headerStale = true;
+
+  // widen the range this pass has touched
+  uint64_t editStart = start - wav->dataOffset;
+  uint64_t editEnd = wav->writePosition - wav->dataOffset;
+  if (wav->editStart == wav->editEnd)
+  {
+    wav->editStart = editStart;
+    wav->editEnd = editEnd;
+  }
+  else if (size > 0)
+  {
+    wav->editStart = editStart < wav->editStart ? editStart : wav->editStart;
+    wav->editEnd = editEnd > wav->editEnd ? editEnd : wav->editEnd;
+  }
+
+  // Update dataSize based on whether the new data extends beyond the original dataSize
+  uint64_t newDataSize = wav->writePosition - wav->dataOffset;
+  if (newDataSize > wav->dataSize)
+  {
+    wav->dataSize = newDataSize;
+  }
+
+  if (!wav->direct.active)
+  {
+    noteFileWritten(&wav->writeback, fileno(wav->file), start, wav->writePosition);
+  }
+}
+
+void writeWavData(WavFile *wav, const void *data, size_t dataSize)
+{
+  size_t written = writeTrackAt(wav, wav->writePosition, data, dataSize);
+  finishTrackWrite(wav, written);
+}
+
+// TRACK FORMATS
+// Tracks are played and recorded as raw session samples (mono, sampleRate,
+// sampleFormat), so a trackN.wav in any other format is either refused or
+// rewritten before the engine touches its audio, depending on formatMismatchPolicy.
+#define CONVERT_BLOCK_FRAMES 65536
+
+void setFormatMismatchPolicy(FormatMismatchPolicy policy)
+{
+  formatMismatchPolicy = policy;
+}
+
+bool wavFormatMatchesSession(const WavFormat *format)
+{
+  return format->formatTag == sampleKernels->formatTag && format->channels == 1 && format->sampleRate == (uint32_t)sampleRate &&
+         format->bitsPerSample == bitDepth && format->blockAlign == bitDepth / 8;
+}
+
+// formats decodeSample understands
+bool wavFormatSupported(const WavFormat *format)
+{
+  bool pcm = format->formatTag == WAVE_FORMAT_PCM && format->bitsPerSample % 8 == 0 && format->bitsPerSample >= 8 && format->bitsPerSample <= 32;
+  bool ieee = format->formatTag == WAVE_FORMAT_IEEE_FLOAT && (format->bitsPerSample == 32 || format->bitsPerSample == 64);
+  return (pcm || ieee) && format->blockAlign == format->channels * (format->bitsPerSample / 8);
+}
+
+// one sample as a left aligned 32 bit integer
+int32_t decodeSample(const unsigned char *sample, const WavFormat *format)
+{
+  if (format->formatTag == WAVE_FORMAT_IEEE_FLOAT)
+  {
+    double value;
+    if (format->bitsPerSample == 64)
+    {
+      memcpy(&value, sample, 8);
+    }
+    else
+    {
+      float single;
+      memcpy(&single, sample, 4);
+      value = single;
+    }
+    value = value < -1.0 ? -1.0 : (value > 1.0 ? 1.0 : value);
+    return (int32_t)lrint(value * 2147483647.0);
+  }
+
+  switch (format->bitsPerSample)
+  {
+  case 8:
+    return (int32_t)((uint32_t)(sample[0] ^ 0x80) << 24); // 8 bit PCM is unsigned
+  case 16:
+    return (int32_t)((uint32_t)sample[0] << 16 | (uint32_t)sample[1] << 24);
+  case 24:
+    return (int32_t)((uint32_t)sample[0] << 8 | (uint32_t)sample[1] << 16 | (uint32_t)sample[2] << 24);
+  default:
+    return (int32_t)((uint32_t)sample[0] | (uint32_t)sample[1] << 8 | (uint32_t)sample[2] << 16 | (uint32_t)sample[3] << 24);
+  }
+}
+
+// Rewrites a track in the session format: samples are converted to sampleFormat and
+// multichannel files are averaged down to mono. The original is renamed to
+// trackN.original.wav first and never modified. The track is left closed.
+bool convertTrackFile(WavFile *wav, char *filename)
+{
+  WavFormat source = wav->format;
+  size_t sourceOffset = wav->dataOffset;
+  uint64_t sourceFrames = wav->dataSize / source.blockAlign;
+  fclose(wav->file); // nothing was written, the header stays as it is
+  wav->file = NULL;
+
+  if (!wavFormatSupported(&source) || source.sampleRate != (uint32_t)sampleRate)
+  {
+    printf("Error: %s cannot be converted here (format %u, %u Hz), import it instead.\n", filename, source.formatTag, source.sampleRate);
+    return false;
+  }
+
+  char *filePath = malloc(strlen(appDirPath) + strlen(filename) + 2);
+  sprintf(filePath, "%s/%s", appDirPath, filename);
+  char *backupPath = malloc(strlen(filePath) + strlen(".original") + 1);
+  sprintf(backupPath, "%.*s.original.wav", (int)(strlen(filePath) - strlen(".wav")), filePath);
+  bool moved = access(backupPath, F_OK) == -1 && rename(filePath, backupPath) == 0;
+  int fd = moved ? open(backupPath, O_RDONLY) : -1;
+  if (fd == -1)
+  {
+    printf("Error: Could not keep the original of %s as %s, not converting it.\n", filename, backupPath);
+    free(backupPath);
+    free(filePath);
+    return false;
+  }
+
+  printf("Converting %s (%u channels, %u bit) to the session format, original kept as %s.\n", filename, source.channels, source.bitsPerSample, backupPath);
+  double savedStartTime = startTimeInSeconds;
+  startTimeInSeconds = 0;
+  openWavFile(wav, filename, appDirPath, 1);
+  startTimeInSeconds = savedStartTime;
+
+  size_t bytesPerSample = bitDepth / 8;
+  size_t sourceBytesPerSample = source.bitsPerSample / 8;
+  unsigned char *input = malloc(CONVERT_BLOCK_FRAMES * source.blockAlign);
+  unsigned char *output = malloc(CONVERT_BLOCK_FRAMES * bytesPerSample);
+  int32_t *mixed = malloc(CONVERT_BLOCK_FRAMES * sizeof(int32_t));
+  for (uint64_t frame = 0; wav->file != NULL && frame < sourceFrames; frame += CONVERT_BLOCK_FRAMES)
+  {
+    size_t frames = sourceFrames - frame < CONVERT_BLOCK_FRAMES ? sourceFrames - frame : CONVERT_BLOCK_FRAMES;
+    ssize_t readBytes = pread(fd, input, frames * source.blockAlign, sourceOffset + frame * source.blockAlign);
+    frames = readBytes > 0 ? readBytes / source.blockAlign : 0;
+    if (frames == 0)
+    {
+      break;
+    }
+    for (size_t i = 0; i < frames; i++)
+    {
+      const unsigned char *sourceFrame = input + i * source.blockAlign;
+      int64_t sum = 0;
+      for (uint16_t channel = 0; channel < source.channels; channel++)
+      {
+        sum += decodeSample(sourceFrame + channel * sourceBytesPerSample, &source);
+      }
+      mixed[i] = (int32_t)(sum / source.channels);
+    }
+    sampleKernels->fromInt32(mixed, output, frames);
+    writeWavData(wav, output, frames * bytesPerSample);
+  }
+
+  free(input);
+  free(output);
+  free(mixed);
+  close(fd);
+  bool converted = wav->file != NULL;
+  closeWavFile(wav);
+  free(backupPath);
+  free(filePath);
+  return converted;
+}
+
+// called right after a track file is opened; leaves it open only if the engine
+// can use it as it is (or after converting it)
+void resolveTrackFormat(WavFile *wav, char *filename)
+{
+  if (wav->file == NULL || wavFormatMatchesSession(&wav->format))
+  {
+    return;
+  }
+
+  printf("Warning: %s is %u channel, %u Hz, %u bit (format %u), the session is mono, %d Hz, %d bit.\n", filename, wav->format.channels,
+         wav->format.sampleRate, wav->format.bitsPerSample, wav->format.formatTag, sampleRate, bitDepth);
+  if (formatMismatchPolicy == FORMAT_MISMATCH_CONVERT && convertTrackFile(wav, filename))
+  {
+    openWavFile(wav, filename, appDirPath, 1);
+    return;
+  }
+
+  if (wav->file != NULL)
+  {
+    fclose(wav->file); // nothing was written, the header stays as it is
+    wav->file = NULL;
+  }
+  printf("Warning: %s is not used; the track stays silent and cannot record.\n", filename);
+}
+
+void openTrackFiles()
+{
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    char filename[20];
+    snprintf(filename, sizeof(filename), "track%zu.wav", i + 1);
+    closeWavFile(&recorder.tracks[i]); // from an earlier initTracks, if any
+    openWavFile(&recorder.tracks[i], filename, appDirPath, 1);
+    resolveTrackFormat(&recorder.tracks[i], filename);
+
+    if (useDirectIO && recorder.tracks[i].file != NULL)
+    {
+      // the header has to be on disk before the direct descriptor reads it back
+      fflush(recorder.tracks[i].file);
+      char *filePath = malloc(strlen(appDirPath) + strlen(filename) + 2);
+      sprintf(filePath, "%s/%s", appDirPath, filename);
+      openDirectIO(&recorder.tracks[i], filePath);
+      free(filePath);
+    }
+  }
+}
+
+void initTracks(const uint32_t *inputTrackRecordEnabledStates)
+{
+  if (sessionStorage == STORAGE_REEL)
+  {
+    openReel();
+  }
+  else
+  {
+    openTrackFiles();
+  }
+
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    // a refused track file has nothing to record into
+    bool recordable = sessionStorage == STORAGE_REEL || recorder.tracks[i].file != NULL;
+    if (inputTrackRecordEnabledStates && inputTrackRecordEnabledStates[i] == 1 && recordable)
+    {
+      recorder.tracks[i].recordEnabled = true;
+      reserveTakeSpace(&recorder.tracks[i]);
+    }
+    else
+    {
+      recorder.tracks[i].recordEnabled = false;
+    }
+
+    recorder.tracks[i].currentAmplitudeLevel = -100; //  a minimum signal level for now
+    recorder.tracks[i].currentPeakLevel = -100;
+    atomic_store(&recorder.tracks[i].clippedSamples, 0);
+
+    // preallocate the rings so the callback never has to
+    size_t bytesPerSample = bitDepth / 8;
+    prepareRingBuffer(&recorder.tracks[i].recordRing, (size_t)(sampleRate * recordRingSeconds) * bytesPerSample);
+    prepareRingBuffer(&recorder.tracks[i].playbackRing, (size_t)(sampleRate * playbackRingSeconds) * bytesPerSample);
+    atomic_store(&recorder.tracks[i].playbackUnderrunCount, 0);
+    atomic_store(&recorder.tracks[i].writeFailureCount, 0);
+    recorder.tracks[i].recordMissingBytes = 0;
+    recorder.tracks[i].playbackMissingBytes = 0;
+  }
+}
+
+// EDIT JOURNAL
+// Every pass that writes a track file appends the frames it touched to edits.log in
+// the session directory, one "track firstFrame endFrame" line each. A bounce
+// remembers how long the journal was when it read the tracks, so a re-bounce only
+// has to render what was appended since.
+#define EDIT_JOURNAL_NAME "edits.log"
+
+char *editJournalPath()
+{
+  char *path = malloc(strlen(appDirPath) + strlen(EDIT_JOURNAL_NAME) + 2);
+  sprintf(path, "%s/%s", appDirPath, EDIT_JOURNAL_NAME);
+  return path;
+}
+
+// trackN.wav in the session directory, N one based
+char *trackFilePath(int trackIndex)
+{
+  char filename[32];
+  snprintf(filename, sizeof(filename), "track%d.wav", trackIndex + 1);
+  char *filePath = malloc(strlen(appDirPath) + strlen(filename) + 2);
+  sprintf(filePath, "%s/%s", appDirPath, filename);
+  return filePath;
+}
+
+void noteTrackEdit(int trackIndex, uint64_t firstFrame, uint64_t endFrame)
+{
+  if (appDirPath == NULL || endFrame <= firstFrame)
+  {
+    return;
+  }
+  char *path = editJournalPath();
+  FILE *journal = fopen(path, "a");
+  free(path);
+  if (journal == NULL)
+  {
+    return;
+  }
+  fprintf(journal, "%d %llu %llu\n", trackIndex, (unsigned long long)firstFrame, (unsigned long long)endFrame);
+  fclose(journal);
+}
+
+uint64_t editJournalLength()
+{
+  char *path = editJournalPath();
+  struct stat journalStat;
+  uint64_t length = stat(path, &journalStat) == 0 ? journalStat.st_size : 0;
+  free(path);
+  return length;
+}
+
+void closeWavFiles()
+{
+  if (sessionStorage == STORAGE_REEL)
+  {
+    // the take is journaled like a track file pass, for re-bounces and for the
+    // next export to the track files
+    for (int t = 0; reel.fd != -1 && t < reelSharedTrackCount(); t++)
+    {
+      if (recorder.tracks[t].recordEnabled)
+      {
+        noteTrackEdit(t, reel.editFirst, reel.editEnd);
+      }
+    }
+    closeReel();
+    return;
+  }
+  size_t bytesPerSample = bitDepth / 8;
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    WavFile *track = &recorder.tracks[i];
+    if (track->file != NULL && track->editEnd > track->editStart)
+    {
+      noteTrackEdit(i, track->editStart / bytesPerSample, (track->editEnd + bytesPerSample - 1) / bytesPerSample);
+    }
+    closeWavFile(track);
+  }
+}
+
+// bounces export from the pool while the UI thread may export too
+pthread_mutex_t reelExportLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Brings every reel track's standalone trackN.wav in appDirPath up to date, reading
+// the reel once front to back. Only the frames journaled since the last export are
+// written into files that already hold the rest; a track file that is missing, in
+// another format or not the length the journal accounts for is rewritten whole.
+int exportReelToTrackFiles()
+{
+  pthread_mutex_lock(&reelExportLock);
+  bool wasOpen = reel.fd != -1;
+  if (!wasOpen && !openReel())
+  {
+    pthread_mutex_unlock(&reelExportLock);
+    return 1;
+  }
+
+  size_t bytesPerSample = bitDepth / 8;
+  uint64_t *dirtyFirst = calloc(reel.trackCount, sizeof(uint64_t));
+  uint64_t *dirtyEnd = calloc(reel.trackCount, sizeof(uint64_t));
+  WavFile *exported = calloc(reel.trackCount, sizeof(WavFile));
+  if (dirtyFirst == NULL || dirtyEnd == NULL || exported == NULL)
+  {
+    printf("Memory allocation failed for reel export.\n");
+    free(dirtyFirst);
+    free(dirtyEnd);
+    free(exported);
+    if (!wasOpen)
+    {
+      closeReel();
+    }
+    pthread_mutex_unlock(&reelExportLock);
+    return 1;
+  }
+
+  // what changed since the last export: the journal, plus a take still being written
+  uint64_t journalLength = editJournalLength();
+  bool journaled = reel.exportedJournalLength != REEL_NEVER_EXPORTED && journalLength >= reel.exportedJournalLength;
+  char *journalPath = editJournalPath();
+  FILE *journal = journaled ? fopen(journalPath, "r") : NULL;
+  free(journalPath);
+  journaled = journaled && (reel.exportedJournalLength == 0 || (journal != NULL && fseeko(journal, reel.exportedJournalLength, SEEK_SET) == 0));
+  int track;
+  unsigned long long first, end;
+  while (journaled && journal != NULL && fscanf(journal, "%d %llu %llu", &track, &first, &end) == 3)
+  {
+    if (track < 0 || track >= reel.trackCount || end <= first)
+    {
+      continue;
+    }
+    bool clean = dirtyFirst[track] == dirtyEnd[track];
+    dirtyFirst[track] = clean || first < dirtyFirst[track] ? first : dirtyFirst[track];
+    dirtyEnd[track] = clean || end > dirtyEnd[track] ? end : dirtyEnd[track];
+  }
+  if (journal != NULL)
+  {
+    fclose(journal);
+  }
+  for (int t = 0; wasOpen && reel.editEnd > reel.editFirst && t < reelSharedTrackCount(); t++)
+  {
+    if (recorder.tracks[t].recordEnabled)
+    {
+      bool clean = dirtyFirst[t] == dirtyEnd[t];
+      dirtyFirst[t] = clean || reel.editFirst < dirtyFirst[t] ? reel.editFirst : dirtyFirst[t];
+      dirtyEnd[t] = clean || reel.editEnd > dirtyEnd[t] ? reel.editEnd : dirtyEnd[t];
+    }
+  }
+
+  uint64_t exportFirst = UINT64_MAX, exportEnd = 0;
+  for (int t = 0; t < reel.trackCount; t++)
+  {
+    dirtyEnd[t] = dirtyEnd[t] < reel.trackFrames[t] ? dirtyEnd[t] : reel.trackFrames[t];
+    dirtyFirst[t] = dirtyFirst[t] < dirtyEnd[t] ? dirtyFirst[t] : dirtyEnd[t];
+
+    // the file has to hold everything before the dirty range and end no later than the reel
+    char *filePath = trackFilePath(t);
+    int fd = open(filePath, O_RDONLY);
+    struct stat fileStat;
+    WavLayout layout;
+    bool current = journaled && fd != -1 && fstat(fd, &fileStat) == 0 && readWavLayout(fd, &layout) && wavFormatMatchesSession(&layout.format);
+    if (current)
+    {
+      uint64_t inFile = (uint64_t)fileStat.st_size > layout.dataOffset ? fileStat.st_size - layout.dataOffset : 0;
+      uint64_t fileFrames = (layout.dataSize < inFile ? layout.dataSize : inFile) / bytesPerSample;
+      current = fileFrames == reel.trackFrames[t] || (fileFrames <= reel.trackFrames[t] && dirtyEnd[t] == reel.trackFrames[t] && dirtyFirst[t] <= fileFrames);
+    }
+    if (fd != -1)
+    {
+      close(fd);
+    }
+
+    if (current && dirtyFirst[t] == dirtyEnd[t])
+    {
+      free(filePath);
+      continue; // nothing new on the reel for this track
+    }
+    if (!current)
+    {
+      remove(filePath);
+      dirtyFirst[t] = 0;
+      dirtyEnd[t] = reel.trackFrames[t];
+    }
+    free(filePath);
+
+    char filename[32];
+    snprintf(filename, sizeof(filename), "track%d.wav", t + 1);
+    openWavFile(&exported[t], filename, appDirPath, 1); // written at explicit positions below, not from the play head
+    if (exported[t].file == NULL)
+    {
+      continue;
+    }
+    if (!current)
+    {
+      noteTrackEdit(t, 0, reel.trackFrames[t]); // rewritten as a whole
+    }
+    exportFirst = dirtyFirst[t] < exportFirst ? dirtyFirst[t] : exportFirst;
+    exportEnd = dirtyEnd[t] > exportEnd ? dirtyEnd[t] : exportEnd;
+  }
+
+  for (size_t chunk = exportFirst < exportEnd ? exportFirst / reel.chunkFrames : 0; chunk * reel.chunkFrames < exportEnd; chunk++)
+  {
+    loadReelChunk(chunk);
+    uint64_t chunkStart = chunk * reel.chunkFrames;
+    for (int t = 0; t < reel.trackCount; t++)
+    {
+      uint64_t from = dirtyFirst[t] > chunkStart ? dirtyFirst[t] : chunkStart;
+      uint64_t to = dirtyEnd[t] < chunkStart + reel.chunkFrames ? dirtyEnd[t] : chunkStart + reel.chunkFrames;
+      if (exported[t].file == NULL || from >= to)
+      {
+        continue;
+      }
+      exported[t].writePosition = exported[t].dataOffset + from * bytesPerSample;
+      writeWavData(&exported[t], reelTrackBlock(t) + (from - chunkStart) * bytesPerSample, (to - from) * bytesPerSample);
+    }
+  }
+
+  for (int t = 0; t < reel.trackCount; t++)
+  {
+    closeWavFile(&exported[t]);
+  }
+  free(exported);
+  free(dirtyFirst);
+  free(dirtyEnd);
+  reel.exportedJournalLength = editJournalLength();
+  if (!wasOpen)
+  {
+    closeReel();
+  }
+  pthread_mutex_unlock(&reelExportLock);
+  return 0;
+}
+
+// I/O ENGINE
+// Every disk cycle collects one request per track and runs the whole batch on a
+// small pool of I/O threads, so a slow file only stalls its own request and the
+// thread count stays fixed no matter how many tracks there are.
+#define IO_ENGINE_DEFAULT_THREADS 4
+
+WorkerPool ioPool;
+int ioEngineThreads = IO_ENGINE_DEFAULT_THREADS;
+pthread_once_t ioEngineOnce = PTHREAD_ONCE_INIT;
+bool ioEngineStarted = false;
+
+void setIoEngineThreads(int threadCount)
+{
+  // only takes effect before the first batch
+  if (threadCount > 0)
+  {
+    ioEngineThreads = threadCount;
+  }
+}
+
+void startIoEngine()
+{
+  ioEngineStarted = startWorkerPool(&ioPool, ioEngineThreads);
+}
+
+void performIoRequest(void *arg)
+{
+  IoRequest *request = arg;
+  off_t position = request->offset;
+  request->result = 0;
+  for (int i = 0; i < request->iovCount; i++)
+  {
+    size_t size = request->iov[i].iov_len;
+    size_t done = request->op == IO_READ
+                      ? readTrackAt(request->track, position, request->iov[i].iov_base, size)
+                      : writeTrackAt(request->track, position, request->iov[i].iov_base, size);
+    request->result += done;
+    position += done;
+    if (done < size)
+    {
+      break;
+    }
+  }
+}
+
+// runs every request, in parallel when there is more than one, and returns once all are done
+void runIoBatch(IoRequest *requests, size_t count)
+{
+  pthread_once(&ioEngineOnce, startIoEngine);
+  if (count == 1 || !ioEngineStarted)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      performIoRequest(&requests[i]);
+    }
+    return;
+  }
+
+  TaskGroup group;
+  initTaskGroup(&group);
+  for (size_t i = 0; i < count; i++)
+  {
+    submitTask(&ioPool, &group, performIoRequest, &requests[i]);
+  }
+  waitTaskGroup(&group);
+  destroyTaskGroup(&group);
+}
+
+// fills a request for a ring's regions, returns the total size it covers
+size_t setIoRegions(IoRequest *request, unsigned char *first, size_t firstSize, unsigned char *second, size_t secondSize)
+{
+  request->iov[0].iov_base = first;
+  request->iov[0].iov_len = firstSize;
+  request->iov[1].iov_base = second;
+  request->iov[1].iov_len = secondSize;
+  request->iovCount = secondSize > 0 ? 2 : 1;
+  return firstSize + secondSize;
+}
+
+// Interleaves channelCount mono tracks into one file, frameCount frames long. The
+// tracks are read bounceBlockFrames at a time, one batch per block, and each
+// interleaved block is written before the next is read, so memory stays at one
+// block per channel plus the output block however long the bounce is. A track
+// shorter than frameCount, or a NULL one, is silence.
+int bounceMonoTracksInterleaved(WavFile **monoTracks, size_t channelCount, WavFile *output, uint64_t frameCount)
+{
+  size_t bytesPerSample = bitDepth / 8;
+  size_t blockFrames = bounceBlockFrames;
+  unsigned char **blocks = calloc(channelCount, sizeof(unsigned char *));
+  unsigned char *interleavedBlock = malloc(blockFrames * channelCount * bytesPerSample);
+  IoRequest *requests = calloc(channelCount, sizeof(IoRequest));
+  int result = 0;
+  bool allocated = blocks != NULL && interleavedBlock != NULL && requests != NULL;
+  for (size_t channel = 0; allocated && channel < channelCount; channel++)
+  {
+    blocks[channel] = malloc(blockFrames * bytesPerSample);
+    allocated = blocks[channel] != NULL;
+  }
+  if (!allocated)
+  {
+    printf("Memory allocation failed for bounce blocks.\n");
+    result = 1;
+    frameCount = 0;
+  }
+
+  for (uint64_t frame = 0; frame < frameCount; frame += blockFrames)
+  {
+    size_t frames = frameCount - frame < blockFrames ? frameCount - frame : blockFrames;
+    size_t requestCount = 0;
+    for (size_t channel = 0; channel < channelCount; channel++)
+    {
+      WavFile *track = monoTracks[channel];
+      uint64_t trackFrames = track != NULL ? track->dataSize / bytesPerSample : 0;
+      uint64_t wanted = frame < trackFrames ? trackFrames - frame : 0;
+      wanted = wanted < frames ? wanted : frames;
+      memset(blocks[channel], 0, frames * bytesPerSample); // silence wherever the read falls short
+      if (wanted == 0)
+      {
+        continue;
+      }
+      IoRequest *request = &requests[requestCount];
+      request->op = IO_READ;
+      request->track = track;
+      request->offset = track->dataOffset + frame * bytesPerSample;
+      setIoRegions(request, blocks[channel], wanted * bytesPerSample, NULL, 0);
+      requestCount++;
+    }
+    runIoBatch(requests, requestCount);
+
+    interleaveSamples((const unsigned char *const *)blocks, channelCount, interleavedBlock, frames);
+
+    size_t blockBytes = frames * channelCount * bytesPerSample;
+    size_t written = writeTrackAt(output, output->writePosition, interleavedBlock, blockBytes);
+    finishTrackWrite(output, written);
+    if (written != blockBytes)
+    {
+      printf("Error: Failed to write the bounce at frame %llu.\n", (unsigned long long)frame);
+      result = 1;
+      break;
+    }
+  }
+
+  for (size_t channel = 0; blocks != NULL && channel < channelCount; channel++)
+  {
+    free(blocks[channel]);
+  }
+  free(blocks);
+  free(interleavedBlock);
+  free(requests);
+  return result;
+}
+
+// DISK WRITER
+// Drains every record ring to disk off the audio thread. Writes are held back
+// until a track has at least DISK_WRITE_CHUNK_BYTES queued so each write is large.
+#define DISK_WRITE_CHUNK_BYTES (64 * 1024)
+#define DISK_WRITER_INTERVAL_USEC 5000
+
+pthread_t diskWriterThread;
+atomic_bool diskWriterRunning = false;
+
+void drainRecordRings(bool flushAll)
+{
+  IoRequest requests[recorder.trackCount];
+  size_t count = 0;
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    WavFile *wav = &recorder.tracks[i];
+    if (!wav->recordEnabled || wav->file == NULL || wav->recordRing.data == NULL)
+    {
+      continue;
+    }
+
+    unsigned char *first, *second;
+    size_t firstSize, secondSize;
+    size_t fill = ringBufferReadRegions(&wav->recordRing, &first, &firstSize, &second, &secondSize);
+    if (fill == 0 || (!flushAll && fill < DISK_WRITE_CHUNK_BYTES))
+    {
+      continue;
+    }
+
+    requests[count].op = IO_WRITE;
+    requests[count].track = wav;
+    requests[count].offset = wav->writePosition;
+    setIoRegions(&requests[count], first, firstSize, second, secondSize);
+    count++;
+  }
+
+  runIoBatch(requests, count);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    WavFile *wav = requests[i].track;
+    size_t wanted = requests[i].iov[0].iov_len + requests[i].iov[1].iov_len;
+    size_t written = requests[i].result > 0 ? requests[i].result : 0;
+    // only what reached the file counts; the rest stays queued for the next cycle
+    finishTrackWrite(wav, written);
+    ringBufferConsume(&wav->recordRing, written);
+    if (written < wanted && atomic_fetch_add(&wav->writeFailureCount, 1) == 0)
+    {
+      printf("Error: Failed to write track %ld at byte %lld, %zu of %zu bytes written.\n", (long)(wav - recorder.tracks) + 1,
+             (long long)(wav->writePosition - written), written, wanted);
+    }
+  }
+}
+
+// rewrites the sizes in the headers of everything written so far this take
+void checkpointHeaders()
+{
+  if (sessionStorage == STORAGE_REEL)
+  {
+    writeReelHeader();
+    return;
+  }
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    if (recorder.tracks[i].recordEnabled)
+    {
+      checkpointTrackHeader(&recorder.tracks[i]);
+    }
+  }
+}
+
+void *diskWriterLoop(void *arg)
+{
+  void (*drain)(bool) = sessionStorage == STORAGE_REEL ? drainReel : drainRecordRings;
+  uint64_t lastCheckpointMs = monotonicMs();
+  while (atomic_load(&diskWriterRunning))
+  {
+    drain(false);
+    if (headerCheckpointSeconds > 0 && monotonicMs() - lastCheckpointMs >= headerCheckpointSeconds * 1000)
+    {
+      checkpointHeaders();
+      lastCheckpointMs = monotonicMs();
+    }
+    usleep(DISK_WRITER_INTERVAL_USEC);
+  }
+  // the stream is stopped by now, so whatever is left is the tail of the take
+  drain(true);
+  return NULL;
+}
+
+void startDiskWriter()
+{
+  if (atomic_load(&diskWriterRunning))
+  {
+    return;
+  }
+  reel.writeFrame = recorder.playbackPosition;
+  atomic_store(&diskWriterRunning, true);
+  if (pthread_create(&diskWriterThread, NULL, diskWriterLoop, NULL) != 0)
+  {
+    atomic_store(&diskWriterRunning, false);
+    printf("Error: Failed to start disk writer thread.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void stopDiskWriter()
+{
+  if (!atomic_load(&diskWriterRunning))
+  {
+    return;
+  }
+  atomic_store(&diskWriterRunning, false);
+  pthread_join(diskWriterThread, NULL);
+}
+
+// PLAYBACK PREFETCHER
+// Keeps every track's playback ring topped up from disk ahead of the play head
+// so the callback only ever copies from memory.
+#define PREFETCH_CHUNK_BYTES (64 * 1024)
+#define PREFETCHER_INTERVAL_USEC 5000
+
+pthread_t prefetcherThread;
+atomic_bool prefetcherRunning = false;
+
+// sets up a read filling as much of the ring as possible, false when the track
+// has nothing to read this cycle
+bool planTrackPrefetch(WavFile *wav, IoRequest *request)
+{
+  if (wav->file == NULL || atomic_load(&wav->prefetchEnded))
+  {
+    return false;
+  }
+
+  // only whole samples go in the ring so the callback never splits one
+  size_t bytesPerSample = bitDepth / 8;
+  size_t remaining = wav->dataSize > wav->prefetchOffset ? wav->dataSize - wav->prefetchOffset : 0;
+  remaining -= remaining % bytesPerSample;
+  if (remaining == 0)
+  {
+    atomic_store(&wav->prefetchEnded, true);
+    return false;
+  }
+
+  unsigned char *first, *second;
+  size_t firstSize, secondSize;
+  size_t space = ringBufferWriteRegions(&wav->playbackRing, &first, &firstSize, &second, &secondSize);
+  if (space < PREFETCH_CHUNK_BYTES && space < remaining)
+  {
+    return false; // wait until a full chunk fits so reads stay large
+  }
+
+  // ring capacity and fill are whole samples, so trimming the end keeps both regions whole too
+  size_t toRead = space < remaining ? space : remaining;
+  toRead -= toRead % bytesPerSample;
+  if (firstSize > toRead)
+  {
+    firstSize = toRead;
+  }
+  secondSize = toRead - firstSize;
+
+  request->op = IO_READ;
+  request->track = wav;
+  request->offset = wav->dataOffset + wav->prefetchOffset;
+  setIoRegions(request, first, firstSize, second, secondSize);
+  return true;
+}
+
+void finishTrackPrefetch(WavFile *wav, IoRequest *request)
+{
+  size_t wanted = request->iov[0].iov_len + request->iov[1].iov_len;
+  size_t total = request->result > 0 ? request->result : 0;
+  total -= total % (bitDepth / 8);
+
+  ringBufferCommit(&wav->playbackRing, total);
+  wav->prefetchOffset += total;
+  if (wav->map != NULL)
+  {
+    slideTrackWindow(wav);
+  }
+  // a short read means the file ended early
+  if (total < wanted || wav->prefetchOffset >= wav->dataSize - wav->dataSize % (bitDepth / 8))
+  {
+    atomic_store(&wav->prefetchEnded, true);
+  }
+}
+
+// one batch of reads across every track that has room, returns bytes added
+size_t prefetchTracks()
+{
+  IoRequest requests[recorder.trackCount];
+  size_t count = 0;
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    if (planTrackPrefetch(&recorder.tracks[i], &requests[count]))
+    {
+      count++;
+    }
+  }
+
+  runIoBatch(requests, count);
+
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    finishTrackPrefetch(requests[i].track, &requests[i]);
+    total += requests[i].result > 0 ? requests[i].result : 0;
+  }
+  return total;
+}
+
+void *prefetcherLoop(void *arg)
+{
+  while (atomic_load(&prefetcherRunning))
+  {
+    if (sessionStorage == STORAGE_REEL)
+    {
+      while (prefetchReel() > 0)
+        ;
+    }
+    else
+    {
+      prefetchTracks();
+    }
+    usleep(PREFETCHER_INTERVAL_USEC);
+  }
+  return NULL;
+}
+
+// seeds every track from recorder.playbackPosition and fills the rings before
+// the stream starts so the first callbacks do not underrun
+void seedPlaybackRings()
+{
+  size_t bytesPerSample = bitDepth / 8;
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    WavFile *wav = &recorder.tracks[i];
+    resetRingBuffer(&wav->playbackRing);
+    wav->prefetchOffset = recorder.playbackPosition * bytesPerSample;
+    // a track being recorded is not also read back
+    atomic_store(&wav->prefetchEnded, isRecording && wav->recordEnabled);
+    if (wav->file != NULL && !atomic_load(&wav->prefetchEnded))
+    {
+      if (useMappedPlayback && mapTrack(wav))
+      {
+        wav->mapAdvisedEnd = wav->prefetchOffset;
+        wav->mapReleasedEnd = wav->prefetchOffset;
+        slideTrackWindow(wav);
+      }
+      else
+      {
+        unmapTrack(wav);
+      }
+    }
+  }
+  if (sessionStorage == STORAGE_TRACK_FILES)
+  {
+    prefetchTracks();
+  }
+
+  if (sessionStorage == STORAGE_REEL)
+  {
+    // tracks the reel does not hold have nothing to play
+    for (size_t i = reelSharedTrackCount(); i < recorder.trackCount; i++)
+    {
+      atomic_store(&recorder.tracks[i].prefetchEnded, true);
+    }
+    reel.readFrame = recorder.playbackPosition;
+    while (prefetchReel() > 0)
+      ;
+  }
+}
+
+void startPlaybackPrefetcher()
+{
+  if (atomic_load(&prefetcherRunning))
+  {
+    return;
+  }
+  seedPlaybackRings();
+
+  atomic_store(&prefetcherRunning, true);
+  if (pthread_create(&prefetcherThread, NULL, prefetcherLoop, NULL) != 0)
+  {
+    atomic_store(&prefetcherRunning, false);
+    printf("Error: Failed to start playback prefetcher thread.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void stopPlaybackPrefetcher()
+{
+  if (!atomic_load(&prefetcherRunning))
+  {
+    return;
+  }
+  atomic_store(&prefetcherRunning, false);
+  pthread_join(prefetcherThread, NULL);
+}
+
+// REALTIME LOGGING
+// The callback never touches stdio. It pushes fixed-size LogEvents into a lock-free
+// queue and the logger thread formats them, applying per-category verbosity and
+// a per-channel rate limit.
+#define LOG_QUEUE_EVENTS 4096
+#define LOG_MAX_CHANNELS 128
+#define LOGGER_INTERVAL_USEC 20000
+
+RingBuffer logQueue = {NULL, 0};
+pthread_t loggerThread;
+atomic_bool loggerRunning = false;
+unsigned int logIntervalMs = 500;
+LogVerbosity logVerbosity[LOG_CATEGORY_COUNT] = {
+    LOG_RATE_LIMITED, // LOG_RECORD_LEVEL
+    LOG_RATE_LIMITED, // LOG_PLAYBACK_LEVEL
+    LOG_VERBOSE,      // LOG_RECORD_OVERFLOW
+    LOG_VERBOSE,      // LOG_PLAYBACK_UNDERRUN
+    LOG_VERBOSE,      // LOG_STREAM_STATUS
+};
+uint64_t lastLoggedMs[LOG_CATEGORY_COUNT][LOG_MAX_CHANNELS];
+size_t suppressedLogEvents[LOG_CATEGORY_COUNT][LOG_MAX_CHANNELS];
+
+void setLogVerbosity(LogCategory category, LogVerbosity verbosity)
+{
+  if (category < LOG_CATEGORY_COUNT)
+  {
+    logVerbosity[category] = verbosity;
+  }
+}
+
+void setLogIntervalMs(unsigned int intervalMs)
+{
+  logIntervalMs = intervalMs;
+}
+
+// safe to call from the audio thread, drops the event if the queue is full
+void logEvent(LogCategory category, size_t channel, float value)
+{
+  if (logQueue.data == NULL || logVerbosity[category] == LOG_QUIET)
+  {
+    return;
+  }
+  LogEvent event = {(uint64_t)recorder.playbackPosition, value, (uint16_t)channel, (uint8_t)category};
+  ringBufferWrite(&logQueue, (const unsigned char *)&event, sizeof(event));
+}
+
+void printLogEvent(const LogEvent *event, size_t suppressed)
+{
+  switch (event->category)
+  {
+  case LOG_RECORD_LEVEL:
+    printf("Recording - Channel %d: dB Level = %f", event->channel, event->value);
+    break;
+  case LOG_PLAYBACK_LEVEL:
+    printf("Playback - Channel %d: dB Level = %f", event->channel, event->value);
+    break;
+  case LOG_RECORD_OVERFLOW:
+    printf("Warning: Record ring overflow on channel %d, block replaced by silence at frame %llu", event->channel, (unsigned long long)event->frame);
+    break;
+  case LOG_PLAYBACK_UNDERRUN:
+    printf("Warning: Playback underrun on channel %d at frame %llu", event->channel, (unsigned long long)event->frame);
+    break;
+  case LOG_STREAM_STATUS:
+    printf("Warning: Stream status flags 0x%lx at frame %llu", (unsigned long)event->value, (unsigned long long)event->frame);
+    break;
+  }
+  if (suppressed > 0)
+  {
+    printf(" (%zu similar suppressed)", suppressed);
+  }
+  printf("\n");
+}
+
+void drainLogQueue()
+{
+  LogEvent event;
+  size_t printed = 0;
+  while (ringBufferRead(&logQueue, (unsigned char *)&event, sizeof(event)) == sizeof(event))
+  {
+    LogVerbosity verbosity = logVerbosity[event.category];
+    if (verbosity == LOG_QUIET)
+    {
+      continue;
+    }
+
+    size_t slot = event.channel < LOG_MAX_CHANNELS ? event.channel : LOG_MAX_CHANNELS - 1;
+    if (verbosity == LOG_RATE_LIMITED)
+    {
+      uint64_t now = monotonicMs();
+      if (now - lastLoggedMs[event.category][slot] < logIntervalMs)
+      {
+        suppressedLogEvents[event.category][slot]++;
+        continue;
+      }
+      lastLoggedMs[event.category][slot] = now;
+    }
+
+    printLogEvent(&event, suppressedLogEvents[event.category][slot]);
+    suppressedLogEvents[event.category][slot] = 0;
+    printed++;
+  }
+
+  if (printed > 0)
+  {
+    fflush(stdout);
+  }
+
+  size_t dropped = atomic_exchange(&logQueue.overflowCount, 0);
+  if (dropped > 0)
+  {
+    printf("Warning: %zu log events dropped, logger queue full\n", dropped);
+  }
+}
+
+void *loggerLoop(void *arg)
+{
+  while (atomic_load(&loggerRunning))
+  {
+    drainLogQueue();
+    usleep(LOGGER_INTERVAL_USEC);
+  }
+  drainLogQueue();
+  return NULL;
+}
+
+void prepareLogQueue()
+{
+  prepareRingBuffer(&logQueue, LOG_QUEUE_EVENTS * sizeof(LogEvent));
+  memset(lastLoggedMs, 0, sizeof(lastLoggedMs));
+  memset(suppressedLogEvents, 0, sizeof(suppressedLogEvents));
+}
+
+void startLogger()
+{
+  if (atomic_load(&loggerRunning))
+  {
+    return;
+  }
+  prepareLogQueue();
+
+  atomic_store(&loggerRunning, true);
+  if (pthread_create(&loggerThread, NULL, loggerLoop, NULL) != 0)
+  {
+    atomic_store(&loggerRunning, false);
+    printf("Error: Failed to start logger thread.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void stopLogger()
+{
+  if (!atomic_load(&loggerRunning))
+  {
+    return;
+  }
+  atomic_store(&loggerRunning, false);
+  pthread_join(loggerThread, NULL);
+}
+
+// ENGINE
+// Everything that happens to one block of audio, whoever supplies it: the device
+// stream in realtime, or renderOffline as fast as the files can be read. Both
+// hold one block of framesPerBuffer session samples per track in inputBuffers
+// and outputBuffers. Realtime rules apply either way: rings and scratch only.
+void processEngineBlock(const unsigned char *const *inputBuffers, unsigned char *const *outputBuffers, size_t framesPerBuffer,
+                        unsigned long statusFlags)
+{
+  size_t minReadFrames = framesPerBuffer; // Initialize with the maximum possible
+
+  enterAudioCallback();
+  resetScratchArena(&callbackArena);
+  size_t blockBytes = framesPerBuffer * sampleKernels->bytesPerSample;
+
+  if (statusFlags != 0)
+  {
+    logEvent(LOG_STREAM_STATUS, 0, (float)statusFlags);
+  }
+
+  float **buses = borrowScratch(&callbackArena, recorder.trackCount * sizeof(float *));
+  size_t *busChannels = borrowScratch(&callbackArena, recorder.trackCount * sizeof(size_t));
+  size_t *busFrames = borrowScratch(&callbackArena, recorder.trackCount * sizeof(size_t));
+  MeterReading *readings = borrowScratch(&callbackArena, recorder.trackCount * sizeof(MeterReading));
+  size_t busCount = 0;
+  float *bounceBus = NULL;
+  if (buses == NULL || busChannels == NULL || busFrames == NULL || readings == NULL)
+  {
+    leaveAudioCallback();
+    return;
+  }
+
+  // onto the float bus once per track for metering and the bounce sum
+  for (size_t channel = 0; channel < recorder.trackCount; ++channel)
+  {
+    WavFile *track = &recorder.tracks[channel];
+    size_t frames = framesPerBuffer;
+    bool recordsInput = isRecording && track->recordEnabled;
+    if (isRecording && !track->recordEnabled && !bouncingToTrack)
+    {
+      continue;
+    }
+    if (!recordsInput) // Handle Playback for non record enabled tracks, which a bounce pass plays too
+    {
+      // check for the end before reading so a late final refill is not mistaken for it
+      bool ended = atomic_load(&track->prefetchEnded);
+      // audio owed from an earlier underrun is skipped as it arrives, so the track
+      // plays the same frame as the ones that did not underrun
+      if (track->playbackMissingBytes > 0)
+      {
+        size_t available = ringBufferFill(&track->playbackRing);
+        size_t skipped = available < track->playbackMissingBytes ? available : track->playbackMissingBytes;
+        ringBufferConsume(&track->playbackRing, skipped);
+        track->playbackMissingBytes -= skipped;
+      }
+      size_t wantedBytes = blockBytes;
+      size_t readBytes = ringBufferRead(&track->playbackRing, outputBuffers[channel], wantedBytes);
+      frames = readBytes / sampleKernels->bytesPerSample;
+      if (readBytes < wantedBytes)
+      {
+        memset(&outputBuffers[channel][readBytes], 0, wantedBytes - readBytes); // Zero out beyond data size or on underrun
+        if (!ended)
+        {
+          track->playbackMissingBytes += wantedBytes - readBytes;
+          atomic_fetch_add_explicit(&track->playbackUnderrunCount, 1, memory_order_relaxed);
+          logEvent(LOG_PLAYBACK_UNDERRUN, channel, 0);
+        }
+      }
+
+      // Determine the minimum readFrames across all channels for playback tracking
+      if (frames < minReadFrames)
+      {
+        minReadFrames = frames;
+      }
+    }
+
+    float *bus = borrowScratch(&callbackArena, framesPerBuffer * sizeof(float));
+    if (bus == NULL)
+    {
+      continue;
+    }
+    if (bouncingToTrack && (int)channel == bounceDestinationTrack)
+    {
+      bounceBus = bus; // filled from the sources below instead of the input
+    }
+    else
+    {
+      sampleKernels->toFloat(recordsInput ? inputBuffers[channel] : outputBuffers[channel], bus, framesPerBuffer);
+    }
+    buses[busCount] = bus;
+    busChannels[busCount] = channel;
+    busFrames[busCount] = frames;
+    busCount++;
+  }
+
+  // the bounce destination records the sum of the sources playing this block
+  if (bounceBus != NULL)
+  {
+    memset(bounceBus, 0, framesPerBuffer * sizeof(float));
+    for (size_t i = 0; i < busCount; i++)
+    {
+      WavFile *source = &recorder.tracks[busChannels[i]];
+      if (source->bounceGain != 0 && !source->recordEnabled)
+      {
+        accumulateScaled(bounceBus, buses[i], source->bounceGain, framesPerBuffer);
+      }
+    }
+  }
+
+  // one metering pass over all of them; playback blocks are zero past what was read
+  meterBlocks((const float *const *)buses, busCount, framesPerBuffer, readings);
+
+  for (size_t i = 0; i < busCount; i++)
+  {
+    size_t channel = busChannels[i];
+    WavFile *track = &recorder.tracks[channel];
+
+    // set db amplitude levels
+    float dbLevel = -100; // Default to a very low dB level if no data is read
+    float peakLevel = -100;
+    if (busFrames[i] > 0)
+    {
+      dbLevel = rmsToDb(sqrt(readings[i].sumOfSquares / busFrames[i]));
+      peakLevel = rmsToDb(readings[i].peak);
+    }
+    track->currentAmplitudeLevel = dbLevel;
+    track->currentPeakLevel = peakLevel;
+    if (readings[i].clipCount > 0)
+    {
+      atomic_fetch_add_explicit(&track->clippedSamples, readings[i].clipCount, memory_order_relaxed);
+    }
+
+    if (isRecording && track->recordEnabled)
+    {
+      logEvent(LOG_RECORD_LEVEL, channel, dbLevel);
+      // the input is queued as it came in, so no format loses bits on the way to
+      // disk; only a bounce sum exists solely on the bus and is packed back first
+      const unsigned char *recordBlock = inputBuffers[channel];
+      if (buses[i] == bounceBus)
+      {
+        unsigned char *packed = borrowScratch(&callbackArena, blockBytes);
+        if (packed != NULL)
+        {
+          sampleKernels->fromFloat(buses[i], packed, framesPerBuffer);
+        }
+        recordBlock = packed;
+      }
+      // a block that does not fit is owed to the ring as silence, paid ahead of
+      // the next block so everything recorded after it keeps its frame
+      if (track->recordMissingBytes > 0)
+      {
+        track->recordMissingBytes -= ringBufferWriteSilence(&track->recordRing, track->recordMissingBytes);
+      }
+      bool held = track->recordMissingBytes > 0 || recordBlock == NULL;
+      if (held || !ringBufferWrite(&track->recordRing, recordBlock, blockBytes))
+      {
+        if (held)
+        {
+          atomic_fetch_add_explicit(&track->recordRing.overflowCount, 1, memory_order_relaxed);
+        }
+        track->recordMissingBytes += blockBytes;
+        logEvent(LOG_RECORD_OVERFLOW, channel, 0);
+      }
+    }
+    else
+    {
+      // the output already holds the playback block, the bus was only metered
+      logEvent(LOG_PLAYBACK_LEVEL, channel, dbLevel);
+    }
+  }
+
+  // advance the play head
+  recorder.playbackPosition += framesPerBuffer;
+
+  // Update the start time to reflect the current playback position. Derived from the
+  // frame count rather than accumulated, so it does not drift over long sessions.
+  startTimeInSeconds = (double)recorder.playbackPosition / sampleRate;
+
+  leaveAudioCallback();
+}
+
+static int streamCallback(const void *inputBuffer, void *outputBuffer,
+                          unsigned long framesPerBuffer,
+                          const PaStreamCallbackTimeInfo *timeInfo,
+                          PaStreamCallbackFlags statusFlags,
+                          void *userData)
+{
+  processEngineBlock((const unsigned char *const *)inputBuffer, (unsigned char *const *)outputBuffer, framesPerBuffer, statusFlags);
+  return paContinue;
+}
+
+// what the engine needs before its first block of a pass
+void prepareEngine(size_t framesPerBuffer)
+{
+  // size the callback scratch for the negotiated block size and track count
+  size_t scratchBlockSize = framesPerBuffer * sizeof(float) + SCRATCH_ALIGNMENT;
+  prepareScratchArena(&callbackArena, scratchBlockSize * SCRATCH_BLOCKS_PER_TRACK * recorder.trackCount);
+
+  // Calculate playback start position based on startTimeInSeconds
+  // Assuming each sample in the buffer corresponds to a frame of audio
+  recorder.playbackPosition = secondsToFrames(startTimeInSeconds);
+}
+
+void initStream()
+{
+  // stop if no input device
+  int inputDevice = Pa_GetDefaultInputDevice();
+  if (inputDevice == -1)
+  {
+    printf("Error: No default input device found!");
+    exit(EXIT_FAILURE);
+  }
+
+  PaError err;
+  // Stream parameters
+  PaStreamParameters inputParameters;
+  inputParameters.channelCount = recorder.trackCount;
+  inputParameters.device = inputDevice;                                                                // or another specific device
+  inputParameters.sampleFormat = sampleKernels->paFormat | paNonInterleaved;                           // Correct way to combine flags
+  inputParameters.suggestedLatency = Pa_GetDeviceInfo(inputParameters.device)->defaultLowInputLatency; // lowest latency
+  inputParameters.hostApiSpecificStreamInfo = NULL;
+
+  // Setup output parameters
+  PaStreamParameters outputParameters;
+  outputParameters.device = Pa_GetDefaultOutputDevice();
+  outputParameters.channelCount = recorder.trackCount;                                                   // Number of tracks
+  outputParameters.sampleFormat = sampleKernels->paFormat | paNonInterleaved;                            // Correct way to combine flags
+  outputParameters.suggestedLatency = Pa_GetDeviceInfo(outputParameters.device)->defaultLowInputLatency; // lowest latency
+  outputParameters.hostApiSpecificStreamInfo = NULL;
+
+  printf("Initializing stream with %d channels.\n", recorder.trackCount); // Typically NULL
+
+  // start PA audio stream
+  err = Pa_OpenStream(
+      &stream,
+      &inputParameters,
+      &outputParameters,
+      sampleRate,
+      frames,
+      paClipOff, // or other relevant flags. Note: paNonInterleaved is NOT set here
+      streamCallback,
+      NULL // User data passed to callback
+  );
+  if (err != paNoError)
+  {
+    printf("PortAudio error: %s\n", Pa_GetErrorText(err));
+    exit(EXIT_FAILURE);
+  }
+
+  prepareEngine(frames);
+}
+
+void onRewind()
+{
+  if (startTimeInSeconds > 0.1)
+  {
+    startTimeInSeconds -= 0.1;
+  }
+  else
+  {
+    startTimeInSeconds = 0.0;
+  }
+}
+
+void onFastForward()
+{
+  // Adjust time forwards by 0.1 seconds, with 216000 seconds as 60 hours
+  if (startTimeInSeconds < 216000 - 0.1)
+  {
+    startTimeInSeconds += 0.1;
+  }
+  else
+  {
+    // Optionally loop around or cap at 216000
+    startTimeInSeconds = 216000;
+  }
+}
+
+void onRtz()
+{
+  updateStartTime(0.00);
+}
+
+void onStop()
+{
+  Pa_StopStream(stream);
+  Pa_CloseStream(stream);
+  stopDiskWriter();
+  stopPlaybackPrefetcher();
+  stopLogger();
+  closeWavFiles();
+}
+
+// opens the tracks for a recording or playback pass, before the engine runs
+void prepareTransport(const uint32_t *inputTrackRecordEnabledStates, bool recording)
+{
+  isRecording = recording;
+  initTracks(inputTrackRecordEnabledStates);
+
+  // a bounce to tape needs its destination armed and the sources read while it records
+  bouncingToTrack = isRecording && bounceDestinationTrack >= 0 && bounceDestinationTrack < recorder.trackCount &&
+                    recorder.tracks[bounceDestinationTrack].recordEnabled;
+  if (bouncingToTrack && sessionStorage == STORAGE_REEL)
+  {
+    printf("Warning: Bouncing to a track needs track file storage, recording the input instead.\n");
+    bouncingToTrack = false;
+  }
+}
+
+void onStart(const uint32_t *inputTrackRecordEnabledStates, bool isRecordingFromUI)
+{
+  PaError err;
+
+  prepareTransport(inputTrackRecordEnabledStates, isRecordingFromUI);
+  initStream();
+  startLogger();
+
+  if (isRecording)
+  {
+    startDiskWriter();
+  }
+  if (!isRecording || bouncingToTrack)
+  {
+    startPlaybackPrefetcher();
+  }
+
+  err = Pa_StartStream(stream);
+  if (err != paNoError)
+  {
+    printf("PortAudio error: %s\n", Pa_GetErrorText(err));
+    exit(EXIT_FAILURE);
+  }
+}
+
+// MACOS
+AudioDeviceID getDefaultMacOSInputDeviceID()
+{
+  AudioDeviceID deviceID = kAudioObjectUnknown;
+  UInt32 dataSize = sizeof(deviceID);
+  AudioObjectPropertyAddress propertyAddress = {
+      kAudioHardwarePropertyDefaultInputDevice,
+      kAudioObjectPropertyScopeGlobal,
+      kAudioObjectPropertyElementMaster};
+
+  OSStatus status = AudioObjectGetPropertyData(kAudioObjectSystemObject,
+                                               &propertyAddress,
+                                               0,
+                                               NULL,
+                                               &dataSize,
+                                               &deviceID);
+  if (status != noErr)
+  {
+    fprintf(stderr, "Failed to get the default macos input device ID\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return deviceID; // Return the default input device ID
+}
+
+AudioDeviceID getDefaultMacOSOutputDeviceID()
+{
+  AudioDeviceID deviceID = kAudioObjectUnknown;
+  UInt32 dataSize = sizeof(deviceID);
+  AudioObjectPropertyAddress propertyAddress = {
+      kAudioHardwarePropertyDefaultOutputDevice,
+      kAudioObjectPropertyScopeGlobal,
+      kAudioObjectPropertyElementMaster};
+
+  OSStatus status = AudioObjectGetPropertyData(kAudioObjectSystemObject,
+                                               &propertyAddress,
+                                               0,
+                                               NULL,
+                                               &dataSize,
+                                               &deviceID);
+  if (status != noErr)
+  {
+    fprintf(stderr, "Failed to get the default macos output device ID\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return deviceID; // Return the default output device ID
+}
+
+void setupInputTracks(int inputChannelCount)
+{
+  if (recorder.tracks != NULL)
+  {
+    for (size_t i = 0; i < recorder.trackCount; i++)
+    {
+      closeWavFile(&recorder.tracks[i]);
+      freeRingBuffer(&recorder.tracks[i].recordRing);
+      freeRingBuffer(&recorder.tracks[i].playbackRing);
+    }
+    free(recorder.tracks);
+    recorder.tracks = NULL;
+  }
+  recorder.trackCount = inputChannelCount;
+  recorder.tracks = calloc(sizeof(WavFile) * recorder.trackCount, sizeof(WavFile)); // make room for as many wav files as needed tracks
+
+  if (recorder.tracks == NULL)
+  {
+    printf("Error: Failed to allocate memory for tracks.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+int checkPAIOAndGetChannelCount()
+{
+  int inputDevice = Pa_GetDefaultInputDevice();
+  int outputDevice = Pa_GetDefaultOutputDevice();
+  // check that we have both IO devices from default setup
+  if (inputDevice == -1 || outputDevice == -1)
+  {
+    printf("Error: We are missing either an input or an output default device\n");
+    exit(EXIT_FAILURE);
+  }
+  // get IO device info
+  const PaDeviceInfo *inputDeviceInfo = Pa_GetDeviceInfo(inputDevice);
+  const PaDeviceInfo *outputDeviceInfo = Pa_GetDeviceInfo(outputDevice);
+  // set channel count
+  int inputChannelCount = inputDeviceInfo->maxInputChannels;
+  int outputChannelCount = outputDeviceInfo->maxOutputChannels;
+
+  // handle input count error
+  if (inputChannelCount <= 0)
+  {
+    printf("Error: Invalid number of input channels (%d). Must be greater than 0.\n", inputChannelCount);
+    exit(EXIT_FAILURE);
+  }
+
+  // for now, we are enforcing that devices must comply with 1:1 inputs to outputs
+  if (outputChannelCount < inputChannelCount)
+  {
+    printf("Error: There are not enough output channels (%d) to match input channels\n", outputChannelCount);
+    exit(EXIT_FAILURE);
+  }
+
+  return inputChannelCount;
+}
+
+void dispatchEngineKernels()
+{
+  dispatchSampleKernels();
+  dispatchMeterKernel();
+  dispatchInterleaveKernel();
+  dispatchMixKernel();
+}
+
+void initAudio()
+{
+
+  PaError err;
+  // init PA
+  err = Pa_Initialize();
+  if (err != paNoError)
+  {
+    printf("PortAudio error during initialization: %s\n", Pa_GetErrorText(err));
+    exit(EXIT_FAILURE);
+  }
+
+  dispatchEngineKernels();
+
+  // establish the current input setup
+  size_t inputChannelCount = checkPAIOAndGetChannelCount();
+  setupInputTracks(inputChannelCount);
+}
+
+// Sets the engine up for trackCount tracks without PortAudio, so offline renders
+// run on machines with no audio hardware. Undone by cleanupOfflineEngine.
+void initOfflineEngine(int trackCount)
+{
+  dispatchEngineKernels();
+  setupInputTracks(trackCount);
+}
+
+void cleanupOfflineEngine()
+{
+  stopDiskWriter();
+  stopPlaybackPrefetcher();
+  stopLogger();
+  freeScratchArena(&callbackArena);
+}
+
+void cleanupAudio()
+{
+  PaError err;
+
+  Pa_StopStream(stream);
+  Pa_CloseStream(stream);
+  cleanupOfflineEngine();
+
+  err = Pa_Terminate();
+  if (err != paNoError)
+  {
+    printf("PortAudio error during termination: %s\n", Pa_GetErrorText(err));
+  }
+}
+
+// also monitors the default devices on macos to adjust audio setup if a change has occured
+int getInputTrackCount()
+{
+  // if macos device defaults change
+  AudioDeviceID defaultMacOSInputDevice = getDefaultMacOSInputDeviceID();
+  AudioDeviceID defaultMacOSOutputDevice = getDefaultMacOSOutputDeviceID();
+  if (defaultMacOSInputDevice != currentDefaultMacOSInputDevice || defaultMacOSOutputDevice != currentDefaultMacOSOutputDevice)
+  {
+    // reset our PA audio setup
+    cleanupAudio();
+    initAudio();
+  }
+  // after we re-init and set the recorder.trackCount we should now be returning the latest state update
+  return recorder.trackCount;
+}
+
+// MIXDOWN
+// Sums any set of tracks to stereo with a gain and a constant power pan per track.
+// Each block is read from every track in one I/O batch, then the tracks are split
+// into groups of MIX_GROUP_TRACKS that compute pool workers sum in float into their
+// own stereo pair. The group sums are added together and packed back to the
+// session format for the output.
+#define MIX_GROUP_TRACKS 4
+
+typedef struct
+{
+  MixInput *inputs;
+  size_t inputCount;
+  unsigned char **blocks; // this block of every input, session format
+  size_t frames;
+  float *left;
+  float *right;
+  float *scratch; // one input on the float bus
+} MixGroup;
+
+void mixGroup(void *arg)
+{
+  MixGroup *group = arg;
+  memset(group->left, 0, group->frames * sizeof(float));
+  memset(group->right, 0, group->frames * sizeof(float));
+  for (size_t i = 0; i < group->inputCount; i++)
+  {
+    sampleKernels->toFloat(group->blocks[i], group->scratch, group->frames);
+    accumulateScaled(group->left, group->scratch, group->inputs[i].leftGain, group->frames);
+    accumulateScaled(group->right, group->scratch, group->inputs[i].rightGain, group->frames);
+  }
+}
+
+// everything one mixdown needs per block, allocated once for the whole bounce
+typedef struct
+{
+  MixInput *inputs;
+  size_t inputCount;
+  size_t blockFrames;
+  unsigned char **blocks;
+  IoRequest *requests;
+  MixGroup *groups; // the finished mix of a block is in groups[0].left and right
+  size_t groupCount;
+} Mixer;
+
+void freeMixer(Mixer *mixer)
+{
+  for (size_t i = 0; mixer->blocks != NULL && i < mixer->inputCount; i++)
+  {
+    free(mixer->blocks[i]);
+  }
+  for (size_t g = 0; mixer->groups != NULL && g < mixer->groupCount; g++)
+  {
+    free(mixer->groups[g].left);
+    free(mixer->groups[g].right);
+    free(mixer->groups[g].scratch);
+  }
+  free(mixer->blocks);
+  free(mixer->requests);
+  free(mixer->groups);
+}
+
+bool initMixer(Mixer *mixer, MixInput *inputs, size_t inputCount, size_t blockFrames)
+{
+  size_t bytesPerSample = bitDepth / 8;
+  mixer->inputs = inputs;
+  mixer->inputCount = inputCount;
+  mixer->blockFrames = blockFrames;
+  mixer->groupCount = (inputCount + MIX_GROUP_TRACKS - 1) / MIX_GROUP_TRACKS;
+  mixer->blocks = calloc(inputCount, sizeof(unsigned char *));
+  mixer->requests = calloc(inputCount, sizeof(IoRequest));
+  mixer->groups = calloc(mixer->groupCount, sizeof(MixGroup));
+  bool allocated = mixer->blocks != NULL && mixer->requests != NULL && mixer->groups != NULL;
+  for (size_t i = 0; allocated && i < inputCount; i++)
+  {
+    allocated = (mixer->blocks[i] = malloc(blockFrames * bytesPerSample)) != NULL;
+  }
+  for (size_t g = 0; allocated && g < mixer->groupCount; g++)
+  {
+    MixGroup *group = &mixer->groups[g];
+    group->inputs = inputs + g * MIX_GROUP_TRACKS;
+    group->inputCount = inputCount - g * MIX_GROUP_TRACKS < MIX_GROUP_TRACKS ? inputCount - g * MIX_GROUP_TRACKS : MIX_GROUP_TRACKS;
+    group->blocks = mixer->blocks + g * MIX_GROUP_TRACKS;
+    group->left = malloc(blockFrames * sizeof(float));
+    group->right = malloc(blockFrames * sizeof(float));
+    group->scratch = malloc(blockFrames * sizeof(float));
+    allocated = group->left != NULL && group->right != NULL && group->scratch != NULL;
+  }
+  if (!allocated)
+  {
+    printf("Memory allocation failed for mixdown blocks.\n");
+    freeMixer(mixer);
+    return false;
+  }
+  pthread_once(&computePoolOnce, startComputePool);
+  return true;
+}
+
+// mixes frames (at most blockFrames) from sourceFrame of the tracks into groups[0]
+void mixBlock(Mixer *mixer, uint64_t sourceFrame, size_t frames)
+{
+  size_t bytesPerSample = bitDepth / 8;
+  size_t requestCount = 0;
+  for (size_t i = 0; i < mixer->inputCount; i++)
+  {
+    WavFile *track = mixer->inputs[i].track;
+    uint64_t trackFrames = track->dataSize / bytesPerSample;
+    uint64_t wanted = sourceFrame < trackFrames ? trackFrames - sourceFrame : 0;
+    wanted = wanted < frames ? wanted : frames;
+    memset(mixer->blocks[i], 0, frames * bytesPerSample); // silence wherever the read falls short
+    if (wanted == 0)
+    {
+      continue;
+    }
+    IoRequest *request = &mixer->requests[requestCount++];
+    request->op = IO_READ;
+    request->track = track;
+    request->offset = track->dataOffset + sourceFrame * bytesPerSample;
+    setIoRegions(request, mixer->blocks[i], wanted * bytesPerSample, NULL, 0);
+  }
+  runIoBatch(mixer->requests, requestCount);
+
+  TaskGroup taskGroup;
+  initTaskGroup(&taskGroup);
+  for (size_t g = 0; g < mixer->groupCount; g++)
+  {
+    mixer->groups[g].frames = frames;
+    if (computePoolStarted && mixer->groupCount > 1)
+    {
+      submitTask(&computePool, &taskGroup, mixGroup, &mixer->groups[g]);
+    }
+    else
+    {
+      mixGroup(&mixer->groups[g]);
+    }
+  }
+  waitTaskGroup(&taskGroup);
+  destroyTaskGroup(&taskGroup);
+
+  for (size_t g = 1; g < mixer->groupCount; g++)
+  {
+    accumulateScaled(mixer->groups[0].left, mixer->groups[g].left, 1, frames);
+    accumulateScaled(mixer->groups[0].right, mixer->groups[g].right, 1, frames);
+  }
+}
+
+// streams the mix of frameCount frames of inputCount inputs, from startFrame of the
+// tracks, into a stereo output at outputFrame, reporting progress to job and
+// stopping if it is cancelled
+int mixTracksToStereo(MixInput *inputs, size_t inputCount, WavFile *output, uint64_t startFrame, uint64_t outputFrame,
+                      uint64_t frameCount, BounceJob *job)
+{
+  size_t bytesPerSample = bitDepth / 8;
+  size_t blockFrames = bounceBlockFrames;
+  Mixer mixer;
+  if (!initMixer(&mixer, inputs, inputCount, blockFrames))
+  {
+    return 1;
+  }
+  unsigned char *sides[2] = {malloc(blockFrames * bytesPerSample), malloc(blockFrames * bytesPerSample)};
+  unsigned char *stereoBlock = malloc(blockFrames * 2 * bytesPerSample);
+  int result = 0;
+  if (sides[0] == NULL || sides[1] == NULL || stereoBlock == NULL)
+  {
+    printf("Memory allocation failed for mixdown blocks.\n");
+    result = 1;
+    frameCount = 0;
+  }
+
+  for (uint64_t frame = 0; frame < frameCount; frame += blockFrames)
+  {
+    if (job != NULL && atomic_load(&job->cancelled))
+    {
+      result = 1;
+      break;
+    }
+    size_t frames = frameCount - frame < blockFrames ? frameCount - frame : blockFrames;
+    mixBlock(&mixer, startFrame + frame, frames);
+    sampleKernels->fromFloat(mixer.groups[0].left, sides[0], frames);
+    sampleKernels->fromFloat(mixer.groups[0].right, sides[1], frames);
+    interleaveSamples((const unsigned char *const *)sides, 2, stereoBlock, frames);
+
+    output->writePosition = output->dataOffset + (outputFrame + frame) * 2 * bytesPerSample;
+    size_t written = writeTrackAt(output, output->writePosition, stereoBlock, frames * 2 * bytesPerSample);
+    finishTrackWrite(output, written);
+    if (written != frames * 2 * bytesPerSample)
+    {
+      printf("Error: Failed to write the mixdown at frame %llu.\n", (unsigned long long)frame);
+      result = 1;
+      break;
+    }
+    if (job != NULL)
+    {
+      atomic_fetch_add(&job->framesDone, frames);
+    }
+  }
+
+  freeMixer(&mixer);
+  free(sides[0]);
+  free(sides[1]);
+  free(stereoBlock);
+  return result;
+}
+
+// BOUNCE JOBS
+// Mixdowns run in the background on bouncePool, BOUNCE_POOL_THREADS at a time with
+// the rest queued behind them. A job reads the track files through handles of its
+// own, so the transport position and the open tracks are untouched and a bounce can
+// run while the session plays. The UI polls a job through its handle, a slot in
+// bounceJobs.
+#define BOUNCE_POOL_THREADS 2
+#define MAX_BOUNCE_JOBS 16
+
+WorkerPool bouncePool;
+pthread_once_t bouncePoolOnce = PTHREAD_ONCE_INIT;
+bool bouncePoolStarted = false;
+BounceJob *bounceJobs[MAX_BOUNCE_JOBS];
+pthread_mutex_t bounceJobsLock = PTHREAD_MUTEX_INITIALIZER;
+
+void startBouncePool()
+{
+  bouncePoolStarted = startWorkerPool(&bouncePool, BOUNCE_POOL_THREADS);
+}
+
+// opens trackN.wav for reading only, without creating it or moving any play head
+bool openTrackForReading(WavFile *wav, int trackIndex)
+{
+  char *filePath = trackFilePath(trackIndex);
+  memset(wav, 0, sizeof(WavFile));
+  wav->file = fopen(filePath, "rb");
+  free(filePath);
+  if (wav->file == NULL)
+  {
+    return false;
+  }
+
+  WavLayout layout;
+  struct stat fileStat;
+  fstat(fileno(wav->file), &fileStat);
+  if (!readWavLayout(fileno(wav->file), &layout) || !wavFormatMatchesSession(&layout.format))
+  {
+    fclose(wav->file);
+    wav->file = NULL;
+    return false;
+  }
+  uint64_t inFile = (uint64_t)fileStat.st_size > layout.dataOffset ? fileStat.st_size - layout.dataOffset : 0;
+  wav->dataOffset = layout.dataOffset;
+  wav->ds64Offset = layout.ds64Offset;
+  wav->format = layout.format;
+  wav->dataSize = layout.dataSize < inFile ? layout.dataSize : inFile;
+  return true;
+}
+
+// BOUNCE RECORDS
+// Next to every finished bounce, out.wav.bounce records what it was made from: the
+// range, the tracks with their gains, and how far the edit journal went. A re-bounce
+// renders just the output frames behind journal entries appended since then, in
+// place. Anything it cannot vouch for (a track changed with no journal entry, an
+// output that is not the size it was left at) falls back to a full bounce.
+#define BOUNCE_RECORD_SUFFIX ".bounce"
+
+char *bounceRecordPath(const char *outputPath)
+{
+  char *path = malloc(strlen(outputPath) + strlen(BOUNCE_RECORD_SUFFIX) + 1);
+  sprintf(path, "%s%s", outputPath, BOUNCE_RECORD_SUFFIX);
+  return path;
+}
+
+void writeBounceRecord(BounceJob *job)
+{
+  char *path = bounceRecordPath(job->outputPath);
+  FILE *record = fopen(path, "w");
+  free(path);
+  if (record == NULL)
+  {
+    return;
+  }
+  fprintf(record, "tape_sim bounce 1\n");
+  fprintf(record, "range %llu %llu %d\n", (unsigned long long)job->startFrame, (unsigned long long)job->frameCount, job->openEnded);
+  fprintf(record, "journal %llu\n", (unsigned long long)job->journalOffset);
+  for (size_t i = 0; i < job->inputCount; i++)
+  {
+    struct stat trackStat = {0};
+    char *filePath = trackFilePath(job->trackIndices[i]);
+    stat(filePath, &trackStat);
+    free(filePath);
+    fprintf(record, "track %d %.9g %.9g %lld %lld\n", job->trackIndices[i], job->inputs[i].leftGain, job->inputs[i].rightGain,
+            (long long)trackStat.st_mtime, (long long)trackStat.st_size);
+  }
+  fclose(record);
+}
+
+void freeBounceJob(BounceJob *job)
+{
+  for (size_t i = 0; i < job->inputCount; i++)
+  {
+    if (job->sources[i].file != NULL)
+    {
+      fclose(job->sources[i].file);
+    }
+  }
+  free(job->sources);
+  free(job->inputs);
+  free(job->trackIndices);
+  free(job->ranges);
+  free(job->outputPath);
+  free(job);
+}
+
+// a job for the given tracks, their files not opened yet
+BounceJob *newBounceJob(const int *trackIndices, const float *leftGains, const float *rightGains, size_t count)
+{
+  BounceJob *job = calloc(1, sizeof(BounceJob));
+  job->sources = calloc(count, sizeof(WavFile));
+  job->inputs = calloc(count, sizeof(MixInput));
+  job->trackIndices = calloc(count, sizeof(int));
+  for (size_t i = 0; i < count; i++)
+  {
+    job->trackIndices[i] = trackIndices[i];
+    job->inputs[i] = (MixInput){&job->sources[i], leftGains[i], rightGains[i]};
+  }
+  job->inputCount = count;
+  return job;
+}
+
+// false if one of the job's tracks cannot be read
+bool openBounceSources(BounceJob *job)
+{
+  job->journalOffset = editJournalLength(); // before opening, so no later edit is missed
+  for (size_t i = 0; i < job->inputCount; i++)
+  {
+    if (!openTrackForReading(&job->sources[i], job->trackIndices[i]))
+    {
+      printf("Error: Track %d has no usable audio file.\n", job->trackIndices[i] + 1);
+      return false;
+    }
+  }
+  return true;
+}
+
+// opens the given tracks for a new job, NULL if one of them cannot be read
+BounceJob *createBounceJob(const int *trackIndices, const float *leftGains, const float *rightGains, size_t count)
+{
+  BounceJob *job = newBounceJob(trackIndices, leftGains, rightGains, count);
+  if (!openBounceSources(job))
+  {
+    freeBounceJob(job);
+    return NULL;
+  }
+  return job;
+}
+
+// the longest track, to the frame
+uint64_t longestInputFrames(BounceJob *job)
+{
+  size_t bytesPerSample = bitDepth / 8;
+  uint64_t frames = 0;
+  for (size_t i = 0; i < job->inputCount; i++)
+  {
+    uint64_t trackFrames = job->sources[i].dataSize / bytesPerSample; // from the header, RF64 included
+    frames = trackFrames > frames ? trackFrames : frames;
+  }
+  return frames;
+}
+
+// brings a reel session's track files up to date and opens them for a job that
+// left that to the pool; false, with the reason printed, if it cannot run
+bool openPendingBounceSources(BounceJob *job)
+{
+  if (sessionStorage == STORAGE_REEL && exportReelToTrackFiles() != 0)
+  {
+    return false;
+  }
+  if (!openBounceSources(job))
+  {
+    return false;
+  }
+  if (job->openEnded)
+  {
+    uint64_t endFrame = longestInputFrames(job);
+    job->frameCount = endFrame > job->startFrame ? endFrame - job->startFrame : 0;
+    job->framesToRender = job->frameCount;
+  }
+  if (job->frameCount == 0)
+  {
+    printf("ERROR: Nothing to bounce in the selected range.\n");
+    return false;
+  }
+  return true;
+}
+
+void runBounceJob(void *arg)
+{
+  BounceJob *job = arg;
+  job->startedMs = monotonicMs();
+  if (job->sourcesPending && (atomic_load(&job->cancelled) || !openPendingBounceSources(job)))
+  {
+    atomic_store(&job->failed, true);
+    atomic_store(&job->finished, true);
+    return;
+  }
+
+  char *dirPath, *trackTitle;
+  separatePathFromTitle(job->outputPath, &dirPath, &trackTitle);
+  if (job->ranges == NULL)
+  {
+    remove(job->outputPath); // a fresh file, not an overwrite into an older bounce
+    char *recordPath = bounceRecordPath(job->outputPath);
+    remove(recordPath);
+    free(recordPath);
+  }
+  WavFile *output = calloc(1, sizeof(WavFile));
+  openWavFile(output, trackTitle, dirPath, 2);
+  int result = 1;
+  if (output->file != NULL)
+  {
+    if (job->ranges == NULL)
+    {
+      result = mixTracksToStereo(job->inputs, job->inputCount, output, job->startFrame, 0, job->frameCount, job);
+    }
+    else
+    {
+      result = 0;
+      for (size_t r = 0; r < job->rangeCount && result == 0; r++)
+      {
+        uint64_t first = job->ranges[r * 2];
+        uint64_t end = job->ranges[r * 2 + 1];
+        result = mixTracksToStereo(job->inputs, job->inputCount, output, job->startFrame + first, first, end - first, job);
+      }
+    }
+    closeWavFile(output);
+  }
+  if (atomic_load(&job->cancelled) && job->ranges == NULL)
+  {
+    remove(job->outputPath);
+  }
+  else if (result == 0)
+  {
+    writeBounceRecord(job);
+  }
+
+  free(output);
+  free(dirPath);
+  free(trackTitle);
+  atomic_store(&job->failed, result != 0);
+  atomic_store(&job->finished, true);
+}
+
+BounceJob *bounceJobAt(int handle)
+{
+  if (handle < 0 || handle >= MAX_BOUNCE_JOBS)
+  {
+    return NULL;
+  }
+  pthread_mutex_lock(&bounceJobsLock);
+  BounceJob *job = bounceJobs[handle];
+  pthread_mutex_unlock(&bounceJobsLock);
+  return job;
+}
+
+// gives the job a handle and starts it, or frees it and returns -1
+int queueBounceJob(BounceJob *job, const char *outputPath)
+{
+  pthread_mutex_lock(&bounceJobsLock);
+  int handle = -1;
+  for (int i = 0; i < MAX_BOUNCE_JOBS && handle < 0; i++)
+  {
+    if (bounceJobs[i] == NULL)
+    {
+      handle = i;
+      bounceJobs[i] = job;
+    }
+  }
+  pthread_mutex_unlock(&bounceJobsLock);
+  if (handle < 0)
+  {
+    printf("Error: Too many bounces running, finish one first.\n");
+    freeBounceJob(job);
+    return -1;
+  }
+
+  job->outputPath = strdup(outputPath);
+  if (job->ranges == NULL)
+  {
+    job->framesToRender = job->frameCount;
+  }
+  job->startedMs = monotonicMs();
+  initTaskGroup(&job->group);
+  pthread_once(&bouncePoolOnce, startBouncePool);
+  if (bouncePoolStarted)
+  {
+    submitTask(&bouncePool, &job->group, runBounceJob, job);
+  }
+  else
+  {
+    runBounceJob(job);
+  }
+  return handle;
+}
+
+// a job for every track marked in tracksToMix, with gain and pan folded into the
+// left and right gains of each input; NULL if there are none. The tracks are opened
+// by openBounceSources.
+BounceJob *createMixdownJob(const uint32_t *tracksToMix, const float *gains, const float *pans)
+{
+  int *trackIndices = calloc(recorder.trackCount, sizeof(int));
+  float *leftGains = calloc(recorder.trackCount, sizeof(float));
+  float *rightGains = calloc(recorder.trackCount, sizeof(float));
+  size_t count = 0;
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    if (tracksToMix[i] != 1)
+    {
+      continue;
+    }
+    float gain = gains != NULL ? gains[i] : 1;
+    float pan = pans != NULL ? pans[i] : 0;
+    pan = pan < -1 ? -1 : (pan > 1 ? 1 : pan);
+    float angle = (pan + 1) * (float)M_PI / 4;
+    float left = gain * cosf(angle);
+    float right = gain * sinf(angle);
+    // a hard pan should leave the other side exactly silent, not at cos(pi/2)
+    leftGains[count] = fabsf(left) < 1e-7f ? 0 : left;
+    rightGains[count] = fabsf(right) < 1e-7f ? 0 : right;
+    trackIndices[count++] = i;
+  }
+  BounceJob *job = count > 0 ? newBounceJob(trackIndices, leftGains, rightGains, count) : NULL;
+  free(trackIndices);
+  free(leftGains);
+  free(rightGains);
+  if (count == 0)
+  {
+    printf("Error: No tracks marked for bouncing.\n");
+  }
+  return job;
+}
+
+// Queues a mixdown of every track marked in tracksToMix to a stereo wav at
+// selectedPath and returns its handle, or -1 if it could not start. gains are
+// linear and pans run from -1 (left) to 1 (right), both indexed by track; NULL
+// means unity gain or center. Pan is constant power, so a centered track is 3 dB
+// down on each side. The bounce covers startSeconds to endSeconds of the session,
+// or to the end of the longest track when endSeconds is 0.
+int submitBounce(const uint32_t *tracksToMix, const float *gains, const float *pans, double startSeconds, double endSeconds, const char *selectedPath)
+{
+  BounceJob *job = createMixdownJob(tracksToMix, gains, pans);
+  if (job == NULL)
+  {
+    return -1;
+  }
+
+  // a reel session's track files are brought up to date on the pool, so the caller
+  // does not wait for that; the job opens them and measures an open end there
+  job->sourcesPending = sessionStorage == STORAGE_REEL;
+  if (!job->sourcesPending && !openBounceSources(job))
+  {
+    freeBounceJob(job);
+    return -1;
+  }
+  job->startFrame = secondsToFrames(startSeconds > 0 ? startSeconds : 0);
+  job->openEnded = endSeconds <= 0;
+  if (job->openEnded && job->sourcesPending)
+  {
+    return queueBounceJob(job, selectedPath);
+  }
+  uint64_t endFrame = job->openEnded ? longestInputFrames(job) : secondsToFrames(endSeconds);
+  job->frameCount = endFrame > job->startFrame ? endFrame - job->startFrame : 0;
+  if (job->frameCount == 0)
+  {
+    printf("ERROR: Nothing to bounce in the selected range.\n");
+    freeBounceJob(job);
+    return -1;
+  }
+  return queueBounceJob(job, selectedPath);
+}
+
+// adds first..end to a job's ranges, merging it with any range it touches
+void addBounceRange(BounceJob *job, uint64_t first, uint64_t end)
+{
+  if (end <= first)
+  {
+    return;
+  }
+  size_t kept = 0;
+  for (size_t r = 0; r < job->rangeCount; r++)
+  {
+    uint64_t rangeFirst = job->ranges[r * 2];
+    uint64_t rangeEnd = job->ranges[r * 2 + 1];
+    if (rangeEnd < first || rangeFirst > end)
+    {
+      job->ranges[kept * 2] = rangeFirst;
+      job->ranges[kept * 2 + 1] = rangeEnd;
+      kept++;
+    }
+    else
+    {
+      first = rangeFirst < first ? rangeFirst : first;
+      end = rangeEnd > end ? rangeEnd : end;
+    }
+  }
+  job->ranges = realloc(job->ranges, (kept + 1) * 2 * sizeof(uint64_t));
+  job->ranges[kept * 2] = first;
+  job->ranges[kept * 2 + 1] = end;
+  job->rangeCount = kept + 1;
+}
+
+// Re-bounces the output at bouncePath with the tracks, gains and range it was made
+// with, rendering only what was recorded over since. Returns a handle like
+// submitBounce, or -1 when the output has no bounce record.
+int submitRebounce(const char *bouncePath)
+{
+  char *recordPath = bounceRecordPath(bouncePath);
+  FILE *record = fopen(recordPath, "r");
+  free(recordPath);
+  if (record == NULL)
+  {
+    printf("Error: %s has no bounce record to re-bounce from.\n", bouncePath);
+    return -1;
+  }
+  if (sessionStorage == STORAGE_REEL && exportReelToTrackFiles() != 0)
+  {
+    fclose(record);
+    return -1;
+  }
+
+  unsigned long long startFrame = 0, frameCount = 0, journalOffset = 0;
+  int openEnded = 0;
+  bool readable = fscanf(record, "tape_sim bounce 1 range %llu %llu %d journal %llu", &startFrame, &frameCount, &openEnded, &journalOffset) == 4;
+  size_t capacity = recorder.trackCount > 0 ? recorder.trackCount : 1;
+  int *trackIndices = calloc(capacity, sizeof(int));
+  float *leftGains = calloc(capacity, sizeof(float));
+  float *rightGains = calloc(capacity, sizeof(float));
+  long long *modified = calloc(capacity, sizeof(long long));
+  long long *sizes = calloc(capacity, sizeof(long long));
+  size_t count = 0;
+  while (readable && count < capacity &&
+         fscanf(record, " track %d %f %f %lld %lld", &trackIndices[count], &leftGains[count], &rightGains[count], &modified[count], &sizes[count]) == 5)
+  {
+    count++;
+  }
+  fclose(record);
+
+  BounceJob *job = readable && count > 0 ? createBounceJob(trackIndices, leftGains, rightGains, count) : NULL;
+  free(leftGains);
+  free(rightGains);
+  if (job == NULL)
+  {
+    printf("Error: The bounce record of %s could not be used.\n", bouncePath);
+    free(trackIndices);
+    free(modified);
+    free(sizes);
+    return -1;
+  }
+  job->startFrame = startFrame;
+  job->openEnded = openEnded != 0;
+  job->frameCount = frameCount;
+  if (job->openEnded)
+  {
+    uint64_t endFrame = longestInputFrames(job);
+    job->frameCount = endFrame > startFrame ? endFrame - startFrame : 0;
+  }
+
+  // the output has to be the one the record describes
+  bool incremental = job->frameCount >= frameCount;
+  int outputFd = open(bouncePath, O_RDONLY);
+  WavLayout layout;
+  incremental = incremental && outputFd >= 0 && readWavLayout(outputFd, &layout) && layout.format.channels == 2 &&
+                layout.format.formatTag == sampleKernels->formatTag && layout.format.bitsPerSample == bitDepth &&
+                layout.dataSize == frameCount * layout.format.blockAlign;
+  if (outputFd >= 0)
+  {
+    close(outputFd);
+  }
+
+  // every journal entry since the bounce, for one of its tracks, marks output to redo
+  bool *journaled = calloc(count, sizeof(bool));
+  char *journalPath = editJournalPath();
+  FILE *journal = fopen(journalPath, "r");
+  free(journalPath);
+  incremental = incremental && journal != NULL && editJournalLength() >= journalOffset && fseeko(journal, journalOffset, SEEK_SET) == 0;
+  int track;
+  unsigned long long first, end;
+  while (incremental && fscanf(journal, "%d %llu %llu", &track, &first, &end) == 3)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      if (trackIndices[i] != track)
+      {
+        continue;
+      }
+      journaled[i] = true;
+      uint64_t clippedFirst = first > startFrame ? first - startFrame : 0;
+      uint64_t clippedEnd = end > startFrame ? end - startFrame : 0;
+      clippedEnd = clippedEnd < job->frameCount ? clippedEnd : job->frameCount;
+      addBounceRange(job, clippedFirst, clippedEnd);
+    }
+  }
+  if (journal != NULL)
+  {
+    fclose(journal);
+  }
+
+  // a track that changed without a journal entry could have changed anywhere
+  for (size_t i = 0; incremental && i < count; i++)
+  {
+    struct stat trackStat = {0};
+    char *filePath = trackFilePath(trackIndices[i]);
+    stat(filePath, &trackStat);
+    free(filePath);
+    bool unchanged = (long long)trackStat.st_mtime == modified[i] && (long long)trackStat.st_size == sizes[i];
+    incremental = unchanged || journaled[i];
+  }
+  if (incremental)
+  {
+    addBounceRange(job, frameCount, job->frameCount); // an open ended bounce grows with its tracks
+    job->framesToRender = 0;
+    for (size_t r = 0; r < job->rangeCount; r++)
+    {
+      job->framesToRender += job->ranges[r * 2 + 1] - job->ranges[r * 2];
+    }
+    if (job->ranges == NULL)
+    {
+      job->ranges = malloc(2 * sizeof(uint64_t)); // nothing to redo, just bring the record up to date
+    }
+  }
+  else
+  {
+    free(job->ranges);
+    job->ranges = NULL;
+    job->rangeCount = 0;
+  }
+  free(journaled);
+  free(trackIndices);
+  free(modified);
+  free(sizes);
+
+  if (job->frameCount == 0)
+  {
+    printf("ERROR: Nothing to bounce in the recorded range.\n");
+    freeBounceJob(job);
+    return -1;
+  }
+  return queueBounceJob(job, bouncePath);
+}
+
+float getBounceProgress(int handle)
+{
+  BounceJob *job = bounceJobAt(handle);
+  if (job == NULL)
+  {
+    return 0;
+  }
+  if (job->framesToRender == 0)
+  {
+    return atomic_load(&job->finished) ? 1 : 0; // not measured yet while a reel session exports, or nothing to redo
+  }
+  return (float)atomic_load(&job->framesDone) / job->framesToRender;
+}
+
+// estimated from the rate so far, -1 until the first block is written
+float getBounceSecondsRemaining(int handle)
+{
+  BounceJob *job = bounceJobAt(handle);
+  uint64_t done = job != NULL ? atomic_load(&job->framesDone) : 0;
+  if (done == 0)
+  {
+    return -1;
+  }
+  double elapsed = (monotonicMs() - job->startedMs) / 1000.0;
+  return elapsed * (job->framesToRender - done) / done;
+}
+
+bool isBounceFinished(int handle)
+{
+  BounceJob *job = bounceJobAt(handle);
+  return job == NULL || atomic_load(&job->finished);
+}
+
+// the job stops at its next block and removes the partial output
+void cancelBounce(int handle)
+{
+  BounceJob *job = bounceJobAt(handle);
+  if (job != NULL)
+  {
+    atomic_store(&job->cancelled, true);
+  }
+}
+
+// waits for the job, frees it and its handle, and returns 0 when the bounce was written
+int finishBounce(int handle)
+{
+  BounceJob *job = bounceJobAt(handle);
+  if (job == NULL)
+  {
+    return -1;
+  }
+  waitTaskGroup(&job->group);
+  destroyTaskGroup(&job->group);
+  int result = atomic_load(&job->failed) ? -1 : 0;
+  if (result < 0 && !atomic_load(&job->cancelled))
+  {
+    printf("Error: Bounce to %s failed.\n", job->outputPath);
+  }
+
+  pthread_mutex_lock(&bounceJobsLock);
+  bounceJobs[handle] = NULL;
+  pthread_mutex_unlock(&bounceJobsLock);
+  freeBounceJob(job);
+  return result;
+}
+
+// the blocking form of submitBounce, for the whole length of the tracks
+int mixdownTracks(const uint32_t *tracksToMix, const float *gains, const float *pans, char *selectedPath)
+{
+  int handle = submitBounce(tracksToMix, gains, pans, 0, 0, selectedPath);
+  if (handle < 0)
+  {
+    return 1;
+  }
+  return finishBounce(handle) == 0 ? 0 : 1;
+}
+
+// Pans of the stereo bounce from the UI, indexed by track. Two marked tracks go hard
+// left and right as they always have; any other number is mixed down centered.
+float *stereoBouncePans(const uint32_t *tracksToBounce)
+{
+  float *pans = calloc(recorder.trackCount, sizeof(float));
+  if (pans == NULL)
+  {
+    printf("Memory allocation failed for bounce pans.\n");
+    return NULL;
+  }
+  int found = 0;
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    found += tracksToBounce[i] == 1;
+  }
+  for (size_t i = 0, side = 0; found == 2 && i < recorder.trackCount; i++)
+  {
+    if (tracksToBounce[i] == 1)
+    {
+      pans[i] = side++ == 0 ? -1 : 1;
+    }
+  }
+  return pans;
+}
+
+int bounceTracks(const uint32_t *tracksToBounce, char *selectedPath)
+{
+  float *pans = stereoBouncePans(tracksToBounce);
+  if (pans == NULL)
+  {
+    return 1;
+  }
+  int result = mixdownTracks(tracksToBounce, NULL, pans, selectedPath);
+  free(pans);
+  return result;
+}
+
+// bounceTracks in the background, returning a handle like submitBounce
+int submitStereoBounce(const uint32_t *tracksToBounce, const char *selectedPath)
+{
+  float *pans = stereoBouncePans(tracksToBounce);
+  if (pans == NULL)
+  {
+    return -1;
+  }
+  int handle = submitBounce(tracksToBounce, NULL, pans, 0, 0, selectedPath);
+  free(pans);
+  return handle;
+}
+
+// Writes every track of the session into one polyphonic wav at selectedPath, track N
+// on channel N, as long as the longest track. Tracks without a usable file are silent.
+// The tracks are read through handles of its own, so the transport is left alone.
+int exportPolyphonicWav(char *selectedPath)
+{
+  // reel sessions are exported from track files brought up to date first
+  if (sessionStorage == STORAGE_REEL && exportReelToTrackFiles() != 0)
+  {
+    return 1;
+  }
+
+  size_t bytesPerSample = bitDepth / 8;
+  uint64_t frameCount = 0;
+  WavFile *sources = calloc(recorder.trackCount, sizeof(WavFile));
+  WavFile **monoTracks = calloc(recorder.trackCount, sizeof(WavFile *));
+  if (sources == NULL || monoTracks == NULL)
+  {
+    printf("Memory allocation failed for export tracks.\n");
+    free(sources);
+    free(monoTracks);
+    return 1;
+  }
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    if (!openTrackForReading(&sources[i], i))
+    {
+      continue;
+    }
+    monoTracks[i] = &sources[i];
+    uint64_t trackFrames = sources[i].dataSize / bytesPerSample;
+    frameCount = trackFrames > frameCount ? trackFrames : frameCount;
+  }
+
+  int result = 1;
+  WavFile *exported = calloc(1, sizeof(WavFile));
+  if (frameCount == 0)
+  {
+    printf("ERROR: The session has no recorded audio to export.\n");
+  }
+  else if (exported == NULL)
+  {
+    printf("Memory allocation failed for export tracks.\n");
+  }
+  else if ((exported->file = fopen(selectedPath, "w+b")) == NULL) // a fresh file, not an overwrite into an older export
+  {
+    perror("Failed to open file");
+  }
+  else
+  {
+    resetWritebackState(&exported->writeback);
+    writeNewWavHeader(exported, recorder.trackCount, sampleKernels);
+    result = bounceMonoTracksInterleaved(monoTracks, recorder.trackCount, exported, frameCount);
+    closeWavFile(exported);
+  }
+
+  for (size_t i = 0; i < recorder.trackCount; i++)
+  {
+    if (monoTracks[i] != NULL)
+    {
+      fclose(sources[i].file);
+    }
+  }
+  free(exported);
+  free(monoTracks);
+  free(sources);
+  return result;
+}
+
+// FLAC
+// A small encoder for the lossless copy of an export: 24 bit stereo, fixed blocks
+// of FLAC_BLOCK_FRAMES, the stereo mode and the fixed predictor (orders 0 to 4) that
+// come out smallest for each frame, and Rice coded residuals with the best
+// partitioning. STREAMINFO carries the sizes but no MD5, which FLAC allows.
+#define FLAC_BLOCK_FRAMES 4096
+#define FLAC_BITS 24
+#define FLAC_MAX_FIXED_ORDER 4
+#define FLAC_MAX_PARTITION_ORDER 8
+#define FLAC_MAX_RICE_PARAMETER 14 // 15 is the escape code
+#define FLAC_STREAMINFO_SIZE 34
+
+enum
+{
+  FLAC_INDEPENDENT = 1, // two channels, coded as they are
+  FLAC_LEFT_SIDE = 8,
+  FLAC_SIDE_RIGHT = 9,
+  FLAC_MID_SIDE = 10,
+};
+
+uint8_t flacCrc8Table[256];
+uint16_t flacCrc16Table[256];
+pthread_once_t flacCrcOnce = PTHREAD_ONCE_INIT;
+
+void buildFlacCrcTables()
+{
+  for (int i = 0; i < 256; i++)
+  {
+    uint8_t crc8 = i;
+    uint16_t crc16 = i << 8;
+    for (int bit = 0; bit < 8; bit++)
+    {
+      crc8 = crc8 & 0x80 ? (crc8 << 1) ^ 0x07 : crc8 << 1;
+      crc16 = crc16 & 0x8000 ? (crc16 << 1) ^ 0x8005 : crc16 << 1;
+    }
+    flacCrc8Table[i] = crc8;
+    flacCrc16Table[i] = crc16;
+  }
+}
+
+typedef struct
+{
+  unsigned char *bytes;
+  size_t length;
+  size_t capacity;
+  uint64_t bits; // the low bitCount bits are still to be stored
+  int bitCount;
+} BitWriter;
+
+void putBits(BitWriter *writer, uint32_t value, int count)
+{
+  if (writer->length + 8 > writer->capacity)
+  {
+    writer->capacity = writer->capacity * 2 + 64;
+    writer->bytes = realloc(writer->bytes, writer->capacity);
+  }
+  writer->bits = (writer->bits << count) | (value & (((uint64_t)1 << count) - 1));
+  writer->bitCount += count;
+  while (writer->bitCount >= 8)
+  {
+    writer->bitCount -= 8;
+    writer->bytes[writer->length++] = writer->bits >> writer->bitCount;
+  }
+}
+
+void putUnary(BitWriter *writer, uint32_t zeros)
+{
+  for (; zeros >= 32; zeros -= 32)
+  {
+    putBits(writer, 0, 32);
+  }
+  putBits(writer, 1, zeros + 1);
+}
+
+void alignBits(BitWriter *writer)
+{
+  if (writer->bitCount > 0)
+  {
+    putBits(writer, 0, 8 - writer->bitCount);
+  }
+}
+
+// frame numbers are coded like UTF-8 code points, up to 31 bits
+void putFrameNumber(BitWriter *writer, uint32_t number)
+{
+  if (number < 0x80)
+  {
+    putBits(writer, number, 8);
+    return;
+  }
+  int extra = number < 0x800 ? 1 : number < 0x10000 ? 2 : number < 0x200000 ? 3 : number < 0x4000000 ? 4 : 5;
+  putBits(writer, (0xFF00 >> (extra + 1)) | (number >> (6 * extra)), 8);
+  for (int i = extra - 1; i >= 0; i--)
+  {
+    putBits(writer, 0x80 | ((number >> (6 * i)) & 0x3F), 8);
+  }
+}
+
+static inline uint32_t zigzag(int32_t value)
+{
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+// the n-order fixed predictor's residual of samples[order..count)
+void fixedResidual(const int32_t *samples, size_t count, int order, int32_t *residual)
+{
+  for (size_t i = order; i < count; i++)
+  {
+    const int32_t *s = samples + i;
+    switch (order)
+    {
+    case 0:
+      residual[i] = s[0];
+      break;
+    case 1:
+      residual[i] = s[0] - s[-1];
+      break;
+    case 2:
+      residual[i] = s[0] - 2 * s[-1] + s[-2];
+      break;
+    case 3:
+      residual[i] = s[0] - 3 * s[-1] + 3 * s[-2] - s[-3];
+      break;
+    default:
+      residual[i] = s[0] - 4 * s[-1] + 6 * s[-2] - 4 * s[-3] + s[-4];
+      break;
+    }
+  }
+}
+
+static inline int riceParameter(uint64_t sum, size_t count)
+{
+  int parameter = 0;
+  while (parameter < FLAC_MAX_RICE_PARAMETER && ((uint64_t)count << (parameter + 1)) < sum)
+  {
+    parameter++;
+  }
+  return parameter;
+}
+
+// picks the partition order for residual[order..count) and returns the estimated
+// size of the coded residual in bits
+uint64_t planRice(const int32_t *residual, size_t count, int order, int *partitionOrder)
+{
+  uint64_t best = UINT64_MAX;
+  for (int p = 0; p <= FLAC_MAX_PARTITION_ORDER; p++)
+  {
+    size_t partitionSize = count >> p;
+    if ((count & ((1 << p) - 1)) != 0 || partitionSize <= (size_t)order)
+    {
+      break;
+    }
+    uint64_t bits = 6;
+    for (size_t first = 0; first < count; first += partitionSize)
+    {
+      size_t start = first == 0 ? order : first;
+      uint64_t sum = 0;
+      for (size_t i = start; i < first + partitionSize; i++)
+      {
+        sum += zigzag(residual[i]);
+      }
+      size_t n = first + partitionSize - start;
+      int parameter = riceParameter(sum, n);
+      bits += 4 + n * (parameter + 1) + (sum >> parameter);
+    }
+    if (bits < best)
+    {
+      best = bits;
+      *partitionOrder = p;
+    }
+  }
+  return best;
+}
+
+typedef struct
+{
+  int type; // 0 constant, 1 verbatim, otherwise 8 + the fixed order
+  int partitionOrder;
+  uint64_t bits;
+} FlacSubframePlan;
+
+// the smallest way to code one channel of a frame, with residual holding that order
+FlacSubframePlan planSubframe(const int32_t *samples, size_t count, int bitsPerSample, int32_t *residual)
+{
+  bool constant = true;
+  for (size_t i = 1; i < count && constant; i++)
+  {
+    constant = samples[i] == samples[0];
+  }
+  if (constant)
+  {
+    return (FlacSubframePlan){0, 0, 8 + bitsPerSample};
+  }
+
+  // the order whose residual is smallest in magnitude usually codes smallest too
+  int bestOrder = 0;
+  uint64_t bestSum = UINT64_MAX;
+  for (int order = 0; order <= FLAC_MAX_FIXED_ORDER && (size_t)order < count; order++)
+  {
+    fixedResidual(samples, count, order, residual);
+    uint64_t sum = 0;
+    for (size_t i = order; i < count; i++)
+    {
+      sum += residual[i] < 0 ? -(int64_t)residual[i] : residual[i];
+    }
+    if (sum < bestSum)
+    {
+      bestSum = sum;
+      bestOrder = order;
+    }
+  }
+  fixedResidual(samples, count, bestOrder, residual);
+  FlacSubframePlan plan = {8 + bestOrder, 0, 0};
+  plan.bits = 8 + bestOrder * bitsPerSample + planRice(residual, count, bestOrder, &plan.partitionOrder);
+  uint64_t verbatim = 8 + (uint64_t)count * bitsPerSample;
+  if (plan.bits >= verbatim)
+  {
+    return (FlacSubframePlan){1, 0, verbatim};
+  }
+  return plan;
+}
+
+void putRice(BitWriter *writer, const int32_t *residual, size_t count, int order, int partitionOrder)
+{
+  putBits(writer, 0, 2); // 4 bit Rice parameters
+  putBits(writer, partitionOrder, 4);
+  size_t partitionSize = count >> partitionOrder;
+  for (size_t first = 0; first < count; first += partitionSize)
+  {
+    size_t start = first == 0 ? order : first;
+    uint64_t sum = 0;
+    for (size_t i = start; i < first + partitionSize; i++)
+    {
+      sum += zigzag(residual[i]);
+    }
+    int parameter = riceParameter(sum, first + partitionSize - start);
+    putBits(writer, parameter, 4);
+    for (size_t i = start; i < first + partitionSize; i++)
+    {
+      uint32_t value = zigzag(residual[i]);
+      putUnary(writer, value >> parameter);
+      putBits(writer, value, parameter);
+    }
+  }
+}
+
+void putSubframe(BitWriter *writer, const int32_t *samples, size_t count, int bitsPerSample, int32_t *residual)
+{
+  FlacSubframePlan plan = planSubframe(samples, count, bitsPerSample, residual);
+  if (plan.type == 0)
+  {
+    putBits(writer, 0x00, 8);
+    putBits(writer, samples[0], bitsPerSample);
+    return;
+  }
+  if (plan.type == 1)
+  {
+    putBits(writer, 0x02, 8);
+    for (size_t i = 0; i < count; i++)
+    {
+      putBits(writer, samples[i], bitsPerSample);
+    }
+    return;
+  }
+  int order = plan.type - 8;
+  putBits(writer, (0x08 | order) << 1, 8);
+  for (int i = 0; i < order; i++)
+  {
+    putBits(writer, samples[i], bitsPerSample);
+  }
+  putRice(writer, residual, count, order, plan.partitionOrder);
+}
+
+typedef struct
+{
+  FILE *file;
+  int32_t *channels[4]; // left, right, mid, side of the frame being filled
+  int32_t *residual;
+  size_t frames;        // filled so far
+  uint32_t frameNumber;
+  uint64_t totalFrames;
+  uint32_t minFrameBytes;
+  uint32_t maxFrameBytes;
+  BitWriter writer;
+} FlacEncoder;
+
+void writeFlacStreamInfo(FlacEncoder *flac)
+{
+  BitWriter *writer = &flac->writer;
+  writer->length = 0;
+  putBits(writer, 0x80, 8); // STREAMINFO, and the last metadata block
+  putBits(writer, FLAC_STREAMINFO_SIZE, 24);
+  putBits(writer, FLAC_BLOCK_FRAMES, 16);
+  putBits(writer, FLAC_BLOCK_FRAMES, 16);
+  putBits(writer, flac->minFrameBytes, 24);
+  putBits(writer, flac->maxFrameBytes, 24);
+  putBits(writer, sampleRate, 20);
+  putBits(writer, 2 - 1, 3);
+  putBits(writer, FLAC_BITS - 1, 5);
+  putBits(writer, flac->totalFrames >> 32, 4);
+  putBits(writer, flac->totalFrames, 32);
+  for (int i = 0; i < 4; i++)
+  {
+    putBits(writer, 0, 32); // no MD5
+  }
+  fseek(flac->file, 4, SEEK_SET);
+  fwrite(writer->bytes, 1, writer->length, flac->file);
+  writer->length = 0;
+}
+
+// codes the frame gathered so far
+bool writeFlacFrame(FlacEncoder *flac)
+{
+  size_t count = flac->frames;
+  int32_t **channels = flac->channels;
+  for (size_t i = 0; i < count; i++)
+  {
+    channels[2][i] = (channels[0][i] + channels[1][i]) >> 1;
+    channels[3][i] = channels[0][i] - channels[1][i];
+  }
+
+  // keep the stereo mode whose two channels code smallest
+  uint64_t bits[4];
+  for (int c = 0; c < 4; c++)
+  {
+    bits[c] = planSubframe(channels[c], count, FLAC_BITS + (c == 3), flac->residual).bits;
+  }
+  int assignment = FLAC_INDEPENDENT;
+  uint64_t best = bits[0] + bits[1];
+  if (bits[0] + bits[3] < best)
+  {
+    assignment = FLAC_LEFT_SIDE;
+    best = bits[0] + bits[3];
+  }
+  if (bits[3] + bits[1] < best)
+  {
+    assignment = FLAC_SIDE_RIGHT;
+    best = bits[3] + bits[1];
+  }
+  if (bits[2] + bits[3] < best)
+  {
+    assignment = FLAC_MID_SIDE;
+  }
+  int first = assignment == FLAC_INDEPENDENT || assignment == FLAC_LEFT_SIDE ? 0 : (assignment == FLAC_SIDE_RIGHT ? 3 : 2);
+  int second = assignment == FLAC_INDEPENDENT || assignment == FLAC_SIDE_RIGHT ? 1 : 3;
+
+  BitWriter *writer = &flac->writer;
+  writer->length = 0;
+  putBits(writer, 0xFFF8, 16); // sync, fixed block size
+  bool fullBlock = count == FLAC_BLOCK_FRAMES;
+  putBits(writer, fullBlock ? 12 : 7, 4); // 12 is 4096, 7 is a 16 bit size at the end of the header
+  putBits(writer, 0, 4);                  // sample rate from STREAMINFO
+  putBits(writer, assignment, 4);
+  putBits(writer, 6 << 1, 4); // 24 bit samples
+  putFrameNumber(writer, flac->frameNumber);
+  if (!fullBlock)
+  {
+    putBits(writer, count - 1, 16);
+  }
+  uint8_t crc8 = 0;
+  for (size_t i = 0; i < writer->length; i++)
+  {
+    crc8 = flacCrc8Table[crc8 ^ writer->bytes[i]];
+  }
+  putBits(writer, crc8, 8);
+
+  putSubframe(writer, channels[first], count, FLAC_BITS + (first == 3), flac->residual);
+  putSubframe(writer, channels[second], count, FLAC_BITS + (second == 3), flac->residual);
+  alignBits(writer);
+  uint16_t crc16 = 0;
+  for (size_t i = 0; i < writer->length; i++)
+  {
+    crc16 = (crc16 << 8) ^ flacCrc16Table[(crc16 >> 8) ^ writer->bytes[i]];
+  }
+  putBits(writer, crc16, 16);
+
+  uint32_t frameBytes = writer->length;
+  flac->minFrameBytes = flac->frameNumber == 0 || frameBytes < flac->minFrameBytes ? frameBytes : flac->minFrameBytes;
+  flac->maxFrameBytes = frameBytes > flac->maxFrameBytes ? frameBytes : flac->maxFrameBytes;
+  flac->frameNumber++;
+  flac->totalFrames += count;
+  flac->frames = 0;
+  return fwrite(writer->bytes, 1, frameBytes, flac->file) == frameBytes;
+}
+
+void freeFlacEncoder(FlacEncoder *flac)
+{
+  for (int c = 0; c < 4; c++)
+  {
+    free(flac->channels[c]);
+  }
+  free(flac->residual);
+  free(flac->writer.bytes);
+  free(flac);
+}
+
+void *openFlacExport(const char *path)
+{
+  pthread_once(&flacCrcOnce, buildFlacCrcTables);
+  FlacEncoder *flac = calloc(1, sizeof(FlacEncoder));
+  bool allocated = true;
+  for (int c = 0; c < 4; c++)
+  {
+    allocated = (flac->channels[c] = malloc(FLAC_BLOCK_FRAMES * sizeof(int32_t))) != NULL && allocated;
+  }
+  allocated = (flac->residual = malloc(FLAC_BLOCK_FRAMES * sizeof(int32_t))) != NULL && allocated;
+  flac->file = allocated ? fopen(path, "wb") : NULL;
+  if (flac->file == NULL)
+  {
+    perror("Failed to open file");
+    freeFlacEncoder(flac);
+    return NULL;
+  }
+  fwrite("fLaC", 1, 4, flac->file);
+  writeFlacStreamInfo(flac); // sizes are filled in on close
+  return flac;
+}
+
+bool encodeFlacExport(void *state, const float *left, const float *right, size_t frames)
+{
+  FlacEncoder *flac = state;
+  for (size_t i = 0; i < frames; i++)
+  {
+    // the same rounding as the 24 bit wav, so the two decode identically
+    flac->channels[0][flac->frames] = lrintf(clampScaled(left[i] * 8388608.0f, -8388608.0f, 8388607.0f));
+    flac->channels[1][flac->frames] = lrintf(clampScaled(right[i] * 8388608.0f, -8388608.0f, 8388607.0f));
+    if (++flac->frames == FLAC_BLOCK_FRAMES && !writeFlacFrame(flac))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool closeFlacExport(void *state, bool complete)
+{
+  FlacEncoder *flac = state;
+  bool written = !complete || flac->frames == 0 || writeFlacFrame(flac);
+  if (complete)
+  {
+    writeFlacStreamInfo(flac);
+  }
+  written = fclose(flac->file) == 0 && written;
+  freeFlacEncoder(flac);
+  return written;
+}
+
+// MULTI-TARGET EXPORT
+// One read and mix pass feeds every format asked for. The mixer hands each float
+// block to one queue per encoder, each encoder runs on its own thread, and the
+// last encoder done with a block gives it back to the free list. With only
+// EXPORT_BLOCKS in circulation the mix never runs further ahead of the slowest
+// encoder than that, however fast the reads are.
+#define EXPORT_QUEUE_DEPTH 4
+#define EXPORT_BLOCKS (EXPORT_QUEUE_DEPTH + 1) // one more for the block being mixed
+#define EXPORT_MAX_TARGETS 3
+#define DITHER_SHAPE_TAPS 5
+
+typedef struct
+{
+  float *left;
+  float *right;
+  size_t frames;
+  atomic_int users; // encoders still to finish with it
+} ExportBlock;
+
+// a bounded blocking queue of blocks; NULL is queued to end a stream
+typedef struct
+{
+  ExportBlock *items[EXPORT_BLOCKS + 1];
+  size_t head;
+  size_t count;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} BlockQueue;
+
+void initBlockQueue(BlockQueue *queue)
+{
+  queue->head = 0;
+  queue->count = 0;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->changed, NULL);
+}
+
+void destroyBlockQueue(BlockQueue *queue)
+{
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->changed);
+}
+
+void pushBlock(BlockQueue *queue, ExportBlock *block)
+{
+  size_t capacity = sizeof(queue->items) / sizeof(queue->items[0]);
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == capacity)
+  {
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  }
+  queue->items[(queue->head + queue->count++) % capacity] = block;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+ExportBlock *popBlock(BlockQueue *queue)
+{
+  size_t capacity = sizeof(queue->items) / sizeof(queue->items[0]);
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0)
+  {
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  }
+  ExportBlock *block = queue->items[queue->head];
+  queue->head = (queue->head + 1) % capacity;
+  queue->count--;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+  return block;
+}
+
+// how one target format is written; open returns the encoder's state or NULL,
+// close finishes the file (or just closes it when the export was cut short)
+typedef struct
+{
+  void *(*open)(const char *path);
+  bool (*encode)(void *state, const float *left, const float *right, size_t frames);
+  bool (*close)(void *state, bool complete);
+} ExportFormat;
+
+typedef struct
+{
+  const ExportFormat *format;
+  const char *path;
+  void *state;
+  BlockQueue queue;
+  BlockQueue *freeBlocks;
+  pthread_t thread;
+  bool failed;
+} ExportEncoder;
+
+// a stereo wav in one of the integer formats, written the way bounces are
+typedef struct
+{
+  WavFile wav;
+  const SampleKernels *kernels;
+  unsigned char *sides[2];
+  unsigned char *interleaved;
+  size_t capacity; // frames the buffers hold
+  // 16 bit only: TPDF dither and the noise shaper's last errors per side
+  uint32_t random;
+  float errors[2][DITHER_SHAPE_TAPS];
+} WavExport;
+
+// Lipshitz's 5 tap E-weighted shaper, which moves the requantization noise up
+// where the ear is least sensitive
+const float ditherShape[DITHER_SHAPE_TAPS] = {2.033f, -2.165f, 1.959f, -1.590f, 0.6149f};
+
+WavExport *openWavExport(const char *path, const SampleKernels *kernels)
+{
+  WavExport *output = calloc(1, sizeof(WavExport));
+  output->kernels = kernels;
+  output->random = 0x9E3779B9;
+  output->wav.file = fopen(path, "w+b");
+  if (output->wav.file == NULL)
+  {
+    perror("Failed to open file");
+    free(output);
+    return NULL;
+  }
+  resetWritebackState(&output->wav.writeback);
+  writeNewWavHeader(&output->wav, 2, kernels);
+  return output;
+}
+
+void *openWav24Export(const char *path)
+{
+  return openWavExport(path, &sampleKernelTable[SAMPLE_INT24]);
+}
+
+void *openWav16Export(const char *path)
+{
+  return openWavExport(path, &sampleKernelTable[SAMPLE_INT16]);
+}
+
+static inline float nextDitherUniform(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state * (1.0f / 4294967296.0f);
+}
+
+// quantizes to 16 bits with triangular dither of one LSB either way, the error of
+// each sample fed back through the shaper into the ones after it
+void ditherToInt16(WavExport *output, int side, const float *source, unsigned char *destination, size_t frames)
+{
+  float *errors = output->errors[side];
+  for (size_t i = 0; i < frames; i++)
+  {
+    float shaped = source[i] * 32768.0f;
+    for (int k = 0; k < DITHER_SHAPE_TAPS; k++)
+    {
+      shaped -= ditherShape[k] * errors[k];
+    }
+    float dither = nextDitherUniform(&output->random) - nextDitherUniform(&output->random);
+    float quantized = rintf(shaped + dither);
+    memmove(errors + 1, errors, (DITHER_SHAPE_TAPS - 1) * sizeof(float));
+    errors[0] = quantized - shaped; // unclipped, so a clipped peak does not upset the shaper
+    int16_t value = (int16_t)clampScaled(quantized, -32768.0f, 32767.0f);
+    memcpy(destination + i * 2, &value, 2);
+  }
+}
+
+bool encodeWavExport(void *state, const float *left, const float *right, size_t frames)
+{
+  WavExport *output = state;
+  size_t bytesPerSample = output->kernels->bytesPerSample;
+  if (frames > output->capacity)
+  {
+    free(output->sides[0]);
+    free(output->sides[1]);
+    free(output->interleaved);
+    output->sides[0] = malloc(frames * bytesPerSample);
+    output->sides[1] = malloc(frames * bytesPerSample);
+    output->interleaved = malloc(frames * 2 * bytesPerSample);
+    output->capacity = frames;
+    if (output->sides[0] == NULL || output->sides[1] == NULL || output->interleaved == NULL)
+    {
+      printf("Memory allocation failed for export blocks.\n");
+      output->capacity = 0;
+      return false;
+    }
+  }
+  const float *channels[2] = {left, right};
+  for (int side = 0; side < 2; side++)
+  {
+    if (bytesPerSample == 2)
+    {
+      ditherToInt16(output, side, channels[side], output->sides[side], frames);
+    }
+    else
+    {
+      output->kernels->fromFloat(channels[side], output->sides[side], frames);
+    }
+  }
+  if (bytesPerSample == 3)
+  {
+    interleaveInt24((const unsigned char *const *)output->sides, 2, output->interleaved, frames);
+  }
+  else
+  {
+    interleaveSamplesScalar((const unsigned char *const *)output->sides, 2, bytesPerSample, output->interleaved, 0, 2, 0, frames);
+  }
+  size_t size = frames * 2 * bytesPerSample;
+  size_t written = writeTrackAt(&output->wav, output->wav.writePosition, output->interleaved, size);
+  finishTrackWrite(&output->wav, written);
+  return written == size;
+}
+
+bool closeWavExport(void *state, bool complete)
+{
+  WavExport *output = state;
+  closeWavFile(&output->wav);
+  free(output->sides[0]);
+  free(output->sides[1]);
+  free(output->interleaved);
+  free(output);
+  return true;
+}
+
+const ExportFormat wav24Export = {openWav24Export, encodeWavExport, closeWavExport};
+const ExportFormat wav16Export = {openWav16Export, encodeWavExport, closeWavExport};
+const ExportFormat flacExport = {openFlacExport, encodeFlacExport, closeFlacExport};
+
+void *runExportEncoder(void *arg)
+{
+  ExportEncoder *encoder = arg;
+  ExportBlock *block;
+  while ((block = popBlock(&encoder->queue)) != NULL)
+  {
+    // a failed encoder keeps taking blocks so the others are never held up by it
+    if (!encoder->failed && !encoder->format->encode(encoder->state, block->left, block->right, block->frames))
+    {
+      printf("Error: Failed to write %s.\n", encoder->path);
+      encoder->failed = true;
+    }
+    if (atomic_fetch_sub(&block->users, 1) == 1)
+    {
+      pushBlock(encoder->freeBlocks, block);
+    }
+  }
+  return NULL;
+}
+
+// Mixes the tracks marked in tracksToMix, with gains and pans as for submitBounce,
+// once, and writes the mix to every target whose path is set. Blocks until all of
+// them are written and returns 0 when every one was.
+int exportMixdown(const uint32_t *tracksToMix, const float *gains, const float *pans, const ExportTargets *targets)
+{
+  const ExportFormat *formats[EXPORT_MAX_TARGETS] = {&wav24Export, &wav16Export, &flacExport};
+  const char *paths[EXPORT_MAX_TARGETS] = {targets->wav24Path, targets->wav16Path, targets->flacPath};
+  ExportEncoder encoders[EXPORT_MAX_TARGETS];
+  size_t encoderCount = 0;
+  for (int t = 0; t < EXPORT_MAX_TARGETS; t++)
+  {
+    if (paths[t] != NULL)
+    {
+      encoders[encoderCount++] = (ExportEncoder){formats[t], paths[t]};
+    }
+  }
+  if (encoderCount == 0)
+  {
+    printf("Error: No export targets given.\n");
+    return 1;
+  }
+
+  // reel sessions are exported from track files brought up to date first
+  if (sessionStorage == STORAGE_REEL && exportReelToTrackFiles() != 0)
+  {
+    return 1;
+  }
+  BounceJob *job = createMixdownJob(tracksToMix, gains, pans);
+  if (job == NULL)
+  {
+    return 1;
+  }
+  if (!openBounceSources(job))
+  {
+    freeBounceJob(job);
+    return 1;
+  }
+  uint64_t frameCount = longestInputFrames(job);
+  size_t blockFrames = bounceBlockFrames;
+  Mixer mixer;
+  if (!initMixer(&mixer, job->inputs, job->inputCount, blockFrames))
+  {
+    freeBounceJob(job);
+    return 1;
+  }
+
+  BlockQueue freeBlocks;
+  initBlockQueue(&freeBlocks);
+  ExportBlock blocks[EXPORT_BLOCKS] = {0};
+  bool allocated = true;
+  for (int b = 0; b < EXPORT_BLOCKS; b++)
+  {
+    blocks[b].left = malloc(blockFrames * sizeof(float));
+    blocks[b].right = malloc(blockFrames * sizeof(float));
+    allocated = allocated && blocks[b].left != NULL && blocks[b].right != NULL;
+    pushBlock(&freeBlocks, &blocks[b]);
+  }
+  if (!allocated)
+  {
+    printf("Memory allocation failed for export blocks.\n");
+  }
+
+  int result = allocated ? 0 : 1;
+  size_t started = 0;
+  for (size_t e = 0; e < encoderCount && result == 0; e++)
+  {
+    ExportEncoder *encoder = &encoders[e];
+    encoder->freeBlocks = &freeBlocks;
+    initBlockQueue(&encoder->queue);
+    encoder->state = encoder->format->open(encoder->path);
+    if (encoder->state == NULL || pthread_create(&encoder->thread, NULL, runExportEncoder, encoder) != 0)
+    {
+      if (encoder->state != NULL)
+      {
+        encoder->format->close(encoder->state, false);
+      }
+      destroyBlockQueue(&encoder->queue);
+      result = 1;
+      break;
+    }
+    started++;
+  }
+
+  for (uint64_t frame = 0; frame < frameCount && result == 0; frame += blockFrames)
+  {
+    size_t frames = frameCount - frame < blockFrames ? frameCount - frame : blockFrames;
+    ExportBlock *block = popBlock(&freeBlocks);
+    mixBlock(&mixer, frame, frames);
+    memcpy(block->left, mixer.groups[0].left, frames * sizeof(float));
+    memcpy(block->right, mixer.groups[0].right, frames * sizeof(float));
+    block->frames = frames;
+    atomic_store(&block->users, (int)started);
+    for (size_t e = 0; e < started; e++)
+    {
+      pushBlock(&encoders[e].queue, block);
+    }
+  }
+
+  for (size_t e = 0; e < started; e++)
+  {
+    pushBlock(&encoders[e].queue, NULL);
+  }
+  for (size_t e = 0; e < started; e++)
+  {
+    ExportEncoder *encoder = &encoders[e];
+    pthread_join(encoder->thread, NULL);
+    bool complete = result == 0 && !encoder->failed;
+    if (!encoder->format->close(encoder->state, complete) || !complete)
+    {
+      result = 1;
+    }
+    destroyBlockQueue(&encoder->queue);
+  }
+
+  for (int b = 0; b < EXPORT_BLOCKS; b++)
+  {
+    free(blocks[b].left);
+    free(blocks[b].right);
+  }
+  destroyBlockQueue(&freeBlocks);
+  freeMixer(&mixer);
+  freeBounceJob(job);
+  for (size_t e = 0; e < encoderCount && result != 0; e++)
+  {
+    remove(encoders[e].path); // no half written masters
+  }
+  return result;
+}
+
+// STEM EXPORT
+// Writes tracks out as standalone mono wavs in the session format, a computePool
+// task per track. A first pass over a track finds its peak and, for trimming, the
+// first and last frames above the silence threshold. It meters a slice of
+// STEM_SCAN_FRAMES at a time with the vector meter kernel, so only the slices at
+// the edges of the audio are searched sample by sample. The second pass copies
+// the kept frames, going through the float bus only when a normalizing gain has
+// to be applied.
+#define STEM_SCAN_FRAMES 1024
+#define STEM_FILENAME_FORMAT "stem%d.wav"
+
+typedef struct
+{
+  WavFile source;
+  int trackIndex;
+  char *outputPath;
+  StemOptions options;
+  bool failed;
+} StemTask;
+
+// the peak of the whole track and the frames [first, end) that rise above threshold
+bool scanStem(WavFile *source, float threshold, float *peak, uint64_t *first, uint64_t *end, unsigned char *raw, float *floats,
+              size_t blockFrames)
+{
+  size_t bytesPerSample = bitDepth / 8;
+  uint64_t frameCount = source->dataSize / bytesPerSample;
+  size_t sliceCount = blockFrames / STEM_SCAN_FRAMES + 1;
+  const float **slices = malloc(sliceCount * sizeof(float *));
+  MeterReading *readings = malloc(sliceCount * sizeof(MeterReading));
+  *peak = 0;
+  *first = frameCount;
+  *end = 0;
+  bool read = slices != NULL && readings != NULL;
+  for (uint64_t frame = 0; frame < frameCount && read; frame += blockFrames)
+  {
+    size_t frames = frameCount - frame < blockFrames ? frameCount - frame : blockFrames;
+    size_t size = frames * bytesPerSample;
+    if (readTrackAt(source, source->dataOffset + frame * bytesPerSample, raw, size) != size)
+    {
+      read = false;
+      break;
+    }
+    sampleKernels->toFloat(raw, floats, frames);
+
+    size_t fullSlices = frames / STEM_SCAN_FRAMES;
+    size_t rest = frames % STEM_SCAN_FRAMES;
+    for (size_t s = 0; s <= fullSlices; s++)
+    {
+      slices[s] = floats + s * STEM_SCAN_FRAMES;
+    }
+    meterBlocks(slices, fullSlices, STEM_SCAN_FRAMES, readings);
+    if (rest > 0)
+    {
+      meterBlocks(slices + fullSlices, 1, rest, readings + fullSlices);
+    }
+
+    for (size_t s = 0; s < fullSlices + (rest > 0); s++)
+    {
+      *peak = readings[s].peak > *peak ? readings[s].peak : *peak;
+      if (readings[s].peak <= threshold)
+      {
+        continue;
+      }
+      size_t sliceFrames = s < fullSlices ? STEM_SCAN_FRAMES : rest;
+      uint64_t sliceStart = frame + s * STEM_SCAN_FRAMES;
+      size_t i = 0;
+      if (*first == frameCount)
+      {
+        while (fabsf(slices[s][i]) <= threshold)
+        {
+          i++;
+        }
+        *first = sliceStart + i;
+      }
+      size_t j = sliceFrames - 1;
+      while (fabsf(slices[s][j]) <= threshold)
+      {
+        j--;
+      }
+      *end = sliceStart + j + 1;
+    }
+  }
+  free(slices);
+  free(readings);
+  return read;
+}
+
+void exportStem(void *arg)
+{
+  StemTask *task = arg;
+  size_t bytesPerSample = bitDepth / 8;
+  uint64_t frameCount = task->source.dataSize / bytesPerSample;
+  size_t blockFrames = bounceBlockFrames;
+  unsigned char *raw = malloc(blockFrames * bytesPerSample);
+  float *floats = malloc(blockFrames * sizeof(float));
+  if (raw == NULL || floats == NULL)
+  {
+    printf("Memory allocation failed for stem blocks.\n");
+    task->failed = true;
+    free(raw);
+    free(floats);
+    return;
+  }
+
+  float peak = 0;
+  uint64_t first = 0;
+  uint64_t end = frameCount;
+  bool scan = task->options.trimSilence || task->options.normalizePeak > 0;
+  uint64_t audioFirst, audioEnd;
+  if (scan && !scanStem(&task->source, task->options.silenceThreshold, &peak, &audioFirst, &audioEnd, raw, floats, blockFrames))
+  {
+    printf("Error: Failed to read track %d.\n", task->trackIndex + 1);
+    task->failed = true;
+  }
+  else if (task->options.trimSilence)
+  {
+    first = audioFirst < audioEnd ? audioFirst : 0;
+    end = audioFirst < audioEnd ? audioEnd : 0; // a silent track leaves an empty stem
+  }
+  float gain = task->options.normalizePeak > 0 && peak > 0 ? task->options.normalizePeak / peak : 1;
+
+  WavFile *output = calloc(1, sizeof(WavFile));
+  if (output == NULL)
+  {
+    printf("Memory allocation failed for stem output.\n");
+    task->failed = true;
+  }
+  else
+  {
+    output->file = task->failed ? NULL : fopen(task->outputPath, "w+b");
+  }
+  if (output == NULL || output->file == NULL)
+  {
+    if (output != NULL && !task->failed)
+    {
+      perror("Failed to open file");
+    }
+    task->failed = true;
+  }
+  else
+  {
+    resetWritebackState(&output->writeback);
+    writeNewWavHeader(output, 1, sampleKernels);
+    for (uint64_t frame = first; frame < end; frame += blockFrames)
+    {
+      size_t frames = end - frame < blockFrames ? end - frame : blockFrames;
+      size_t size = frames * bytesPerSample;
+      if (readTrackAt(&task->source, task->source.dataOffset + frame * bytesPerSample, raw, size) != size)
+      {
+        task->failed = true;
+        break;
+      }
+      if (gain != 1)
+      {
+        sampleKernels->toFloat(raw, floats, frames);
+        for (size_t i = 0; i < frames; i++)
+        {
+          floats[i] *= gain;
+        }
+        sampleKernels->fromFloat(floats, raw, frames);
+      }
+      size_t written = writeTrackAt(output, output->writePosition, raw, size);
+      finishTrackWrite(output, written);
+      if (written != size)
+      {
+        task->failed = true;
+        break;
+      }
+    }
+    closeWavFile(output);
+    if (task->failed)
+    {
+      printf("Error: Failed to write %s.\n", task->outputPath);
+      remove(task->outputPath);
+    }
+  }
+
+  free(output);
+  free(raw);
+  free(floats);
+}
+
+// Writes each track marked in tracksToExport (every track with a file when NULL) to
+// directoryPath as stemN.wav, N being the track number. options may be NULL for
+// untrimmed stems at their recorded level. Returns 0 when every stem was written.
+int exportStems(const uint32_t *tracksToExport, const char *directoryPath, const StemOptions *options)
+{
+  if (sessionStorage == STORAGE_REEL && exportReelToTrackFiles() != 0)
+  {
+    return 1;
+  }
+
+  StemTask *tasks = calloc(recorder.trackCount, sizeof(StemTask));
+  size_t taskCount = 0;
+  int result = 0;
+  for (int i = 0; i < recorder.trackCount; i++)
+  {
+    if (tracksToExport != NULL && tracksToExport[i] != 1)
+    {
+      continue;
+    }
+    StemTask *task = &tasks[taskCount];
+    if (!openTrackForReading(&task->source, i))
+    {
+      if (tracksToExport != NULL)
+      {
+        printf("Error: Track %d has no usable audio file.\n", i + 1);
+        result = 1;
+      }
+      continue;
+    }
+    char filename[32];
+    snprintf(filename, sizeof(filename), STEM_FILENAME_FORMAT, i + 1);
+    task->outputPath = malloc(strlen(directoryPath) + strlen(filename) + 2);
+    sprintf(task->outputPath, "%s/%s", directoryPath, filename);
+    task->trackIndex = i;
+    task->options = options != NULL ? *options : (StemOptions){false, 0, 0};
+    taskCount++;
+  }
+
+  pthread_once(&computePoolOnce, startComputePool);
+  TaskGroup group;
+  initTaskGroup(&group);
+  for (size_t t = 0; t < taskCount && result == 0; t++)
+  {
+    if (computePoolStarted)
+    {
+      submitTask(&computePool, &group, exportStem, &tasks[t]);
+    }
+    else
+    {
+      exportStem(&tasks[t]);
+    }
+  }
+  waitTaskGroup(&group);
+  destroyTaskGroup(&group);
+
+  for (size_t t = 0; t < taskCount; t++)
+  {
+    result = tasks[t].failed ? 1 : result;
+    fclose(tasks[t].source.file);
+    free(tasks[t].outputPath);
+  }
+  free(tasks);
+  return result;
+}
+
+void onSetAppDirPath(const char *selectedPath)
+{
+  if (appDirPath != NULL)
   {
     free(appDirPath);
   }
 
-  appDirPath = malloc(strlen(selectedPath) + 1);
-  if (appDirPath == NULL)
+  appDirPath = malloc(strlen(selectedPath) + 1);
+  if (appDirPath == NULL)
+  {
+    fprintf(stderr, "Failed to allocate memory for appDirPath\n");
+    return;
+  }
+  strcpy(appDirPath, selectedPath);
+  printf("App directory path set to: %s\n", appDirPath);
+  // reset time in seconds
+  startTimeInSeconds = 0;
+  // fix up tracks a crash left with stale headers before anything reads them
+  if (sessionStorage == STORAGE_TRACK_FILES)
+  {
+    recoverTrackFiles(appDirPath);
+  }
+  // re-init tracks
+  initTracks(NULL);
+}
+
+// IMPORT
+// Converts a WAV file from anywhere into session tracks: every source channel
+// becomes its own trackN.wav, samples are converted to sampleFormat and the rate is
+// converted with a windowed sinc interpolator. The output is cut into
+// IMPORT_CHUNK_FRAMES pieces that only depend on the source, so the chunks run on
+// every core of computePool in any order and write straight to their place in
+// the track files. The transport has to be stopped; the target tracks are closed
+// until finishImport reopens them.
+#define IMPORT_CHUNK_FRAMES 65536
+#define RESAMPLE_TAPS 32 // source samples per output sample
+#define RESAMPLE_PHASES 512
+
+typedef struct
+{
+  ImportJob *job;
+  uint64_t firstFrame; // output frames
+  uint64_t frameCount;
+} ImportChunk;
+
+// RESAMPLE_PHASES + 1 rows of RESAMPLE_TAPS coefficients, one row per fractional
+// source position. The cutoff follows the lower of the two rates so downsampling
+// does not alias, and every row is normalised to unity gain at DC.
+float *buildResampleTable(uint32_t inRate, uint32_t outRate)
+{
+  float *table = malloc(sizeof(float) * (RESAMPLE_PHASES + 1) * RESAMPLE_TAPS);
+  double cutoff = (inRate > outRate ? (double)outRate / inRate : 1.0) * 0.95;
+  for (int phase = 0; phase <= RESAMPLE_PHASES; phase++)
+  {
+    double fraction = (double)phase / RESAMPLE_PHASES;
+    double sum = 0;
+    float *row = table + phase * RESAMPLE_TAPS;
+    for (int k = 0; k < RESAMPLE_TAPS; k++)
+    {
+      double distance = k - (RESAMPLE_TAPS / 2 - 1) - fraction;
+      double x = M_PI * cutoff * distance;
+      double sinc = distance == 0 ? 1.0 : sin(x) / x;
+      double w = distance / (RESAMPLE_TAPS / 2);
+      double window = fabs(w) >= 1 ? 0 : 0.42 + 0.5 * cos(M_PI * w) + 0.08 * cos(2 * M_PI * w); // Blackman
+      row[k] = cutoff * sinc * window;
+      sum += row[k];
+    }
+    for (int k = 0; k < RESAMPLE_TAPS; k++)
+    {
+      row[k] /= sum;
+    }
+  }
+  return table;
+}
+
+void importChunk(void *arg)
+{
+  ImportChunk *chunk = arg;
+  ImportJob *job = chunk->job;
+  if (atomic_load(&job->failed))
+  {
+    free(chunk);
+    return;
+  }
+
+  WavFormat *source = &job->source;
+  uint32_t inRate = source->sampleRate, outRate = sampleRate;
+  size_t sourceBytesPerSample = source->bitsPerSample / 8;
+  size_t bytesPerSample = bitDepth / 8;
+
+  // source frames this chunk reads, including the filter's reach on both sides
+  uint64_t lastFrame = chunk->firstFrame + chunk->frameCount - 1;
+  int64_t readStart = (int64_t)(chunk->firstFrame * inRate / outRate);
+  int64_t readEnd = (int64_t)(lastFrame * inRate / outRate) + 1;
+  if (job->resampleTable != NULL)
+  {
+    readStart -= RESAMPLE_TAPS / 2 - 1;
+    readEnd += RESAMPLE_TAPS / 2;
+  }
+  int64_t fileStart = readStart > 0 ? readStart : 0;
+  int64_t fileEnd = readEnd < (int64_t)job->sourceFrames ? readEnd : (int64_t)job->sourceFrames;
+  size_t windowFrames = readEnd - readStart;
+
+  unsigned char *input = calloc(windowFrames, source->blockAlign); // zeros stand in for samples outside the file
+  unsigned char *output = malloc(chunk->frameCount * bytesPerSample);
+  float *planar = job->resampleTable != NULL ? malloc(sizeof(float) * windowFrames) : NULL;
+  float *resampled = job->resampleTable != NULL ? malloc(sizeof(float) * chunk->frameCount) : NULL;
+  int32_t *copied = job->resampleTable == NULL ? malloc(sizeof(int32_t) * chunk->frameCount) : NULL;
+  bool allocated = input != NULL && output != NULL &&
+                   (job->resampleTable != NULL ? planar != NULL && resampled != NULL : copied != NULL);
+  if (!allocated)
+  {
+    printf("Memory allocation failed for import chunk.\n");
+    atomic_store(&job->failed, true);
+  }
+  else if (fileEnd > fileStart)
+  {
+    size_t size = (fileEnd - fileStart) * source->blockAlign;
+    off_t position = job->sourceOffset + fileStart * source->blockAlign;
+    if (pread(job->sourceFd, input + (fileStart - readStart) * source->blockAlign, size, position) != (ssize_t)size)
+    {
+      atomic_store(&job->failed, true);
+    }
+  }
+
+  for (int channel = 0; channel < source->channels && !atomic_load(&job->failed); channel++)
+  {
+    const unsigned char *samples = input + channel * sourceBytesPerSample;
+    if (job->resampleTable == NULL)
+    {
+      for (size_t i = 0; i < chunk->frameCount; i++)
+      {
+        copied[i] = decodeSample(samples + i * source->blockAlign, source);
+      }
+      sampleKernels->fromInt32(copied, output, chunk->frameCount);
+    }
+    else
+    {
+      for (size_t i = 0; i < windowFrames; i++)
+      {
+        planar[i] = decodeSample(samples + i * source->blockAlign, source) / 2147483648.0f;
+      }
+      for (size_t i = 0; i < chunk->frameCount; i++)
+      {
+        // exact rational source position, so long files do not drift
+        uint64_t scaled = (chunk->firstFrame + i) * inRate;
+        int64_t base = (int64_t)(scaled / outRate) - (RESAMPLE_TAPS / 2 - 1) - readStart;
+        int phase = (int)(((scaled % outRate) * RESAMPLE_PHASES + outRate / 2) / outRate);
+        const float *row = job->resampleTable + phase * RESAMPLE_TAPS;
+        float sum = 0;
+        for (int k = 0; k < RESAMPLE_TAPS; k++)
+        {
+          sum += planar[base + k] * row[k];
+        }
+        resampled[i] = sum;
+      }
+      sampleKernels->fromFloat(resampled, output, chunk->frameCount);
+    }
+
+    WavFile *track = &job->outputs[channel];
+    size_t size = chunk->frameCount * bytesPerSample;
+    if (writeTrackAt(track, track->dataOffset + chunk->firstFrame * bytesPerSample, output, size) != size)
+    {
+      atomic_store(&job->failed, true);
+    }
+  }
+
+  free(input);
+  free(output);
+  free(planar);
+  free(resampled);
+  free(copied);
+  atomic_fetch_add(&job->framesDone, chunk->frameCount);
+  free(chunk);
+}
+
+// queues every chunk, waits for them and writes the final headers
+void *importLoop(void *arg)
+{
+  ImportJob *job = arg;
+  pthread_once(&computePoolOnce, startComputePool);
+
+  TaskGroup group;
+  initTaskGroup(&group);
+  for (uint64_t frame = 0; frame < job->outputFrames; frame += IMPORT_CHUNK_FRAMES)
+  {
+    ImportChunk *chunk = malloc(sizeof(ImportChunk));
+    chunk->job = job;
+    chunk->firstFrame = frame;
+    chunk->frameCount = job->outputFrames - frame < IMPORT_CHUNK_FRAMES ? job->outputFrames - frame : IMPORT_CHUNK_FRAMES;
+    if (computePoolStarted)
+    {
+      submitTask(&computePool, &group, importChunk, chunk);
+    }
+    else
+    {
+      importChunk(chunk);
+    }
+  }
+  waitTaskGroup(&group);
+  destroyTaskGroup(&group);
+
+  size_t bytesPerSample = bitDepth / 8;
+  for (int channel = 0; channel < job->source.channels; channel++)
   {
-    fprintf(stderr, "Failed to allocate memory for appDirPath\n");
+    WavFile *track = &job->outputs[channel];
+    track->dataSize = atomic_load(&job->failed) ? 0 : job->outputFrames * bytesPerSample;
+    track->headerStale = true;
+    closeWavFile(track);
+    noteTrackEdit(job->firstTrack + channel, 0, job->outputFrames);
+  }
+  atomic_store(&job->finished, true);
+  return NULL;
+}
+
+// Decides from the file on disk, not the open track, since a track in another
+// format is left closed but still holds audio. A missing, zero length or header
+// only trackN.wav is empty; anything else, readable or not, is refused.
+bool trackFileIsEmpty(int trackIndex)
+{
+  char *filePath = trackFilePath(trackIndex);
+  int fd = open(filePath, O_RDONLY);
+  free(filePath);
+  if (fd == -1)
+  {
+    if (errno == ENOENT)
+    {
+      return true;
+    }
+    printf("Error: track%d.wav cannot be read, import into empty tracks.\n", trackIndex + 1);
+    return false;
+  }
+
+  struct stat fileStat;
+  WavLayout layout;
+  bool empty = false;
+  bool statted = fstat(fd, &fileStat) == 0;
+  if (statted && fileStat.st_size == 0)
+  {
+    empty = true;
+  }
+  else if (!statted || !readWavLayout(fd, &layout))
+  {
+    printf("Error: track%d.wav is not a WAV file this session can read, import into empty tracks.\n", trackIndex + 1);
+  }
+  else
+  {
+    uint64_t inFile = (uint64_t)fileStat.st_size > layout.dataOffset ? fileStat.st_size - layout.dataOffset : 0;
+    empty = layout.dataSize == 0 || inFile == 0;
+    if (!empty)
+    {
+      printf("Error: track%d.wav already has audio, import into empty tracks.\n", trackIndex + 1);
+    }
+  }
+  close(fd);
+  return empty;
+}
+
+// Starts converting filePath into tracks firstTrack, firstTrack + 1, ... (zero
+// based), one per source channel, in the background. The target tracks must exist
+// on the current device and hold no audio yet. Returns NULL if the import cannot
+// start.
+ImportJob *startImport(const char *filePath, int firstTrack)
+{
+  if (appDirPath == NULL || sessionStorage != STORAGE_TRACK_FILES)
+  {
+    printf("Error: Import needs a working directory with per-track files.\n");
+    return NULL;
+  }
+  if (atomic_load(&diskWriterRunning) || atomic_load(&prefetcherRunning))
+  {
+    printf("Error: Stop the transport before importing.\n");
+    return NULL;
+  }
+
+  ImportJob *job = calloc(1, sizeof(ImportJob));
+  if (job == NULL)
+  {
+    printf("Memory allocation failed for import job.\n");
+    return NULL;
+  }
+  WavLayout layout;
+  job->sourceFd = open(filePath, O_RDONLY);
+  if (job->sourceFd == -1 || !readWavLayout(job->sourceFd, &layout) || !wavFormatSupported(&layout.format) || layout.format.sampleRate == 0)
+  {
+    printf("Error: %s is not a WAV file that can be imported.\n", filePath);
+    if (job->sourceFd != -1)
+    {
+      close(job->sourceFd);
+    }
+    free(job);
+    return NULL;
+  }
+
+  struct stat fileStat;
+  fstat(job->sourceFd, &fileStat);
+  uint64_t inFile = (uint64_t)fileStat.st_size > layout.dataOffset ? fileStat.st_size - layout.dataOffset : 0;
+  uint64_t dataSize = layout.dataSize < inFile ? layout.dataSize : inFile;
+  job->source = layout.format;
+  job->sourceOffset = layout.dataOffset;
+  job->sourceFrames = dataSize / layout.format.blockAlign;
+  job->firstTrack = firstTrack;
+
+  int channels = job->source.channels;
+  bool usable = firstTrack >= 0 && firstTrack + channels <= recorder.trackCount;
+  if (!usable)
+  {
+    printf("Error: %s needs %d tracks from track %d, the session has %d.\n", filePath, channels, firstTrack + 1, recorder.trackCount);
+  }
+  for (int t = firstTrack; usable && t < firstTrack + channels; t++)
+  {
+    usable = trackFileIsEmpty(t);
+  }
+  if (!usable)
+  {
+    close(job->sourceFd);
+    free(job);
+    return NULL;
+  }
+
+  uint32_t inRate = job->source.sampleRate;
+  job->outputFrames = (job->sourceFrames * sampleRate + inRate - 1) / inRate;
+  job->resampleTable = inRate != (uint32_t)sampleRate ? buildResampleTable(inRate, sampleRate) : NULL;
+  job->sourcePath = strdup(filePath);
+  job->outputs = calloc(channels, sizeof(WavFile));
+
+  double savedStartTime = startTimeInSeconds;
+  startTimeInSeconds = 0;
+  for (int channel = 0; channel < channels; channel++)
+  {
+    int t = firstTrack + channel;
+    char filename[32];
+    snprintf(filename, sizeof(filename), "track%d.wav", t + 1);
+    char *trackPath = malloc(strlen(appDirPath) + strlen(filename) + 2);
+    sprintf(trackPath, "%s/%s", appDirPath, filename);
+    closeWavFile(&recorder.tracks[t]);
+    remove(trackPath);
+    free(trackPath);
+    openWavFile(&job->outputs[channel], filename, appDirPath, 1);
+    if (job->outputs[channel].file == NULL)
+    {
+      atomic_store(&job->failed, true);
+    }
+  }
+  startTimeInSeconds = savedStartTime;
+
+  printf("Importing %s: %u channel, %u Hz, %u bit into tracks %d-%d.\n", filePath, channels, inRate, job->source.bitsPerSample, firstTrack + 1, firstTrack + channels);
+  if (pthread_create(&job->thread, NULL, importLoop, job) != 0)
+  {
+    importLoop(job); // no thread to spare, convert in place
+    job->thread = pthread_self();
+  }
+  return job;
+}
+
+float getImportProgress(ImportJob *job)
+{
+  if (job->outputFrames == 0)
+  {
+    return atomic_load(&job->finished) ? 1.0f : 0.0f;
+  }
+  return (float)atomic_load(&job->framesDone) / job->outputFrames;
+}
+
+bool isImportFinished(ImportJob *job)
+{
+  return atomic_load(&job->finished);
+}
+
+// Waits for the job, reopens the session's tracks and frees the job. Returns the
+// number of tracks written, or -1 if the import failed.
+int finishImport(ImportJob *job)
+{
+  if (!pthread_equal(job->thread, pthread_self()))
+  {
+    pthread_join(job->thread, NULL);
+  }
+  int result = atomic_load(&job->failed) ? -1 : job->source.channels;
+  if (result < 0)
+  {
+    printf("Error: Import of %s failed.\n", job->sourcePath);
+  }
+
+  close(job->sourceFd);
+  free(job->resampleTable);
+  free(job->outputs);
+  free(job->sourcePath);
+  free(job);
+  openTrackFiles();
+  return result;
+}
+
+// OFFLINE RENDER
+// Runs the engine over files instead of a device, as fast as it can go. The device
+// input comes from a multichannel wav, channel N feeding track N, and the device
+// output goes to one, a channel per track. Nothing is paced by threads here: before
+// each block the playback rings are topped up and after it the record rings are
+// drained, inline, so the rings never underrun or overflow however fast it runs.
+
+// Tracks of the session in directoryPath: track1.wav, track2.wav ... up to the
+// first one missing. For setting up an offline render without a device.
+int sessionTrackCount(const char *directoryPath)
+{
+  int count = 0;
+  while (true)
+  {
+    char filename[32];
+    snprintf(filename, sizeof(filename), "track%d.wav", count + 1);
+    char *filePath = malloc(strlen(directoryPath) + strlen(filename) + 2);
+    sprintf(filePath, "%s/%s", directoryPath, filename);
+    bool exists = access(filePath, F_OK) == 0;
+    free(filePath);
+    if (!exists)
+    {
+      return count;
+    }
+    count++;
+  }
+}
+
+// fills the playback rings and drains the record rings the way the prefetcher and
+// the disk writer would
+void pumpTransport(bool flushAll)
+{
+  if (!isRecording || bouncingToTrack)
+  {
+    if (sessionStorage == STORAGE_REEL)
+    {
+      while (prefetchReel() > 0)
+        ;
+    }
+    else
+    {
+      prefetchTracks();
+    }
+  }
+  if (isRecording)
+  {
+    (sessionStorage == STORAGE_REEL ? drainReel : drainRecordRings)(flushAll);
+  }
+}
+
+// frames from the play head to the end of the longest track
+uint64_t framesToSessionEnd()
+{
+  size_t bytesPerSample = bitDepth / 8;
+  uint64_t longest = 0;
+  for (int t = 0; t < recorder.trackCount; t++)
+  {
+    uint64_t trackFrames = 0;
+    if (sessionStorage == STORAGE_REEL)
+    {
+      trackFrames = t < reelSharedTrackCount() ? reel.trackFrames[t] : 0;
+    }
+    else if (recorder.tracks[t].file != NULL)
+    {
+      trackFrames = recorder.tracks[t].dataSize / bytesPerSample;
+    }
+    longest = trackFrames > longest ? trackFrames : longest;
+  }
+  return longest > recorder.playbackPosition ? longest - recorder.playbackPosition : 0;
+}
+
+// Runs one pass of the engine from the current start time without a device. With
+// recordEnabledStates it records the armed tracks from inputPath (which has to be
+// in the session's sample format and rate), otherwise it plays the session back.
+// outputPath, when set, receives what the engine would send to the device. The pass
+// lasts seconds, or when that is 0 until the input or the longest track ends.
+// Timings go to stats when it is not NULL. Returns 0 when the pass completed.
+int renderOffline(const uint32_t *recordEnabledStates, const char *inputPath, const char *outputPath, double seconds,
+                  RenderStats *stats)
+{
+  size_t bytesPerSample = bitDepth / 8;
+  size_t trackCount = recorder.trackCount;
+  size_t framesPerBuffer = frames;
+
+  int inputFd = -1;
+  WavLayout input = {0};
+  uint64_t inputFrames = 0;
+  if (inputPath != NULL)
+  {
+    inputFd = open(inputPath, O_RDONLY);
+    struct stat inputStat;
+    if (inputFd == -1 || fstat(inputFd, &inputStat) != 0 || !readWavLayout(inputFd, &input))
+    {
+      printf("Error: Could not read %s.\n", inputPath);
+      if (inputFd != -1)
+      {
+        close(inputFd);
+      }
+      return 1;
+    }
+    if (input.format.formatTag != sampleKernels->formatTag || input.format.sampleRate != (uint32_t)sampleRate ||
+        input.format.bitsPerSample != bitDepth || input.format.blockAlign != input.format.channels * bytesPerSample)
+    {
+      printf("Error: %s is not in the session's sample format and rate.\n", inputPath);
+      close(inputFd);
+      return 1;
+    }
+    uint64_t inFile = (uint64_t)inputStat.st_size > input.dataOffset ? inputStat.st_size - input.dataOffset : 0;
+    inputFrames = (input.dataSize < inFile ? input.dataSize : inFile) / input.format.blockAlign;
+  }
+
+  prepareTransport(recordEnabledStates, recordEnabledStates != NULL);
+  prepareEngine(framesPerBuffer);
+  prepareLogQueue();
+  if (isRecording)
+  {
+    reel.writeFrame = recorder.playbackPosition;
+  }
+  if (!isRecording || bouncingToTrack)
+  {
+    seedPlaybackRings();
+  }
+
+  uint64_t frameCount = seconds > 0 ? secondsToFrames(seconds) : (isRecording ? inputFrames : framesToSessionEnd());
+  size_t blockBytes = framesPerBuffer * bytesPerSample;
+  unsigned char **inputs = calloc(trackCount, sizeof(unsigned char *));
+  unsigned char **outputs = calloc(trackCount, sizeof(unsigned char *));
+  unsigned char *inputBlock = malloc(framesPerBuffer * (input.format.blockAlign > 0 ? input.format.blockAlign : 1));
+  unsigned char *outputBlock = malloc(blockBytes * trackCount);
+  bool allocated = inputs != NULL && outputs != NULL && inputBlock != NULL && outputBlock != NULL;
+  for (size_t t = 0; allocated && t < trackCount; t++)
+  {
+    allocated = (inputs[t] = calloc(1, blockBytes)) != NULL && (outputs[t] = calloc(1, blockBytes)) != NULL;
+  }
+
+  WavFile *output = calloc(1, sizeof(WavFile));
+  allocated = allocated && output != NULL;
+  if (output != NULL)
+  {
+    output->file = allocated && outputPath != NULL ? fopen(outputPath, "w+b") : NULL;
+  }
+  int result = allocated ? 0 : 1;
+  if (!allocated)
+  {
+    printf("Memory allocation failed for render blocks.\n");
+  }
+  else if (outputPath != NULL && output->file == NULL)
+  {
+    perror("Failed to open file");
+    result = 1;
+  }
+  else if (output->file != NULL)
+  {
+    resetWritebackState(&output->writeback);
+    writeNewWavHeader(output, trackCount, sampleKernels);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  double engineSeconds = 0;
+  uint64_t frame = 0;
+  for (; frame < frameCount && result == 0; frame += framesPerBuffer)
+  {
+    size_t blockFrames = frameCount - frame < framesPerBuffer ? frameCount - frame : framesPerBuffer;
+
+    // split the input block into one block per track, silence past its end
+    for (size_t t = 0; inputFd != -1 && t < trackCount; t++)
+    {
+      memset(inputs[t], 0, blockBytes);
+    }
+    if (inputFd != -1 && frame < inputFrames)
+    {
+      size_t wanted = inputFrames - frame < blockFrames ? inputFrames - frame : blockFrames;
+      ssize_t readBytes = pread(inputFd, inputBlock, wanted * input.format.blockAlign, input.dataOffset + frame * input.format.blockAlign);
+      size_t readFrames = readBytes > 0 ? readBytes / input.format.blockAlign : 0;
+      if (readFrames < wanted)
+      {
+        printf("Error: Failed to read %s at frame %llu.\n", inputPath, (unsigned long long)(frame + readFrames));
+        result = 1;
+        break;
+      }
+      size_t channels = input.format.channels < trackCount ? input.format.channels : trackCount;
+      for (size_t f = 0; f < readFrames; f++)
+      {
+        for (size_t c = 0; c < channels; c++)
+        {
+          memcpy(inputs[c] + f * bytesPerSample, inputBlock + f * input.format.blockAlign + c * bytesPerSample, bytesPerSample);
+        }
+      }
+    }
+
+    pumpTransport(false);
+    struct timespec blockStart;
+    clock_gettime(CLOCK_MONOTONIC, &blockStart);
+    processEngineBlock((const unsigned char *const *)inputs, outputs, blockFrames, 0);
+    engineSeconds += elapsedSeconds(blockStart);
+    drainLogQueue();
+
+    if (output->file != NULL)
+    {
+      interleaveSamples((const unsigned char *const *)outputs, trackCount, outputBlock, blockFrames);
+      size_t size = blockFrames * trackCount * bytesPerSample;
+      size_t written = writeTrackAt(output, output->writePosition, outputBlock, size);
+      finishTrackWrite(output, written);
+      if (written != size)
+      {
+        printf("Error: Failed to write %s.\n", outputPath);
+        result = 1;
+      }
+    }
+  }
+  pumpTransport(true);
+  double totalSeconds = elapsedSeconds(start);
+  drainLogQueue();
+  closeWavFiles();
+
+  if (output != NULL && output->file != NULL)
+  {
+    closeWavFile(output);
+  }
+  if (stats != NULL)
+  {
+    uint64_t rendered = frame < frameCount ? frame : frameCount;
+    double audioSeconds = (double)rendered / sampleRate;
+    *stats = (RenderStats){rendered, totalSeconds, engineSeconds, totalSeconds > 0 ? audioSeconds / totalSeconds : 0,
+                           engineSeconds > 0 ? audioSeconds / engineSeconds : 0};
+  }
+
+  for (size_t t = 0; t < trackCount; t++)
+  {
+    free(inputs != NULL ? inputs[t] : NULL);
+    free(outputs != NULL ? outputs[t] : NULL);
+  }
+  free(inputs);
+  free(outputs);
+  free(inputBlock);
+  free(outputBlock);
+  free(output);
+  if (inputFd != -1)
+  {
+    close(inputFd);
+  }
+  return result;
+}
+
+// BENCHMARKS
+// true when every benchmark track opened; otherwise closes and removes them all
+bool benchmarkTracksOpen(WavFile *tracks, int trackCount, const char *dirPath)
+{
+  bool opened = true;
+  for (int t = 0; t < trackCount; t++)
+  {
+    opened = opened && tracks[t].file != NULL;
+  }
+  if (opened)
+  {
+    return true;
+  }
+
+  printf("Error: Could not open the benchmark tracks in %s.\n", dirPath);
+  for (int t = 0; t < trackCount; t++)
+  {
+    closeWavFile(&tracks[t]);
+    char filename[32];
+    snprintf(filename, sizeof(filename), "bench_track%d.wav", t + 1);
+    char *filePath = malloc(strlen(dirPath) + strlen(filename) + 2);
+    sprintf(filePath, "%s/%s", dirPath, filename);
+    remove(filePath);
+    free(filePath);
+  }
+  return false;
+}
+
+// Records trackCount tracks of seconds of audio into directoryPath through the
+// buffered and the direct I/O paths, then plays them back, and prints the throughput
+// of each. Writes go in DISK_WRITE_CHUNK_BYTES pieces and reads in
+// PREFETCH_CHUNK_BYTES pieces, the same sizes the disk writer and prefetcher use.
+void runTrackIOBenchmark(const char *directoryPath, int trackCount, float seconds)
+{
+  size_t bytesPerTrack = (size_t)(sampleRate * seconds) * (bitDepth / 8);
+  size_t totalBytes = bytesPerTrack * trackCount;
+  unsigned char *block = malloc(DISK_WRITE_CHUNK_BYTES > PREFETCH_CHUNK_BYTES ? DISK_WRITE_CHUNK_BYTES : PREFETCH_CHUNK_BYTES);
+  WavFile *tracks = calloc(trackCount, sizeof(WavFile));
+  char *dirPath = strdup(directoryPath);
+  if (block == NULL || tracks == NULL || dirPath == NULL)
+  {
+    printf("Memory allocation failed for the track I/O benchmark.\n");
+    free(block);
+    free(tracks);
+    free(dirPath);
     return;
   }
-  strcpy(appDirPath, selectedPath);
-  printf("App directory path set to: %s\n", appDirPath);
-  // reset time in seconds
+  bool savedDirectIO = useDirectIO;
+  double savedStartTime = startTimeInSeconds;
   startTimeInSeconds = 0;
-  // re-init tracks
-  initTracks(NULL);
-}
\ No newline at end of file
+  for (size_t i = 0; i < DISK_WRITE_CHUNK_BYTES; i++)
+  {
+    block[i] = (unsigned char)(i * 31);
+  }
+
+  printf("Track I/O benchmark: %d tracks x %.1f s (%.1f MB)\n", trackCount, seconds, totalBytes / 1e6);
+  for (int mode = 0; mode < 2; mode++)
+  {
+    bool direct = mode == 1;
+    struct timespec start;
+    char filename[32];
+
+    // record
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < trackCount; t++)
+    {
+      snprintf(filename, sizeof(filename), "bench_track%d.wav", t + 1);
+      char *filePath = malloc(strlen(dirPath) + strlen(filename) + 2);
+      sprintf(filePath, "%s/%s", dirPath, filename);
+      remove(filePath);
+      openWavFile(&tracks[t], filename, dirPath, 1);
+      if (direct && tracks[t].file != NULL)
+      {
+        fflush(tracks[t].file);
+        openDirectIO(&tracks[t], filePath);
+      }
+      free(filePath);
+    }
+    if (!benchmarkTracksOpen(tracks, trackCount, dirPath))
+    {
+      break;
+    }
+    for (size_t written = 0; written < bytesPerTrack; written += DISK_WRITE_CHUNK_BYTES)
+    {
+      size_t size = bytesPerTrack - written < DISK_WRITE_CHUNK_BYTES ? bytesPerTrack - written : DISK_WRITE_CHUNK_BYTES;
+      for (int t = 0; t < trackCount; t++)
+      {
+        writeWavData(&tracks[t], block, size);
+      }
+    }
+    for (int t = 0; t < trackCount; t++)
+    {
+      fflush(tracks[t].file);
+      if (tracks[t].direct.active)
+      {
+        flushDirectIO(&tracks[t]);
+      }
+      fsync(fileno(tracks[t].file)); // count the time to reach the disk, not just the cache
+      closeWavFile(&tracks[t]);
+    }
+    double writeTime = elapsedSeconds(start);
+
+    // play back
+    for (int t = 0; t < trackCount; t++)
+    {
+      snprintf(filename, sizeof(filename), "bench_track%d.wav", t + 1);
+      openWavFile(&tracks[t], filename, dirPath, 1);
+      if (tracks[t].file == NULL)
+      {
+        continue;
+      }
+#ifdef POSIX_FADV_DONTNEED
+      posix_fadvise(fileno(tracks[t].file), 0, 0, POSIX_FADV_DONTNEED); // start cold
+#endif
+      if (direct)
+      {
+        char *filePath = malloc(strlen(dirPath) + strlen(filename) + 2);
+        sprintf(filePath, "%s/%s", dirPath, filename);
+        openDirectIO(&tracks[t], filePath);
+        free(filePath);
+      }
+    }
+    if (!benchmarkTracksOpen(tracks, trackCount, dirPath))
+    {
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t readTotal = 0;
+    for (size_t offset = 0; offset < bytesPerTrack; offset += PREFETCH_CHUNK_BYTES)
+    {
+      size_t size = bytesPerTrack - offset < PREFETCH_CHUNK_BYTES ? bytesPerTrack - offset : PREFETCH_CHUNK_BYTES;
+      for (int t = 0; t < trackCount; t++)
+      {
+        readTotal += readTrackAt(&tracks[t], tracks[t].dataOffset + offset, block, size);
+      }
+    }
+    double readTime = elapsedSeconds(start);
+    for (int t = 0; t < trackCount; t++)
+    {
+      closeDirectIO(&tracks[t]);
+      fclose(tracks[t].file);
+      snprintf(filename, sizeof(filename), "bench_track%d.wav", t + 1);
+      char *filePath = malloc(strlen(dirPath) + strlen(filename) + 2);
+      sprintf(filePath, "%s/%s", dirPath, filename);
+      remove(filePath);
+      free(filePath);
+    }
+
+    printf("  %-8s write %8.1f MB/s   read %8.1f MB/s%s\n", direct ? "direct" : "buffered",
+           totalBytes / 1e6 / writeTime, readTotal / 1e6 / readTime,
+           readTotal == totalBytes ? "" : "   (short read)");
+  }
+
+  useDirectIO = savedDirectIO;
+  startTimeInSeconds = savedStartTime;
+  free(dirPath);
+  free(tracks);
+  free(block);
+}
+
+// Meters trackCount tracks of framesPerBuffer 24 bit samples iterations times, first
+// one track at a time with calculateRMS and then with the float bus path the callback
+// uses (toFloat per track, then one fused pass) with the scalar and the dispatched
+// metering kernels, and prints the time per callback block for each.
+void runMeterBenchmark(int trackCount, size_t framesPerBuffer, int iterations)
+{
+  const SampleKernels *int24 = &sampleKernelTable[SAMPLE_INT24];
+  unsigned char **inputs = calloc(trackCount, sizeof(unsigned char *));
+  float **buses = calloc(trackCount, sizeof(float *));
+  MeterReading *readings = calloc(trackCount, sizeof(MeterReading));
+  const SampleKernels *savedKernels = sampleKernels;
+  sampleKernels = int24; // calculateRMS decodes in the session format
+  dispatchSampleKernels();
+  dispatchMeterKernel();
+  for (int t = 0; t < trackCount; t++)
+  {
+    inputs[t] = malloc(framesPerBuffer * 3);
+    if (posix_memalign((void **)&buses[t], SCRATCH_ALIGNMENT, framesPerBuffer * sizeof(float)) != 0)
+    {
+      buses[t] = NULL;
+    }
+    if (inputs[t] == NULL || buses[t] == NULL)
+    {
+      printf("Error: Failed to allocate meter benchmark blocks.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < framesPerBuffer; i++)
+    {
+      int32_t sample = (int32_t)(sin((i + t * 97) * 0.05) * 8388607);
+      inputs[t][i * 3] = sample;
+      inputs[t][i * 3 + 1] = sample >> 8;
+      inputs[t][i * 3 + 2] = sample >> 16;
+    }
+  }
+
+  printf("Meter benchmark: %d tracks x %zu frames, %d blocks\n", trackCount, framesPerBuffer, iterations);
+  volatile float sink = 0; // keeps the scalar loop from being optimized away
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int n = 0; n < iterations; n++)
+  {
+    for (int t = 0; t < trackCount; t++)
+    {
+      sink += calculateRMS(inputs[t], framesPerBuffer);
+    }
+  }
+  double rmsTime = elapsedSeconds(start);
+
+  double busTime[2];
+  void (*kernels[2])(const float *const *, size_t, size_t, MeterReading *) = {meterBlocksScalar, meterBlocks};
+  for (int k = 0; k < 2; k++)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int n = 0; n < iterations; n++)
+    {
+      for (int t = 0; t < trackCount; t++)
+      {
+        int24->toFloat(inputs[t], buses[t], framesPerBuffer);
+      }
+      kernels[k]((const float *const *)buses, trackCount, framesPerBuffer, readings);
+      sink += readings[0].sumOfSquares;
+    }
+    busTime[k] = elapsedSeconds(start);
+  }
+
+  printf("  calculateRMS         %8.2f us/block\n", rmsTime / iterations * 1e6);
+  printf("  bus + scalar meter   %8.2f us/block   %5.2fx\n", busTime[0] / iterations * 1e6, rmsTime / busTime[0]);
+  printf("  bus + vector meter   %8.2f us/block   %5.2fx\n", busTime[1] / iterations * 1e6, rmsTime / busTime[1]);
+
+  sampleKernels = savedKernels;
+  for (int t = 0; t < trackCount; t++)
+  {
+    free(inputs[t]);
+    free(buses[t]);
+  }
+  free(inputs);
+  free(buses);
+  free(readings);
+}
@@ -1,46 +1,390 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#ifdef __linux__
+#define _GNU_SOURCE // fallocate and sync_file_range
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pwd.h>
 #include <termios.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSSE3 / AVX2 sample converters, picked at runtime
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include "../portaudio/include/portaudio.h"
 // macos specific
 #include <CoreAudio/CoreAudio.h>
 
 // SETUP
 char *appDirPath = NULL;
-float startTimeInSeconds = 0;
+double startTimeInSeconds = 0; // double keeps sample accuracy over a 60 hour reel
+float recordRingSeconds = 4; // how much audio each track can buffer ahead of the disk writer
+float playbackRingSeconds = 2; // how much audio the prefetcher keeps read ahead of the play head
+size_t bounceBlockFrames = 65536; // frames per track read and written in each bounce step
+bool useMappedPlayback = false; // prefetch from an mmap of each track instead of fread
+
+// where a session keeps its audio
+typedef enum
+{
+  STORAGE_TRACK_FILES, // one mono trackN.wav per track
+  STORAGE_REEL         // every track interleaved by time chunk in session.reel
+} SessionStorage;
+
+SessionStorage sessionStorage = STORAGE_TRACK_FILES;
+
+// how recorded data is pushed out of the page cache
+typedef enum
+{
+  WRITEBACK_KERNEL,   // leave it to the kernel
+  WRITEBACK_RANGE,    // start writeback of each new range and wait for the one before it
+  WRITEBACK_DATASYNC  // fdatasync every writebackIntervalBytes
+} WritebackMode;
+
+WritebackMode writebackMode = WRITEBACK_KERNEL;
+size_t writebackIntervalBytes = 8 * 1024 * 1024;
+bool dropPersistedPages = false; // posix_fadvise(DONTNEED) ranges once they are on disk
+float expectedTakeSeconds = 0;   // disk space reserved for armed tracks at the start of a take
+bool useDirectIO = false;        // bypass the page cache for track files (O_DIRECT / F_NOCACHE)
+float headerCheckpointSeconds = 2; // how often the disk writer rewrites header sizes while recording
 int sampleRate = 48000;
-short bitDepth = 24;
+short bitDepth = 24; // container size of the session's sample format, kept in step by setSampleFormat
 PaStream *stream;
 int frames = 256;
 bool isRecording;
+int bounceDestinationTrack = -1; // track that records the sum of the bounce sources, -1 for none
+bool bouncingToTrack = false;    // this pass records bounceDestinationTrack from the sources
 AudioDeviceID currentDefaultMacOSInputDevice;
 AudioDeviceID currentDefaultMacOSOutputDevice;
 
+// sample format of a session, used for tracks, the stream and bounces alike
+typedef enum
+{
+  SAMPLE_INT16,
+  SAMPLE_INT24,
+  SAMPLE_INT32,
+  SAMPLE_FLOAT32,
+  SAMPLE_FORMAT_COUNT
+} SampleFormat;
+
+// per-format loops, each specialised for its format at compile time so that no
+// loop branches on the format per sample
+typedef struct
+{
+  size_t bytesPerSample;
+  PaSampleFormat paFormat;
+  uint16_t formatTag; // WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+  float (*rms)(const unsigned char *buffer, size_t frames);
+  void (*toFloat)(const unsigned char *source, float *destination, size_t count);
+  void (*fromFloat)(const float *source, unsigned char *destination, size_t count);
+  void (*fromInt32)(const int32_t *source, unsigned char *destination, size_t count); // left aligned samples
+} SampleKernels;
+
+SampleFormat sampleFormat = SAMPLE_INT24;
+
+// single producer (audio thread) / single consumer (disk thread) byte ring
+typedef struct
+{
+  unsigned char *data;
+  size_t capacity;
+  _Atomic size_t writeIndex; // total bytes ever written, wraps via % capacity
+  _Atomic size_t readIndex;  // total bytes ever read
+  _Atomic size_t peakFill;   // high water mark since the last reset
+  _Atomic size_t overflowCount;
+} RingBuffer;
+
+// file ranges written since the last sync, and the range synced before that
+typedef struct
+{
+  off_t pendingStart;
+  off_t pendingEnd;
+  off_t previousStart;
+  off_t previousEnd;
+} WritebackState;
+
+// aligned staging for direct I/O. Transfers always cover whole aligned blocks, so
+// partial blocks at either end are read back first and merged.
+typedef struct
+{
+  bool active;
+  int fd;                 // second descriptor on the track opened for direct I/O
+  unsigned char *staging; // DIRECT_IO_STAGING_BYTES, block aligned
+  off_t stagingOffset;    // file offset of staging[0], block aligned
+  size_t stagingFill;     // bytes of staging holding valid data
+  off_t initialFileSize;  // file size before the first direct write
+} DirectIO;
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+// sample layout of a WAV file's audio, from its fmt chunk
+typedef struct
+{
+  uint16_t formatTag; // PCM or IEEE float; extensible files report their subformat
+  uint16_t channels;
+  uint32_t sampleRate;
+  uint16_t bitsPerSample; // container size of one sample
+  uint16_t blockAlign;    // bytes per frame
+} WavFormat;
+
+// where the audio of a WAV file is, as read from (or written to) its header
+typedef struct
+{
+  size_t dataOffset; // first byte of the data chunk's payload
+  size_t ds64Offset; // ds64 chunk or the JUNK chunk reserved for it, 0 if neither
+  uint64_t dataSize; // as the header states it, 64 bit for RF64 files
+  WavFormat format;
+} WavLayout;
+
+// what happens to a track file whose format differs from the session's
+typedef enum
+{
+  FORMAT_MISMATCH_REFUSE, // leave the file alone; the track stays silent and cannot record
+  FORMAT_MISMATCH_CONVERT // rewrite it in the session format, keeping the original beside it
+} FormatMismatchPolicy;
+
+FormatMismatchPolicy formatMismatchPolicy = FORMAT_MISMATCH_REFUSE;
+
+// what one metering pass measures for one block of bus samples
+typedef struct
+{
+  float peak;         // largest absolute sample
+  float sumOfSquares; // divide by the frame count and take the root for RMS
+  uint32_t clipCount; // samples at or past METER_CLIP_LEVEL
+} MeterReading;
+
 typedef struct
 {
   FILE *file;
-  size_t dataSize; // not including header
+  size_t dataOffset;         // where the audio data starts in the file
+  size_t ds64Offset;         // see WavLayout
+  WavFormat format;          // cached from the header when the file was opened
+  bool headerStale;          // audio was written since open, so the sizes need rewriting
+  _Atomic uint64_t dataSize; // not including header
+  uint64_t editStart;        // data bytes written since open, for the edit journal
+  uint64_t editEnd;          // (editStart == editEnd when nothing was written)
   float currentAmplitudeLevel;
+  float currentPeakLevel;         // dBFS peak of the last callback block
+  _Atomic size_t clippedSamples; // full scale samples metered since the stream started
   bool recordEnabled;
+  float bounceGain;        // into bounceDestinationTrack, 0 when the track is not a bounce source
+  RingBuffer recordRing;   // filled by the callback, drained by the disk writer
+  size_t recordMissingBytes; // dropped on overflow and still owed to recordRing as silence, callback only
+  RingBuffer playbackRing; // filled by the prefetcher, drained by the callback
+  size_t playbackMissingBytes; // zero filled on underrun and still to be skipped in playbackRing, callback only
+  uint64_t prefetchOffset; // next data byte the prefetcher will read
+  atomic_bool prefetchEnded;
+  _Atomic size_t playbackUnderrunCount;
+  _Atomic size_t writeFailureCount; // disk writer cycles that could not write all the queued audio
+  unsigned char *map; // read-only mapping of the whole file for mapped playback
+  size_t mapSize;
+  size_t mapAdvisedEnd;  // data bytes already covered by MADV_WILLNEED
+  size_t mapReleasedEnd; // data bytes already given back with MADV_DONTNEED
+  WritebackState writeback;
+  DirectIO direct;
+  off_t writePosition; // file offset of the next recorded byte
 } WavFile;
 
+// Single-file multitrack storage. After a fixed header the file is a sequence of
+// chunks, each holding chunkFrames of audio for every track as one block per track,
+// so a whole chunk is read or written with one I/O.
+typedef struct
+{
+  int fd;
+  int trackCount;
+  size_t chunkFrames;
+  size_t chunkBytes;
+  size_t allocatedChunks;
+  uint64_t *trackFrames;      // recorded length of each track
+  unsigned char *chunkBuffer; // one chunk, shared by the writer and prefetcher (never active together)
+  long cachedChunk;           // chunk currently held in chunkBuffer, -1 for none
+  uint64_t writeFrame;        // next frame the disk writer will store
+  uint64_t readFrame;         // next frame the prefetcher will load
+  uint64_t editFirst;         // frames stored since the reel was opened, journaled when the pass closes
+  uint64_t editEnd;
+  uint64_t exportedJournalLength; // edits.log length at the last export to track files
+  WritebackState writeback;
+} Reel;
+
+// fixed set of threads running queued tasks. Submitters wait on their own TaskGroup,
+// so several independent batches can share one pool.
+typedef struct
+{
+  size_t pending;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} TaskGroup;
+
+typedef struct WorkerTask
+{
+  void (*run)(void *arg);
+  void *arg;
+  TaskGroup *group;
+  struct WorkerTask *next;
+} WorkerTask;
+
+typedef struct
+{
+  pthread_t *threads;
+  int threadCount;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  WorkerTask *head;
+  WorkerTask *tail;
+  bool stopping;
+} WorkerPool;
+
+typedef enum
+{
+  IO_READ,
+  IO_WRITE
+} IoOp;
+
+// one positional transfer for one track. The two iovecs let a request cover both
+// halves of a wrapped ring in a single call.
+typedef struct
+{
+  IoOp op;
+  WavFile *track;
+  struct iovec iov[2];
+  int iovCount;
+  off_t offset;
+  ssize_t result; // bytes transferred, or -1
+} IoRequest;
+
+// realtime log events, pushed by the callback and printed by the logger thread
+typedef enum
+{
+  LOG_RECORD_LEVEL,
+  LOG_PLAYBACK_LEVEL,
+  LOG_RECORD_OVERFLOW,
+  LOG_PLAYBACK_UNDERRUN,
+  LOG_STREAM_STATUS,
+  LOG_CATEGORY_COUNT
+} LogCategory;
+
+typedef enum
+{
+  LOG_QUIET,        // dropped
+  LOG_RATE_LIMITED, // at most one line per channel every logIntervalMs
+  LOG_VERBOSE       // every event
+} LogVerbosity;
+
+typedef struct
+{
+  uint64_t frame; // play head position when the event happened
+  float value;
+  uint16_t channel;
+  uint8_t category;
+} LogEvent;
+
+// per-callback scratch memory, sized once when the stream is opened
+typedef struct
+{
+  unsigned char *base;
+  size_t size;
+  size_t used;
+} ScratchArena;
+
+// background conversion of one foreign WAV file into session tracks, one track
+// per source channel. Created by startImport, freed by finishImport.
+typedef struct
+{
+  char *sourcePath;
+  int sourceFd;
+  WavFormat source;
+  size_t sourceOffset;
+  uint64_t sourceFrames;
+  int firstTrack;  // zero based index of the track receiving the first channel
+  WavFile *outputs; // one per source channel
+  uint64_t outputFrames;
+  float *resampleTable; // NULL when the rates already match
+  _Atomic uint64_t framesDone;
+  atomic_bool failed;
+  atomic_bool finished;
+  pthread_t thread;
+} ImportJob;
+
+// one track feeding a mixdown
+typedef struct
+{
+  WavFile *track;
+  float leftGain; // gain and pan folded together
+  float rightGain;
+} MixInput;
+
+// a stereo mixdown running on bouncePool. Created by submitBounce, freed by
+// finishBounce; the UI refers to it by its slot in bounceJobs.
+typedef struct
+{
+  char *outputPath;
+  WavFile *sources; // read-only handles of its own, the transport's tracks are left alone
+  MixInput *inputs;
+  int *trackIndices; // session track behind each input
+  size_t inputCount;
+  uint64_t startFrame;
+  uint64_t frameCount; // length of the output
+  bool openEnded;      // runs to the end of the longest track rather than a fixed end
+  uint64_t *ranges;    // output frames to render, as start/end pairs; NULL renders all
+  size_t rangeCount;
+  uint64_t framesToRender;
+  uint64_t journalOffset; // length of the edit journal when the sources were opened
+  bool sourcesPending;     // opened by the job itself, after a reel session's track files are exported
+  _Atomic uint64_t framesDone;
+  uint64_t startedMs;
+  atomic_bool cancelled;
+  atomic_bool failed;
+  atomic_bool finished;
+  TaskGroup group; // just the job itself, so finishBounce can wait for it
+} BounceJob;
+
+// where exportMixdown writes each format; NULL skips that format
+typedef struct
+{
+  const char *wav24Path;
+  const char *wav16Path; // dithered and noise shaped
+  const char *flacPath;
+} ExportTargets;
+
+typedef struct
+{
+  bool trimSilence;       // drop the silence before the first and after the last sound
+  float silenceThreshold; // linear peak at or below which a sample counts as silence
+  float normalizePeak;    // linear peak each stem is scaled to, 0 keeps the recorded level
+} StemOptions;
+
+// how fast an offline render went; factors are seconds of audio per second taken
+typedef struct
+{
+  uint64_t frames;
+  double seconds;       // the whole pass, disk included
+  double engineSeconds; // inside the engine alone
+  double realtimeFactor;
+  double engineRealtimeFactor;
+} RenderStats;
+
 typedef struct
 {
   WavFile *tracks;
   int trackCount;
-  int playbackPosition;      // Current playback position in the buffer
+  uint64_t playbackPosition; // Current playback position in frames
 } Recorder;
 
 Recorder recorder = {NULL, 0, 0}; // Initializer ensures tracks is NULL
@@ -48,6 +392,8 @@ Recorder recorder = {NULL, 0, 0}; // Initializer ensures tracks is NULL
 // functions
 void initAudio();
 void cleanupAudio();
+void initOfflineEngine(int trackCount);
+void cleanupOfflineEngine();
 void onStop();
 void onStart(const uint32_t *inputTrackRecordEnabledStates, bool isRecordingFromUI);
 void onRewind();
@@ -56,8 +402,54 @@ void onRtz();
 float getCurrentStartTimeInSeconds();
 int getInputTrackCount();
 float getCurrentAmplitude(unsigned int index);
+float getCurrentPeak(unsigned int index);
+size_t getClippedSampleCount(unsigned int index);
 void onSetInputTrackRecordEnabled(unsigned int index, bool state);
 int bounceTracks(const uint32_t *tracksToBounce, char *selectedPath);
+int submitStereoBounce(const uint32_t *tracksToBounce, const char *selectedPath);
+int mixdownTracks(const uint32_t *tracksToMix, const float *gains, const float *pans, char *selectedPath);
+int submitBounce(const uint32_t *tracksToMix, const float *gains, const float *pans, double startSeconds, double endSeconds, const char *selectedPath);
+float getBounceProgress(int handle);
+float getBounceSecondsRemaining(int handle);
+bool isBounceFinished(int handle);
+void cancelBounce(int handle);
+int finishBounce(int handle);
+int submitRebounce(const char *bouncePath);
+int exportPolyphonicWav(char *selectedPath);
+int exportMixdown(const uint32_t *tracksToMix, const float *gains, const float *pans, const ExportTargets *targets);
+int renderOffline(const uint32_t *recordEnabledStates, const char *inputPath, const char *outputPath, double seconds,
+                  RenderStats *stats);
+int sessionTrackCount(const char *directoryPath);
+int exportStems(const uint32_t *tracksToExport, const char *directoryPath, const StemOptions *options);
 void onSetAppDirPath(const char *selectedPath);
+void setRecordRingSeconds(float seconds);
+float getRecordRingFillLevel(unsigned int index);
+float getRecordRingPeakFillLevel(unsigned int index);
+size_t getRecordRingOverflowCount(unsigned int index);
+size_t getRecordWriteFailureCount(unsigned int index);
+void setPlaybackRingSeconds(float seconds);
+size_t getPlaybackUnderrunCount(unsigned int index);
+void setBounceBlockFrames(size_t frames);
+void setTrackBounce(const uint32_t *sourceTracks, const float *gains, int destinationTrack);
+void clearTrackBounce();
+void setMappedPlayback(bool enabled);
+void setSessionStorage(SessionStorage storage);
+int exportReelToTrackFiles();
+void setWritebackPolicy(WritebackMode mode, size_t intervalBytes, bool dropPages);
+void setExpectedTakeSeconds(float seconds);
+void setDirectIO(bool enabled);
+void setHeaderCheckpointSeconds(float seconds);
+int recoverTrackFiles(const char *directoryPath);
+void setFormatMismatchPolicy(FormatMismatchPolicy policy);
+void setSampleFormat(SampleFormat format);
+ImportJob *startImport(const char *filePath, int firstTrack);
+float getImportProgress(ImportJob *job);
+bool isImportFinished(ImportJob *job);
+int finishImport(ImportJob *job);
+void setIoEngineThreads(int threadCount);
+void runTrackIOBenchmark(const char *directoryPath, int trackCount, float seconds);
+void runMeterBenchmark(int trackCount, size_t framesPerBuffer, int iterations);
+void setLogVerbosity(LogCategory category, LogVerbosity verbosity);
+void setLogIntervalMs(unsigned int intervalMs);
 
 #endif
@@ -1,4 +1,4 @@
-#include "audio.h"
+#include "audio.c" // audio.h defines the engine globals, so the engine is built into this file
 
 // Function to check if a key was pressed
 bool keyPressed()
@@ -70,4 +70,288 @@ void inputStartTime()
 //   onStopPlaying();
 
 //   cleanupAudio();
-// }
\ No newline at end of file
+// }
+
+// COMMANDS
+// tape_sim_cli import <session dir> <first track> <file.wav> [file.wav ...]
+//   converts each file into session tracks, starting at <first track> (1 based)
+//   and moving on by one track per channel. All files convert at the same time.
+int runImport(int argc, char **argv)
+{
+  if (argc < 5)
+  {
+    printf("usage: %s import <session dir> <first track> <file.wav> [file.wav ...]\n", argv[0]);
+    return 1;
+  }
+  onSetAppDirPath(argv[2]);
+
+  int fileCount = argc - 4;
+  ImportJob **jobs = calloc(fileCount, sizeof(ImportJob *));
+  int nextTrack = atoi(argv[3]) - 1;
+  int started = 0;
+  for (int i = 0; i < fileCount; i++)
+  {
+    jobs[i] = startImport(argv[4 + i], nextTrack);
+    if (jobs[i] != NULL)
+    {
+      nextTrack += jobs[i]->source.channels;
+      started++;
+    }
+  }
+
+  bool running = started > 0;
+  while (running)
+  {
+    running = false;
+    float progress = 0;
+    for (int i = 0; i < fileCount; i++)
+    {
+      if (jobs[i] != NULL)
+      {
+        running = running || !isImportFinished(jobs[i]);
+        progress += getImportProgress(jobs[i]) / started;
+      }
+    }
+    printf("\rImporting: %3.0f%%", progress * 100);
+    fflush(stdout);
+    usleep(100000);
+  }
+  printf("\n");
+
+  int failures = fileCount - started;
+  for (int i = 0; i < fileCount; i++)
+  {
+    if (jobs[i] != NULL && finishImport(jobs[i]) < 0)
+    {
+      failures++;
+    }
+  }
+  free(jobs);
+  return failures > 0 ? 1 : 0;
+}
+
+// tape_sim_cli export <session dir> <out.wav>
+//   writes every track of the session into one polyphonic wav
+int runExport(int argc, char **argv)
+{
+  if (argc < 4)
+  {
+    printf("usage: %s export <session dir> <out.wav>\n", argv[0]);
+    return 1;
+  }
+  onSetAppDirPath(argv[2]);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int result = exportPolyphonicWav(argv[3]);
+  double seconds = elapsedSeconds(start);
+  if (result == 0)
+  {
+    struct stat exported;
+    stat(argv[3], &exported);
+    printf("Exported %d tracks, %.1f MB in %.2f s (%.1f MB/s)\n", recorder.trackCount, exported.st_size / 1e6, seconds,
+           exported.st_size / 1e6 / seconds);
+  }
+  return result;
+}
+
+int runMaster(int argc, char **argv)
+{
+  if (argc < 4)
+  {
+    printf("usage: %s master <session dir> <name>\n", argv[0]);
+    return 1;
+  }
+  onSetAppDirPath(argv[2]);
+
+  // every track the session has a file for
+  uint32_t *tracksToMix = malloc(recorder.trackCount * sizeof(uint32_t));
+  for (int i = 0; i < recorder.trackCount; i++)
+  {
+    char *filePath = trackFilePath(i);
+    tracksToMix[i] = access(filePath, F_OK) == 0;
+    free(filePath);
+  }
+  char *paths[3];
+  const char *suffixes[3] = {".wav", "-16.wav", ".flac"};
+  for (int i = 0; i < 3; i++)
+  {
+    paths[i] = malloc(strlen(argv[3]) + strlen(suffixes[i]) + 1);
+    sprintf(paths[i], "%s%s", argv[3], suffixes[i]);
+  }
+  ExportTargets targets = {paths[0], paths[1], paths[2]};
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int result = exportMixdown(tracksToMix, NULL, NULL, &targets);
+  double seconds = elapsedSeconds(start);
+  if (result == 0)
+  {
+    printf("Mastered to %s, %s and %s in %.2f s\n", paths[0], paths[1], paths[2], seconds);
+  }
+  for (int i = 0; i < 3; i++)
+  {
+    free(paths[i]);
+  }
+  free(tracksToMix);
+  return result;
+}
+
+int runStems(int argc, char **argv)
+{
+  if (argc < 4)
+  {
+    printf("usage: %s stems <session dir> <out dir> [--trim] [--normalize <dBFS>]\n", argv[0]);
+    return 1;
+  }
+  StemOptions options = {false, 0, 0};
+  for (int i = 4; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--trim") == 0)
+    {
+      options.trimSilence = true;
+    }
+    else if (strcmp(argv[i], "--normalize") == 0 && i + 1 < argc)
+    {
+      options.normalizePeak = powf(10, atof(argv[++i]) / 20);
+    }
+  }
+  onSetAppDirPath(argv[2]);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int result = exportStems(NULL, argv[3], &options);
+  if (result == 0)
+  {
+    printf("Exported stems to %s in %.2f s\n", argv[3], elapsedSeconds(start));
+  }
+  return result;
+}
+
+int runRender(int argc, char **argv)
+{
+  if (argc < 3)
+  {
+    printf("usage: %s render <session dir> [--in <input.wav>] [--out <output.wav>] [--seconds <s>] [--tracks <n>]\n", argv[0]);
+    return 1;
+  }
+  const char *inputPath = NULL;
+  const char *outputPath = NULL;
+  double seconds = 0;
+  int trackCount = 0;
+  for (int i = 3; i + 1 < argc; i += 2)
+  {
+    if (strcmp(argv[i], "--in") == 0)
+    {
+      inputPath = argv[i + 1];
+    }
+    else if (strcmp(argv[i], "--out") == 0)
+    {
+      outputPath = argv[i + 1];
+    }
+    else if (strcmp(argv[i], "--seconds") == 0)
+    {
+      seconds = atof(argv[i + 1]);
+    }
+    else if (strcmp(argv[i], "--tracks") == 0)
+    {
+      trackCount = atoi(argv[i + 1]);
+    }
+  }
+
+  // no device here: the tracks are as many as asked for, or the input has
+  // channels, or the session has files
+  WavLayout input;
+  int inputFd = inputPath != NULL ? open(inputPath, O_RDONLY) : -1;
+  if (trackCount <= 0 && inputFd != -1 && readWavLayout(inputFd, &input))
+  {
+    trackCount = input.format.channels;
+  }
+  if (inputFd != -1)
+  {
+    close(inputFd);
+  }
+  if (trackCount <= 0)
+  {
+    trackCount = sessionTrackCount(argv[2]);
+  }
+  if (trackCount <= 0)
+  {
+    printf("Error: %s has no tracks, give --tracks or an --in file.\n", argv[2]);
+    return 1;
+  }
+  initOfflineEngine(trackCount);
+  onSetAppDirPath(argv[2]);
+
+  // with an input every track records from its channel, otherwise the session plays
+  uint32_t *armed = NULL;
+  if (inputPath != NULL)
+  {
+    armed = malloc(recorder.trackCount * sizeof(uint32_t));
+    for (int i = 0; i < recorder.trackCount; i++)
+    {
+      armed[i] = 1;
+    }
+  }
+  RenderStats stats;
+  int result = renderOffline(armed, inputPath, outputPath, seconds, &stats);
+  if (result == 0)
+  {
+    printf("Rendered %.1f s of %d tracks in %.2f s: %.1fx realtime, engine alone %.1fx\n", (double)stats.frames / sampleRate,
+           recorder.trackCount, stats.seconds, stats.realtimeFactor, stats.engineRealtimeFactor);
+  }
+  free(armed);
+  return result;
+}
+
+void printUsage(const char *program)
+{
+  printf("usage: %s import <session dir> <first track> <file.wav> [file.wav ...]\n", program);
+  printf("       %s export <session dir> <out.wav>\n", program);
+  printf("       %s master <session dir> <name>\n", program);
+  printf("       %s stems <session dir> <out dir> [--trim] [--normalize <dBFS>]\n", program);
+  printf("       %s render <session dir> [--in <input.wav>] [--out <output.wav>] [--seconds <s>] [--tracks <n>]\n", program);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  // render runs without a device, so it sets the engine up itself
+  if (strcmp(argv[1], "render") == 0)
+  {
+    int status = runRender(argc, argv);
+    cleanupOfflineEngine();
+    return status;
+  }
+
+  initAudio();
+  int status = 1;
+  if (strcmp(argv[1], "import") == 0)
+  {
+    status = runImport(argc, argv);
+  }
+  else if (strcmp(argv[1], "export") == 0)
+  {
+    status = runExport(argc, argv);
+  }
+  else if (strcmp(argv[1], "master") == 0)
+  {
+    status = runMaster(argc, argv);
+  }
+  else if (strcmp(argv[1], "stems") == 0)
+  {
+    status = runStems(argc, argv);
+  }
+  else
+  {
+    printf("Unknown command: %s\n", argv[1]);
+    printUsage(argv[0]);
+  }
+  cleanupAudio();
+  return status;
+}
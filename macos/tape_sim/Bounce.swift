@@ -9,31 +9,77 @@ import SwiftUI
 
 struct BounceView: View {
     @State private var selectedTracks: [Bool]
+    @State private var bounceHandle: Int32 = -1
+    @State private var progress: Float = 0
+    @State private var secondsRemaining: Float = -1
+    @State private var statusMessage = ""
+    private var progressTimer = Timer.publish(every: 0.1, on: .main, in: .common).autoconnect()
     
     init() {
         _selectedTracks = State(initialValue: [Bool](repeating: false, count: Int(getInputTrackCount())))
     }
 
     var body: some View {
-		Text("Please select two tracks to mix into a stereo output wav file")
-		.padding()
-		
-        List(0..<selectedTracks.count, id: \.self) { index in
-            Toggle("Track \(index + 1)", isOn: $selectedTracks[index])
-				.onChange(of: selectedTracks[index]) { newValue in
-					if newValue {
-						if selectedTracks.filter({ $0 }).count > 2 {
-							selectedTracks[index] = false // Automatically unselect if more than 2
-						}
-					}
-				}
+        VStack {
+            Text("Select the tracks to mix into a stereo output wav file. Two tracks are panned hard left and right, any other selection is mixed centered.")
+                .padding()
+            
+            List(0..<selectedTracks.count, id: \.self) { index in
+                Toggle("Track \(index + 1)", isOn: $selectedTracks[index])
+            }
+            
+            if bounceHandle >= 0 {
+                ProgressView(value: progress) {
+                    Text(secondsRemaining < 0 ? "Bouncing..." : String(format: "Bouncing... %.0f s left", secondsRemaining))
+                }
+                .padding()
+                Button("Cancel") {
+                    cancelBounce(bounceHandle)
+                }
+                .padding()
+            } else {
+                Button("Create Stereo Bounce") {
+                    showSavePanelAndBounce()
+                }
+                .padding()
+                .disabled(selectedTracks.filter({ $0 }).count == 0)
+            }
+            
+            if !statusMessage.isEmpty {
+                Text(statusMessage)
+                    .padding()
+            }
         }
-        
-        Button("Create Stereo Bounce") {
-            showSavePanelAndBounce()
+        .onReceive(progressTimer) { _ in
+            pollBounce()
+        }
+        .onDisappear {
+            stopBounce()
+        }
+    }
+    
+    // a bounce still running when the view goes away is cancelled and finished, so
+    // the job and its handle are freed; the wait happens off the main thread
+    private func stopBounce() {
+        guard bounceHandle >= 0 else { return }
+        let handle = bounceHandle
+        bounceHandle = -1
+        cancelBounce(handle)
+        DispatchQueue.global(qos: .utility).async {
+            _ = finishBounce(handle)
+        }
+    }
+    
+    // the bounce runs in the background; this only reads its progress
+    private func pollBounce() {
+        guard bounceHandle >= 0 else { return }
+        progress = getBounceProgress(bounceHandle)
+        secondsRemaining = getBounceSecondsRemaining(bounceHandle)
+        if isBounceFinished(bounceHandle) {
+            let result = finishBounce(bounceHandle)
+            statusMessage = result == 0 ? "Bounce finished." : "Bounce cancelled or failed."
+            bounceHandle = -1
         }
-        .padding()
-        .disabled(selectedTracks.filter({ $0 }).count != 2)
     }
     
     private func showSavePanelAndBounce() {
@@ -50,11 +96,11 @@ struct BounceView: View {
 					let selectedTracksAsInt = selectedTracks.map { $0 ? 1 : 0 }.map(UInt32.init)
 					selectedTracksAsInt.withUnsafeBufferPointer { bufferPointer in
 						if let baseAddress = bufferPointer.baseAddress {
-							// Create a mutable copy of the selectedPath string for the C function.
-							let cPath = strdup(selectedPath)
-							defer { free(cPath) }  // Ensure to free the allocated memory after use.
-							if let cPath = cPath {
-								bounceTracks(baseAddress, cPath)
+							statusMessage = ""
+							progress = 0
+							bounceHandle = submitStereoBounce(baseAddress, selectedPath)
+							if bounceHandle < 0 {
+								statusMessage = "Could not start the bounce."
 							}
 						}
 					}
@@ -63,4 +109,3 @@ struct BounceView: View {
 		}
 	}
 }
-